@@ -0,0 +1,145 @@
+/* hnswlib index loaded with all upper level link lists in one allocation */
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <hnswlib/hnswlib.h>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+// HierarchicalNSW::loadIndex mallocs the upper level link lists of every element above level 0 on
+// their own (one element in M has any, ~30k buffers for 1M GIST vectors at M = 32), so the load
+// makes that many allocations and the greedy descent hops between buffers wherever the allocator
+// put them. In a saved index those lists already follow each other, each behind its byte count,
+// after the level 0 block. ArenaHnsw reads that whole section with one read into one buffer and
+// points linkLists_ into it: one allocation, and the lists the descent reads are contiguous in id
+// order. The file format is unchanged. Everything else is loaded as hnswlib loads it and the
+// index is still a HierarchicalNSW that searches and the benchmarks take as one. Elements inserted
+// later get hnswlib's own buffers, the lists of loaded elements are rewritten in place as usual.
+
+class ArenaHnsw : public hnswlib::HierarchicalNSW<float> {
+public:
+	/// @brief load the index saved at `path` over `space`
+	/// @throw std::runtime_error if the file cannot be read or is not a saved index
+	ArenaHnsw(hnswlib::SpaceInterface<float>* space, const std::filesystem::path& path)
+		: hnswlib::HierarchicalNSW<float>(space) {
+		std::ifstream input(path, std::ios::binary);
+		if(!input) {
+			throw std::runtime_error(std::format("could not open filename {}", path.string()));
+		}
+		input.seekg(0, std::ios::end);
+		const size_t file_size = input.tellg();
+		input.seekg(0, std::ios::beg);
+
+		size_t count = 0;
+		read_pod(input, offsetLevel0_);
+		read_pod(input, max_elements_);
+		read_pod(input, count);
+		read_pod(input, size_data_per_element_);
+		read_pod(input, label_offset_);
+		read_pod(input, offsetData_);
+		read_pod(input, maxlevel_);
+		read_pod(input, enterpoint_node_);
+		read_pod(input, maxM_);
+		read_pod(input, maxM0_);
+		read_pod(input, M_);
+		read_pod(input, mult_);
+		read_pod(input, ef_construction_);
+		max_elements_ = std::max(max_elements_, count);
+
+		data_size_ = space->get_data_size();
+		fstdistfunc_ = space->get_dist_func();
+		dist_func_param_ = space->get_dist_func_param();
+		const size_t count_bytes = sizeof(hnswlib::linklistsizeint);
+		size_links_per_element_ = maxM_ * sizeof(hnswlib::tableint) + count_bytes;
+		size_links_level0_ = maxM0_ * sizeof(hnswlib::tableint) + count_bytes;
+		revSize_ = 1.0 / mult_;
+		ef_ = 10;
+
+		data_level0_memory_ = static_cast<char*>(malloc(max_elements_ * size_data_per_element_));
+		if(data_level0_memory_ == nullptr) {
+			throw std::runtime_error("not enough memory for the level 0 block");
+		}
+		input.read(data_level0_memory_, count * size_data_per_element_);
+		std::vector<std::mutex>(max_elements_).swap(link_list_locks_);
+		std::vector<std::mutex>(MAX_LABEL_OPERATION_LOCKS).swap(label_op_locks_);
+		visited_list_pool_ = std::make_unique<hnswlib::VisitedListPool>(1, max_elements_);
+		linkLists_ = static_cast<char**>(malloc(sizeof(void*) * max_elements_));
+		if(linkLists_ == nullptr) {
+			throw std::runtime_error("not enough memory for the link list pointers");
+		}
+		element_levels_ = std::vector<int>(max_elements_);
+
+		// the rest of the file: per element a uint32 byte count and that many bytes of lists
+		const std::streamoff section_start = input.tellg();
+		if(!input || section_start < 0 || static_cast<size_t>(section_start) > file_size) {
+			throw std::runtime_error(std::format("could not read index {}", path.string()));
+		}
+		arena_.resize(file_size - section_start);
+		input.read(arena_.data(), arena_.size());
+		if(!input) {
+			throw std::runtime_error(std::format("could not read index {}", path.string()));
+		}
+
+		size_t offset = 0;
+		for(size_t i = 0; i < count; i++) {
+			label_lookup_[getExternalLabel(i)] = i;
+			uint32_t bytes = 0;
+			if(offset + sizeof(bytes) > arena_.size()) {
+				throw std::runtime_error(std::format("index {} is truncated", path.string()));
+			}
+			std::memcpy(&bytes, arena_.data() + offset, sizeof(bytes));
+			offset += sizeof(bytes);
+			element_levels_[i] = bytes / size_links_per_element_;
+			linkLists_[i] = bytes > 0 ? arena_.data() + offset : nullptr;
+			offset += bytes;
+		}
+		if(offset != arena_.size()) {
+			throw std::runtime_error(std::format("index {} is corrupted", path.string()));
+		}
+		cur_element_count = count;
+
+		for(size_t i = 0; i < count; i++) {
+			if(isMarkedDeleted(i)) {
+				num_deleted_ += 1;
+				if(allow_replace_deleted_) {
+					deleted_elements.insert(i);
+				}
+			}
+		}
+	}
+
+	ArenaHnsw(const ArenaHnsw&) = delete;
+	ArenaHnsw& operator=(const ArenaHnsw&) = delete;
+
+	/// @brief hnswlib frees the list of every element above level 0, the ones in the arena are
+	/// not its to free
+	~ArenaHnsw() {
+		const char* begin = arena_.data();
+		const char* end = begin + arena_.size();
+		for(size_t i = 0; i < cur_element_count; i++) {
+			if(linkLists_[i] >= begin && linkLists_[i] < end) {
+				linkLists_[i] = nullptr;
+			}
+		}
+	}
+
+	/// @brief bytes of the arena, byte counts included
+	size_t arena_bytes() const {
+		return arena_.size();
+	}
+
+private:
+	template <typename T>
+	static void read_pod(std::istream& in, T& value) {
+		in.read(reinterpret_cast<char*>(&value), sizeof(T));
+	}
+
+	std::vector<char> arena_;
+};
@@ -0,0 +1,280 @@
+/* Common interface over the ANN libraries we compare, so they share queries, timing and recall */
+#pragma once
+
+#include <faiss/IndexFlat.h>
+#include <faiss/IndexHNSW.h>
+#include <faiss/IndexIVF.h>
+#include <faiss/IndexIVFFlat.h>
+#include <faiss/IndexIVFPQ.h>
+#include <format>
+#include <hnswlib/hnswlib.h>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lib/distance.hpp"
+#include "lib/embeddings.hpp"
+#include "lib/half.hpp"
+#include "lib/recall.hpp"
+#include "lib/utils.hpp"
+
+/// @brief backend spec of the form `kind,key=value,key=value`, e.g. `ivf_pq,nlist=4096,m=96`
+struct BackendSpec {
+	std::string kind;
+	std::map<std::string, std::string> params;
+
+	static BackendSpec parse(const std::string& spec) {
+		BackendSpec parsed;
+		std::stringstream ss(spec);
+		std::getline(ss, parsed.kind, ',');
+		std::string item;
+		while(std::getline(ss, item, ',')) {
+			const size_t eq = item.find('=');
+			if(eq == std::string::npos) {
+				throw std::runtime_error(std::format("expected key=value in '{}'", spec));
+			}
+			parsed.params[item.substr(0, eq)] = item.substr(eq + 1);
+		}
+		return parsed;
+	}
+
+	int get_int(const std::string& key, int default_value) const {
+		const auto it = params.find(key);
+		return it == params.end() ? default_value : std::stoi(it->second);
+	}
+
+	std::string get(const std::string& key, const std::string& default_value) const {
+		const auto it = params.find(key);
+		return it == params.end() ? default_value : it->second;
+	}
+};
+
+class AnnBackend {
+public:
+	virtual ~AnnBackend() = default;
+
+	/// @brief human readable name including the build parameters
+	virtual std::string name() const = 0;
+
+	/// @brief train (if needed) and add the base vectors, row i gets label i
+	virtual void build(const Embedding<float>& base) = 0;
+
+	/// @brief name of the knob that trades recall for speed ("ef", "nprobe" or "" if none)
+	virtual std::string search_param_name() const = 0;
+
+	virtual void set_search_param(int value) = 0;
+
+	/// @brief k nearest neighbors of one query, nearest first
+	virtual SearchResult search(const float* query, size_t k) const = 0;
+
+	/// @brief bytes held by the index structures (vectors, codes, graph, centroids)
+	virtual size_t memory_bytes() const = 0;
+};
+
+/// @brief hnswlib HierarchicalNSW, either built here or loaded from a saved index (`index=path`),
+/// over float vectors or half precision ones (`storage=fp16|bf16`, lib/half.hpp)
+class HnswlibBackend : public AnnBackend {
+public:
+	HnswlibBackend(const BackendSpec& spec, int dim)
+		: space_(dim)
+		, m_(spec.get_int("M", 32))
+		, ef_construction_(spec.get_int("efc", 200))
+		, index_path_(spec.get("index", ""))
+		, storage_(spec.get("storage", "fp32")) {
+		if(storage_ != "fp32") {
+			half_format_ = parse_half_format(storage_);
+			half_build_space_ = std::make_unique<HalfSpace>(dim, *half_format_, false);
+			half_query_space_ = std::make_unique<HalfSpace>(dim, *half_format_, true);
+		}
+		if(!index_path_.empty()) {
+			hnsw_ = std::make_unique<hnswlib::HierarchicalNSW<float>>(
+				half_format_ ? static_cast<hnswlib::SpaceInterface<float>*>(half_query_space_.get())
+							 : &space_,
+				index_path_);
+		}
+	}
+
+	std::string name() const override {
+		const std::string storage = half_format_ ? ",storage=" + storage_ : "";
+		return index_path_.empty()
+				   ? std::format("hnswlib,M={},efc={}{}", m_, ef_construction_, storage)
+				   : std::format("hnswlib,index={}{}", index_path_, storage);
+	}
+
+	void build(const Embedding<float>& base) override {
+		if(hnsw_) {
+			return;
+		}
+		if(half_format_) {
+			hnsw_ = std::make_unique<hnswlib::HierarchicalNSW<float>>(
+				half_build_space_.get(), base.nb, m_, ef_construction_);
+			ParallelFor(0, base.nb, 0, [&](size_t row, size_t) {
+				thread_local std::vector<uint16_t> half;
+				half.resize(base.dim);
+				to_half(base.data.get() + static_cast<size_t>(base.dim) * row,
+						base.dim,
+						*half_format_,
+						half.data());
+				hnsw_->addPoint(half.data(), row);
+			});
+			// inserts compare two stored vectors, searches a float query with a stored one
+			hnsw_->fstdistfunc_ = half_query_space_->get_dist_func();
+			return;
+		}
+		hnsw_ = std::make_unique<hnswlib::HierarchicalNSW<float>>(
+			&space_, base.nb, m_, ef_construction_);
+		ParallelFor(0, base.nb, 0, [&](size_t row, size_t) {
+			hnsw_->addPoint(base.data.get() + static_cast<size_t>(base.dim) * row, row);
+		});
+	}
+
+	std::string search_param_name() const override {
+		return "ef";
+	}
+
+	void set_search_param(int value) override {
+		hnsw_->setEf(value);
+	}
+
+	SearchResult search(const float* query, size_t k) const override {
+		return to_sorted_result(hnsw_->searchKnn(query, k));
+	}
+
+	size_t memory_bytes() const override {
+		size_t bytes = hnsw_->cur_element_count * hnsw_->size_data_per_element_;
+		for(size_t i = 0; i < hnsw_->cur_element_count; i++) {
+			bytes += hnsw_->size_links_per_element_ * hnsw_->element_levels_[i];
+		}
+		// per element lock and label lookup entry
+		bytes += hnsw_->max_elements_ * sizeof(std::mutex);
+		bytes +=
+			hnsw_->cur_element_count * (sizeof(hnswlib::labeltype) + sizeof(hnswlib::tableint));
+		return bytes;
+	}
+
+private:
+	DispatchedL2Space space_;
+	const int m_;
+	const int ef_construction_;
+	const std::string index_path_;
+	const std::string storage_;
+	std::optional<HalfFormat> half_format_;
+	std::unique_ptr<HalfSpace> half_build_space_;
+	std::unique_ptr<HalfSpace> half_query_space_;
+	std::unique_ptr<hnswlib::HierarchicalNSW<float>> hnsw_;
+};
+
+/// @brief faiss IndexFlatL2, IndexHNSWFlat, IndexIVFFlat and IndexIVFPQ
+class FaissBackend : public AnnBackend {
+public:
+	FaissBackend(const BackendSpec& spec, int dim)
+		: spec_(spec) {
+		if(spec.kind == "flat") {
+			index_ = std::make_unique<faiss::IndexFlatL2>(dim);
+		} else if(spec.kind == "faiss_hnsw") {
+			auto hnsw = std::make_unique<faiss::IndexHNSWFlat>(dim, spec.get_int("M", 32));
+			hnsw->hnsw.efConstruction = spec.get_int("efc", 200);
+			index_ = std::move(hnsw);
+		} else if(spec.kind == "ivf_flat") {
+			const int nlist = spec.get_int("nlist", 4096);
+			auto ivf =
+				std::make_unique<faiss::IndexIVFFlat>(new faiss::IndexFlatL2(dim), dim, nlist);
+			ivf->own_fields = true;
+			index_ = std::move(ivf);
+		} else if(spec.kind == "ivf_pq") {
+			const int nlist = spec.get_int("nlist", 4096);
+			const int m = spec.get_int("m", 96);
+			const int nbits = spec.get_int("nbits", 8);
+			auto ivf = std::make_unique<faiss::IndexIVFPQ>(
+				new faiss::IndexFlatL2(dim), dim, nlist, m, nbits);
+			ivf->own_fields = true;
+			index_ = std::move(ivf);
+		} else {
+			throw std::runtime_error(std::format("unknown backend '{}'", spec.kind));
+		}
+	}
+
+	std::string name() const override {
+		std::string name = spec_.kind;
+		for(const auto& [key, value] : spec_.params) {
+			name += std::format(",{}={}", key, value);
+		}
+		return name;
+	}
+
+	void build(const Embedding<float>& base) override {
+		if(!index_->is_trained) {
+			// kmeans subsamples to 256 points per centroid itself
+			index_->train(base.nb, base.data.get());
+		}
+		index_->add(base.nb, base.data.get());
+	}
+
+	std::string search_param_name() const override {
+		if(spec_.kind == "faiss_hnsw") {
+			return "ef";
+		}
+		if(spec_.kind == "ivf_flat" || spec_.kind == "ivf_pq") {
+			return "nprobe";
+		}
+		return "";
+	}
+
+	void set_search_param(int value) override {
+		hnsw_params_.efSearch = value;
+		ivf_params_.nprobe = value;
+	}
+
+	SearchResult search(const float* query, size_t k) const override {
+		std::vector<float> distances(k);
+		std::vector<faiss::idx_t> labels(k);
+
+		const faiss::SearchParameters* params = nullptr;
+		if(spec_.kind == "faiss_hnsw") {
+			params = &hnsw_params_;
+		} else if(spec_.kind != "flat") {
+			params = &ivf_params_;
+		}
+		index_->search(1, query, k, distances.data(), labels.data(), params);
+
+		SearchResult result;
+		result.reserve(k);
+		for(size_t i = 0; i < k && labels[i] >= 0; i++) {
+			result.emplace_back(distances[i], static_cast<hnswlib::labeltype>(labels[i]));
+		}
+		return result;
+	}
+
+	size_t memory_bytes() const override {
+		const size_t vectors = index_->ntotal * index_->d * sizeof(float);
+		if(spec_.kind == "flat") {
+			return vectors;
+		}
+		if(const auto* hnsw = dynamic_cast<const faiss::IndexHNSW*>(index_.get())) {
+			return vectors + hnsw->hnsw.neighbors.size() * sizeof(faiss::HNSW::storage_idx_t) +
+				   hnsw->hnsw.offsets.size() * sizeof(size_t) +
+				   hnsw->hnsw.levels.size() * sizeof(int);
+		}
+		const auto* ivf = dynamic_cast<const faiss::IndexIVF*>(index_.get());
+		return ivf->ntotal * (ivf->code_size + sizeof(faiss::idx_t)) +
+			   ivf->nlist * ivf->d * sizeof(float);
+	}
+
+private:
+	const BackendSpec spec_;
+	std::unique_ptr<faiss::Index> index_;
+	faiss::SearchParametersHNSW hnsw_params_;
+	faiss::SearchParametersIVF ivf_params_;
+};
+
+inline std::unique_ptr<AnnBackend> make_backend(const std::string& spec, int dim) {
+	const BackendSpec parsed = BackendSpec::parse(spec);
+	if(parsed.kind == "hnswlib") {
+		return std::make_unique<HnswlibBackend>(parsed, dim);
+	}
+	return std::make_unique<FaissBackend>(parsed, dim);
+}
@@ -0,0 +1,74 @@
+/* Binary codes of the vectors of an hnsw index, for a hamming prefilter of its searches */
+#pragma once
+
+#include <cstdint>
+#include <hnswlib/hnswlib.h>
+#include <vector>
+
+#include "lib/distance.hpp"
+
+// Bit d of a code is set if dim d of the vector is above the mean of dim d over the index: the
+// sign bits of the centered vector (GIST descriptors are non-negative, the sign bits of the raw
+// vectors would all be set). 960 dims are 15 words, 120 bytes per vector against 3840 for the
+// floats, kept by internal id next to the graph. The hamming distance of two codes grows with the
+// angle between the centered vectors and costs a popcount of 15 words, so a search can skip the
+// full l2 of neighbors whose code is far from the query's (SearchMode::prefilter).
+
+class BinaryCodes {
+public:
+	/// @brief the codes of the float vectors of `index`, `dim` dims each
+	BinaryCodes(const hnswlib::HierarchicalNSW<float>& index, size_t dim)
+		: dim_(dim)
+		, words_((dim + 63) / 64)
+		, mean_(dim, 0.0f) {
+		const size_t count = index.cur_element_count;
+		std::vector<double> sum(dim, 0.0);
+		for(size_t id = 0; id < count; id++) {
+			const float* v = vector(index, id);
+			for(size_t d = 0; d < dim; d++) {
+				sum[d] += v[d];
+			}
+		}
+		for(size_t d = 0; d < dim; d++) {
+			mean_[d] = count > 0 ? static_cast<float>(sum[d] / count) : 0.0f;
+		}
+
+		codes_.resize(count * words_);
+		for(size_t id = 0; id < count; id++) {
+			encode(vector(index, id), codes_.data() + id * words_);
+		}
+	}
+
+	/// @brief 64 bit words per code
+	size_t words() const {
+		return words_;
+	}
+
+	const uint64_t* code(hnswlib::tableint id) const {
+		return codes_.data() + id * words_;
+	}
+
+	/// @param out words() words
+	void encode(const float* x, uint64_t* out) const {
+		for(size_t w = 0; w < words_; w++) {
+			out[w] = 0;
+		}
+		for(size_t d = 0; d < dim_; d++) {
+			out[d / 64] |= static_cast<uint64_t>(x[d] > mean_[d]) << (d % 64);
+		}
+	}
+
+	size_t memory_bytes() const {
+		return codes_.size() * sizeof(uint64_t);
+	}
+
+private:
+	static const float* vector(const hnswlib::HierarchicalNSW<float>& index, size_t id) {
+		return reinterpret_cast<const float*>(index.getDataByInternalId(id));
+	}
+
+	size_t dim_;
+	size_t words_;
+	std::vector<float> mean_;
+	std::vector<uint64_t> codes_;
+};
@@ -0,0 +1,123 @@
+/* Helpers to push the index out of the cpu caches / page cache between queries */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <hnswlib/hnswlib.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "lib/isolation.hpp"
+
+enum class CacheMode {
+	warm, // back to back runs of the same query
+	evict, // stream a buffer larger than the llc between runs
+	pageout, // evict + ask the kernel to reclaim the index pages between runs
+	interleave, // run unrelated queries between runs
+};
+
+inline CacheMode parse_cache_mode(const std::string& name) {
+	if(name == "warm")
+		return CacheMode::warm;
+	if(name == "evict")
+		return CacheMode::evict;
+	if(name == "pageout")
+		return CacheMode::pageout;
+	if(name == "interleave")
+		return CacheMode::interleave;
+	throw std::runtime_error(std::format("unknown cache mode '{}'", name));
+}
+
+/// @brief size of the last level cache of cpu 0 in bytes
+/// @return 0 if sysfs does not expose it
+inline size_t last_level_cache_size() {
+	for(int index = 4; index >= 0; index--) {
+		const std::string size = read_first_line(
+			std::format("/sys/devices/system/cpu/cpu0/cache/index{}/size", index));
+		if(size == "unknown") {
+			continue;
+		}
+		size_t bytes = std::stoull(size);
+		if(size.ends_with('K')) {
+			bytes <<= 10;
+		} else if(size.ends_with('M')) {
+			bytes <<= 20;
+		}
+		return bytes;
+	}
+	return 0;
+}
+
+/// @brief evicts the cpu caches by writing and reading back a buffer several times the llc
+class CacheEvictor {
+public:
+	/// @param bytes buffer size, defaults to 4x the llc (64 MiB if unknown)
+	explicit CacheEvictor(size_t bytes = 0)
+		: size_(bytes != 0 ? bytes : std::max<size_t>(4 * last_level_cache_size(), 64 << 20))
+		, buffer_(std::make_unique<char[]>(size_)) {
+		std::memset(buffer_.get(), 1, size_);
+	}
+
+	/// @brief stream the whole buffer, returns a value so the loop is not optimized away
+	size_t evict() {
+		constexpr size_t CACHE_LINE = 64;
+		volatile char* ptr = buffer_.get();
+		size_t sum = 0;
+		for(size_t offset = 0; offset < size_; offset += CACHE_LINE) {
+			ptr[offset] = static_cast<char>(ptr[offset] + 1);
+			sum += ptr[offset];
+		}
+		return sum;
+	}
+
+	size_t size() const {
+		return size_;
+	}
+
+private:
+	size_t size_;
+	std::unique_ptr<char[]> buffer_;
+};
+
+/// @brief ask the kernel to reclaim the pages backing [addr, addr + bytes)
+/// @note pages are written to swap and faulted back in on next access, so this only has an
+/// effect with swap enabled and on memory that is not mlocked
+inline void pageout(const void* addr, size_t bytes) {
+	static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+	// madvise needs a page aligned start, only whole pages inside the range are reclaimed
+	const uintptr_t begin = (reinterpret_cast<uintptr_t>(addr) + page_size - 1) & ~(page_size - 1);
+	const uintptr_t end = (reinterpret_cast<uintptr_t>(addr) + bytes) & ~(page_size - 1);
+	if(end <= begin) {
+		return;
+	}
+	if(madvise(reinterpret_cast<void*>(begin), end - begin, MADV_PAGEOUT) != 0) {
+		throw std::runtime_error(std::format("madvise(MADV_PAGEOUT) failed: {}", std::strerror(errno)));
+	}
+}
+
+/// @brief reclaim level 0 of an hnsw index (upper levels are tiny and are left alone)
+template <typename dist_t>
+void pageout_hnsw(const hnswlib::HierarchicalNSW<dist_t>& hnsw) {
+	pageout(hnsw.data_level0_memory_, hnsw.cur_element_count * hnsw.size_data_per_element_);
+}
+
+/// @brief drop a file from the page cache so the next load reads it from disk
+inline void drop_file_cache(const std::filesystem::path& path) {
+	const int fd = open(path.c_str(), O_RDONLY);
+	if(fd < 0) {
+		throw std::runtime_error(std::format("could not open {}", path.string()));
+	}
+	const int err = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+	if(err != 0) {
+		throw std::runtime_error(std::format("posix_fadvise failed: {}", std::strerror(err)));
+	}
+}
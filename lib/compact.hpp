@@ -0,0 +1,684 @@
+/* Frozen hnsw index: read only, level 0 split into separate link, vector and label arrays */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <hnswlib/hnswlib.h>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lib/distance.hpp"
+
+// hnswlib keeps level 0 as one record per element: the link count, maxM0 neighbor ids, the vector
+// and the label, size_data_per_element_ bytes apart. Expanding a node reads the links of one record
+// and then the vectors of others, so every step drags in bytes it does not need (the vector after
+// the links, the links and label around a vector). CompactIndex holds the graph in three arrays:
+// the level 0 neighbors in CSR (an offset per element, uint32 ids back to back, no unused slots),
+// the vectors at a 64 byte aligned stride and the labels. search() is HnswSearcher's standard loop
+// over those arrays, so on the same graph it returns the same results and only the layout differs.
+//
+// It is frozen: the upper level link lists are packed into one array (a malloc per element in
+// hnswlib) and nothing a mutation needs is kept, neither the per element and label lock mutexes,
+// nor the label map, the deleted set or the visited list pool (search() keeps its visited tags
+// per thread). Built from a HierarchicalNSW or loaded straight from a saved index without one, it
+// takes no lock and any number of threads can search it at once.
+//
+// The level 0 links can also be compressed (LinkEncoding::vbyte). Each list is sorted and stored as
+// the differences between consecutive ids in stream vbyte: 1 to 4 bytes per value, with the lengths
+// in 2 bit fields of a control byte per four values. The search decodes a list before expanding
+// it, with a pshufb per four values on avx2 (kernels::decode_links_avx2). The differences are
+// only small if neighbors have close ids, so reorder() first renumbers the elements in breadth
+// first order of level 0 from the entry point. A sorted list is expanded in another order than
+// hnswlib's, which can change a few results. save() writes the whole index, reordered and encoded
+// or not, and load() reads it back (<index>.compact next to the hnswlib file, build_hnsw writes
+// it).
+
+/// @brief how a CompactIndex stores its level 0 links
+enum class LinkEncoding {
+	plain, // uint32 ids back to back
+	vbyte, // sorted, differences in stream vbyte (kernels::decode_links_scalar)
+};
+
+inline LinkEncoding parse_link_encoding(const std::string& name) {
+	if(name == "plain")
+		return LinkEncoding::plain;
+	if(name == "vbyte")
+		return LinkEncoding::vbyte;
+	throw std::runtime_error(std::format("unknown link encoding '{}'", name));
+}
+
+inline std::string link_encoding_name(LinkEncoding encoding) {
+	return encoding == LinkEncoding::vbyte ? "vbyte" : "plain";
+}
+
+class CompactIndex {
+public:
+	using Result = std::priority_queue<std::pair<float, hnswlib::labeltype>>;
+
+	static constexpr size_t ALIGNMENT = 64;
+
+	/// @brief freeze `index`: copy its graph, vectors and labels, its space must outlive the copy
+	explicit CompactIndex(const hnswlib::HierarchicalNSW<float>& index)
+		: CompactIndex(Header::of(index), index.fstdistfunc_, index.dist_func_param_) {
+		for(size_t id = 0; id < count_; id++) {
+			add_element(id, index.data_level0_memory_ + id * header_.record_size);
+			const size_t levels = index.element_levels_[id];
+			add_upper(id,
+					  reinterpret_cast<const hnswlib::tableint*>(index.linkLists_[id]),
+					  levels * (header_.max_m + 1));
+		}
+		links_.shrink_to_fit();
+	}
+
+	/// @brief load an index saved by HierarchicalNSW::saveIndex into the frozen layout without
+	/// building the HierarchicalNSW, or one written by save(). `space` (the one the index was
+	/// built with, or one over the same vectors) must outlive it.
+	/// @throw std::runtime_error if the file is not a saved index of vectors of `space`
+	static CompactIndex load(const std::filesystem::path& src,
+							 hnswlib::SpaceInterface<float>& space) {
+		std::ifstream fin(src, std::ios::binary);
+		if(!fin) {
+			throw std::runtime_error(std::format("could not open filename {}", src.string()));
+		}
+		// hnswlib's files start with offsetLevel0_, which is 0
+		uint64_t magic = 0;
+		Header::read_pod(fin, magic);
+		fin.seekg(0);
+		if(magic == MAGIC) {
+			return load_compact(fin, src, space);
+		}
+		const Header header = Header::read(fin, space.get_data_size());
+		if(!fin) {
+			throw std::runtime_error(std::format("could not read index {}", src.string()));
+		}
+		CompactIndex frozen(header, space.get_dist_func(), space.get_dist_func_param());
+
+		// level 0 in chunks of records, a copy of the whole block would double the peak memory
+		constexpr size_t CHUNK = 4096;
+		std::vector<char> records(CHUNK * header.record_size);
+		for(size_t first = 0; first < header.count; first += CHUNK) {
+			const size_t n = std::min(CHUNK, header.count - first);
+			fin.read(records.data(), n * header.record_size);
+			for(size_t i = 0; i < n; i++) {
+				frozen.add_element(first + i, records.data() + i * header.record_size);
+			}
+		}
+		std::vector<hnswlib::tableint> upper;
+		for(size_t id = 0; id < header.count && fin; id++) {
+			uint32_t bytes = 0;
+			fin.read(reinterpret_cast<char*>(&bytes), sizeof(bytes));
+			upper.resize(bytes / sizeof(hnswlib::tableint));
+			fin.read(reinterpret_cast<char*>(upper.data()), bytes);
+			frozen.add_upper(id, upper.data(), upper.size());
+		}
+		if(!fin) {
+			throw std::runtime_error(std::format("could not read index {}", src.string()));
+		}
+		frozen.links_.shrink_to_fit();
+		return frozen;
+	}
+
+	/// @brief magic, count, data size, max level, entry point, max_m and encoding as uint64, the
+	/// level 0 offsets, the size of the links in bytes and the links, the vectors (unpadded), the
+	/// labels, then the upper offsets and link lists
+	void save(const std::filesystem::path& dst) const {
+		std::ofstream fout(dst, std::ios::binary);
+		if(!fout) {
+			throw std::runtime_error(std::format("could not open filename {}", dst.string()));
+		}
+		const uint64_t header[7] = { MAGIC,
+									 count_,
+									 header_.data_size,
+									 static_cast<uint64_t>(header_.max_level),
+									 header_.entry_point,
+									 header_.max_m,
+									 static_cast<uint64_t>(encoding_) };
+		write(fout, header, 7);
+		write(fout, offsets_.data(), offsets_.size());
+		const uint64_t link_bytes = encoding_ == LinkEncoding::vbyte
+										? encoded_.size()
+										: links_.size() * sizeof(hnswlib::tableint);
+		write(fout, &link_bytes, 1);
+		if(encoding_ == LinkEncoding::vbyte) {
+			write(fout, encoded_.data(), encoded_.size());
+		} else {
+			write(fout, links_.data(), links_.size());
+		}
+		for(size_t id = 0; id < count_; id++) {
+			fout.write(static_cast<const char*>(vector(id)), header_.data_size);
+		}
+		write(fout, labels_.data(), labels_.size());
+		write(fout, upper_offsets_.data(), upper_offsets_.size());
+		write(fout, upper_links_.data(), upper_links_.size());
+		if(!fout) {
+			throw std::runtime_error(std::format("could not write index {}", dst.string()));
+		}
+	}
+
+	/// @brief renumber the elements in breadth first order of level 0 from the entry point
+	/// (elements it does not reach follow in id order), so neighbors get close ids. Labels and
+	/// results do not change. Copies the vectors once.
+	/// @throw std::runtime_error if the links are already encoded
+	void reorder() {
+		if(encoding_ != LinkEncoding::plain) {
+			throw std::runtime_error("a compact index is reordered before its links are encoded");
+		}
+		constexpr hnswlib::tableint NONE = UINT32_MAX;
+		// order[new id] = old id, position[old id] = new id
+		std::vector<hnswlib::tableint> order;
+		std::vector<hnswlib::tableint> position(count_, NONE);
+		order.reserve(count_);
+		const auto visit = [&](hnswlib::tableint id) {
+			if(position[id] == NONE) {
+				position[id] = order.size();
+				order.push_back(id);
+			}
+		};
+		size_t next_root = 0;
+		if(count_ > 0) {
+			visit(header_.entry_point);
+		}
+		for(size_t head = 0; head < count_; head++) {
+			if(head == order.size()) {
+				while(position[next_root] != NONE) {
+					next_root++;
+				}
+				visit(next_root);
+			}
+			const hnswlib::tableint id = order[head];
+			for(uint64_t j = offsets_[id]; j < offsets_[id + 1]; j++) {
+				visit(links_[j]);
+			}
+		}
+
+		std::vector<uint64_t> offsets(count_ + 1, 0);
+		std::vector<hnswlib::tableint> links;
+		links.reserve(links_.size());
+		std::unique_ptr<char[], FreeDeleter> vectors(static_cast<char*>(
+			std::aligned_alloc(ALIGNMENT, std::max(count_ * stride_, ALIGNMENT))));
+		if(vectors == nullptr) {
+			throw std::runtime_error("not enough memory to reorder the compact index");
+		}
+		std::vector<hnswlib::labeltype> labels(count_);
+		std::vector<uint64_t> upper_offsets(count_ + 1, 0);
+		std::vector<hnswlib::tableint> upper_links;
+		upper_links.reserve(upper_links_.size());
+		for(size_t id = 0; id < count_; id++) {
+			const hnswlib::tableint old = order[id];
+			for(uint64_t j = offsets_[old]; j < offsets_[old + 1]; j++) {
+				links.push_back(position[links_[j]]);
+			}
+			offsets[id + 1] = links.size();
+			std::memcpy(vectors.get() + id * stride_, vector(old), stride_);
+			labels[id] = labels_[old];
+
+			// a count and max_m ids per level, only the counted ones are ids
+			const size_t first = upper_links.size();
+			upper_links.insert(upper_links.end(),
+							   upper_links_.begin() + upper_offsets_[old],
+							   upper_links_.begin() + upper_offsets_[old + 1]);
+			for(size_t list = first; list < upper_links.size(); list += header_.max_m + 1) {
+				const size_t size = list_count(upper_links.data() + list);
+				for(size_t j = 1; j <= size; j++) {
+					upper_links[list + j] = position[upper_links[list + j]];
+				}
+			}
+			upper_offsets[id + 1] = upper_links.size();
+		}
+		header_.entry_point = count_ > 0 ? position[header_.entry_point] : 0;
+		offsets_ = std::move(offsets);
+		links_ = std::move(links);
+		vectors_ = std::move(vectors);
+		labels_ = std::move(labels);
+		upper_offsets_ = std::move(upper_offsets);
+		upper_links_ = std::move(upper_links);
+	}
+
+	/// @brief store the level 0 links in `encoding` from now on
+	/// @throw std::runtime_error if they are encoded already in another one
+	void encode_links(LinkEncoding encoding) {
+		if(encoding == encoding_) {
+			return;
+		}
+		if(encoding_ != LinkEncoding::plain) {
+			throw std::runtime_error("the links of a compact index are only encoded once");
+		}
+		std::vector<uint64_t> offsets(count_ + 1, 0);
+		std::vector<uint8_t> encoded;
+		std::vector<hnswlib::tableint> list;
+		for(size_t id = 0; id < count_; id++) {
+			list.assign(links_.begin() + offsets_[id], links_.begin() + offsets_[id + 1]);
+			std::sort(list.begin(), list.end());
+			append_vbyte(encoded, id, list);
+			offsets[id + 1] = encoded.size();
+		}
+		encoded.resize(encoded.size() + kernels::LINK_PADDING, 0);
+		offsets_ = std::move(offsets);
+		encoded_ = std::move(encoded);
+		links_ = {};
+		encoding_ = encoding;
+		update_max_degree();
+	}
+
+	LinkEncoding encoding() const {
+		return encoding_;
+	}
+
+	size_t size() const {
+		return count_;
+	}
+
+	/// @brief bytes of the level 0 arrays (offsets, links, vectors, labels)
+	size_t level0_bytes() const {
+		return link_bytes() + vector_bytes() + labels_.size() * sizeof(hnswlib::labeltype);
+	}
+
+	/// @brief the part of level0_bytes() that is links and their offsets
+	size_t link_bytes() const {
+		return offsets_.size() * sizeof(uint64_t) + links_.size() * sizeof(hnswlib::tableint) +
+			   encoded_.size();
+	}
+
+	/// @brief the part of level0_bytes() that is vectors, padding included
+	size_t vector_bytes() const {
+		return count_ * stride_;
+	}
+
+	/// @brief bytes of the upper levels (offsets and link lists)
+	size_t upper_bytes() const {
+		return upper_offsets_.size() * sizeof(uint64_t) +
+			   upper_links_.size() * sizeof(hnswlib::tableint);
+	}
+
+	/// @brief k nearest neighbors with `ef` (at least k) candidates on level 0
+	Result search(const float* query, size_t k, size_t ef) const {
+		Result result;
+		if(count_ == 0) {
+			return result;
+		}
+
+		// greedy descent, a neighbor only matters if it is closer than the current node
+		hnswlib::tableint current = header_.entry_point;
+		float current_dist = distance(query, current);
+		for(int level = header_.max_level; level > 0; level--) {
+			bool changed = true;
+			while(changed) {
+				changed = false;
+				const hnswlib::tableint* list = upper_list(current, level);
+				const size_t size = list_count(list);
+				const hnswlib::tableint* neighbors = list + 1;
+				for(size_t i = 0; i < size; i++) {
+					const float d = distance(query, neighbors[i]);
+					if(d < current_dist) {
+						current_dist = d;
+						current = neighbors[i];
+						changed = true;
+					}
+				}
+			}
+		}
+
+		Heap top = search_level0(query, current, current_dist, std::max(ef, k));
+		while(top.size() > k) {
+			top.pop();
+		}
+		while(!top.empty()) {
+			result.emplace(top.top().first, labels_[top.top().second]);
+			top.pop();
+		}
+		return result;
+	}
+
+private:
+	using Candidate = std::pair<float, hnswlib::tableint>;
+	using Heap = std::priority_queue<Candidate,
+									 std::vector<Candidate>,
+									 hnswlib::HierarchicalNSW<float>::CompareByFirst>;
+
+	/// @brief what the frozen layout needs of hnswlib's, read in the order saveIndex writes it
+	struct Header {
+		size_t count = 0;
+		// a level 0 record: links at level0_offset, the vector at data_offset, then the label
+		size_t record_size = 0;
+		size_t level0_offset = 0;
+		size_t data_offset = 0;
+		size_t label_offset = 0;
+		size_t data_size = 0;
+		int max_level = 0;
+		hnswlib::tableint entry_point = 0;
+		size_t max_m = 0;
+
+		static Header of(const hnswlib::HierarchicalNSW<float>& index) {
+			Header header;
+			header.count = index.cur_element_count;
+			header.record_size = index.size_data_per_element_;
+			header.level0_offset = index.offsetLevel0_;
+			header.data_offset = index.offsetData_;
+			header.label_offset = index.label_offset_;
+			header.data_size = index.data_size_;
+			header.max_level = index.maxlevel_;
+			header.entry_point = index.enterpoint_node_;
+			header.max_m = index.maxM_;
+			return header;
+		}
+
+		/// @brief sets the failbit of `in` if the records do not hold vectors of `data_size`
+		static Header read(std::istream& in, size_t data_size) {
+			Header header;
+			size_t max_elements = 0;
+			size_t max_m0 = 0;
+			size_t m = 0;
+			double mult = 0.0;
+			size_t ef_construction = 0;
+			read_pod(in, header.level0_offset);
+			read_pod(in, max_elements);
+			read_pod(in, header.count);
+			read_pod(in, header.record_size);
+			read_pod(in, header.label_offset);
+			read_pod(in, header.data_offset);
+			read_pod(in, header.max_level);
+			read_pod(in, header.entry_point);
+			read_pod(in, header.max_m);
+			read_pod(in, max_m0);
+			read_pod(in, m);
+			read_pod(in, mult);
+			read_pod(in, ef_construction);
+			header.data_size = data_size;
+			if(header.data_offset + data_size != header.label_offset ||
+			   header.label_offset + sizeof(hnswlib::labeltype) > header.record_size) {
+				in.setstate(std::ios::failbit);
+			}
+			return header;
+		}
+
+		template <typename T>
+		static void read_pod(std::istream& in, T& value) {
+			in.read(reinterpret_cast<char*>(&value), sizeof(T));
+		}
+	};
+
+	// "HNSWCMPT"
+	static constexpr uint64_t MAGIC = 0x54504d43574e5348;
+
+	template <typename T>
+	static void write(std::ostream& out, const T* data, size_t n) {
+		out.write(reinterpret_cast<const char*>(data), n * sizeof(T));
+	}
+
+	template <typename T>
+	static void read(std::istream& in, T* data, size_t n) {
+		in.read(reinterpret_cast<char*>(data), n * sizeof(T));
+	}
+
+	/// @brief the rest of load() for a file written by save()
+	static CompactIndex load_compact(std::istream& fin,
+									 const std::filesystem::path& src,
+									 hnswlib::SpaceInterface<float>& space) {
+		uint64_t fields[7] = {};
+		read(fin, fields, 7);
+		const size_t data_size = space.get_data_size();
+		if(!fin || fields[2] != data_size ||
+		   fields[6] > static_cast<uint64_t>(LinkEncoding::vbyte)) {
+			throw std::runtime_error(std::format("could not read index {}", src.string()));
+		}
+		Header header;
+		header.count = fields[1];
+		header.data_size = data_size;
+		header.max_level = static_cast<int>(fields[3]);
+		header.entry_point = static_cast<hnswlib::tableint>(fields[4]);
+		header.max_m = fields[5];
+		CompactIndex frozen(header, space.get_dist_func(), space.get_dist_func_param());
+		frozen.encoding_ = static_cast<LinkEncoding>(fields[6]);
+
+		read(fin, frozen.offsets_.data(), frozen.offsets_.size());
+		uint64_t link_bytes = 0;
+		read(fin, &link_bytes, 1);
+		if(!fin) {
+			throw std::runtime_error(std::format("could not read index {}", src.string()));
+		}
+		if(frozen.encoding_ == LinkEncoding::vbyte) {
+			frozen.encoded_.resize(link_bytes);
+			read(fin, frozen.encoded_.data(), link_bytes);
+		} else {
+			frozen.links_.resize(link_bytes / sizeof(hnswlib::tableint));
+			read(fin, frozen.links_.data(), frozen.links_.size());
+		}
+		for(size_t id = 0; id < header.count; id++) {
+			char* vector = frozen.vectors_.get() + id * frozen.stride_;
+			fin.read(vector, data_size);
+			std::memset(vector + data_size, 0, frozen.stride_ - data_size);
+		}
+		read(fin, frozen.labels_.data(), frozen.labels_.size());
+		read(fin, frozen.upper_offsets_.data(), frozen.upper_offsets_.size());
+		frozen.upper_links_.resize(frozen.upper_offsets_.back());
+		read(fin, frozen.upper_links_.data(), frozen.upper_links_.size());
+		const size_t links_end = frozen.encoding_ == LinkEncoding::vbyte
+									 ? frozen.offsets_.back() + kernels::LINK_PADDING
+									 : frozen.offsets_.back() * sizeof(hnswlib::tableint);
+		if(!fin || links_end != link_bytes) {
+			throw std::runtime_error(std::format("could not read index {}", src.string()));
+		}
+		frozen.update_max_degree();
+		return frozen;
+	}
+
+	/// @brief the longest level 0 list, the size of a buffer to decode one into
+	void update_max_degree() {
+		max_degree_ = 0;
+		for(size_t id = 0; id < count_; id++) {
+			size_t size = offsets_[id + 1] - offsets_[id];
+			if(encoding_ == LinkEncoding::vbyte) {
+				const uint8_t* list = encoded_.data() + offsets_[id];
+				size = list[0] | static_cast<size_t>(list[1]) << 8;
+			}
+			max_degree_ = std::max(max_degree_, size);
+		}
+	}
+
+	/// @brief the vbyte list of element `id` (kernels::decode_links_scalar), `list` sorted
+	static void append_vbyte(std::vector<uint8_t>& out,
+							 hnswlib::tableint id,
+							 const std::vector<hnswlib::tableint>& list) {
+		const size_t count = list.size();
+		out.push_back(static_cast<uint8_t>(count));
+		out.push_back(static_cast<uint8_t>(count >> 8));
+		const size_t groups = (count + kernels::LINK_GROUP - 1) / kernels::LINK_GROUP;
+		const size_t control = out.size();
+		out.resize(control + groups, 0);
+		for(size_t i = 0; i < groups * kernels::LINK_GROUP; i++) {
+			uint32_t value = 0;
+			if(i == 0) {
+				value = kernels::zigzag_encode(static_cast<int32_t>(list[0] - id));
+			} else if(i < count) {
+				value = list[i] - list[i - 1];
+			}
+			size_t bytes = 1;
+			while(bytes < 4 && value >> (8 * bytes) != 0) {
+				bytes++;
+			}
+			out[control + i / kernels::LINK_GROUP] |=
+				static_cast<uint8_t>((bytes - 1) << (2 * (i % kernels::LINK_GROUP)));
+			for(size_t b = 0; b < bytes; b++) {
+				out.push_back(static_cast<uint8_t>(value >> (8 * b)));
+			}
+		}
+	}
+
+	struct FreeDeleter {
+		void operator()(char* p) const {
+			std::free(p);
+		}
+	};
+
+	CompactIndex(const Header& header, hnswlib::DISTFUNC<float> distance, const void* param)
+		: header_(header)
+		, count_(header.count)
+		, stride_((header.data_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT)
+		, distance_(distance)
+		, distance_param_(param)
+		, offsets_(count_ + 1, 0)
+		, vectors_(static_cast<char*>(
+			  std::aligned_alloc(ALIGNMENT, std::max(count_ * stride_, ALIGNMENT))))
+		, labels_(count_)
+		, upper_offsets_(count_ + 1, 0)
+		, decode_(distance_kernels().decode_links) {
+		if(vectors_ == nullptr) {
+			throw std::runtime_error("not enough memory for the compact index vectors");
+		}
+	}
+
+	/// @brief the level 0 record of element `id`, elements are added in order
+	void add_element(size_t id, const char* record) {
+		const hnswlib::tableint* list =
+			reinterpret_cast<const hnswlib::tableint*>(record + header_.level0_offset);
+		const size_t size = list_count(list);
+		links_.insert(links_.end(), list + 1, list + 1 + size);
+		offsets_[id + 1] = offsets_[id] + size;
+
+		char* vector = vectors_.get() + id * stride_;
+		std::memcpy(vector, record + header_.data_offset, header_.data_size);
+		std::memset(vector + header_.data_size, 0, stride_ - header_.data_size);
+		std::memcpy(&labels_[id], record + header_.label_offset, sizeof(hnswlib::labeltype));
+	}
+
+	/// @brief the upper link lists of element `id` as hnswlib stores them (a count and max_m ids
+	/// per level, `size` words), elements are added in order
+	void add_upper(size_t id, const hnswlib::tableint* lists, size_t size) {
+		upper_links_.insert(upper_links_.end(), lists, lists + size);
+		upper_offsets_[id + 1] = upper_offsets_[id] + size;
+	}
+
+	const hnswlib::tableint* upper_list(hnswlib::tableint id, int level) const {
+		return upper_links_.data() + upper_offsets_[id] + (level - 1) * (header_.max_m + 1);
+	}
+
+	/// @brief hnswlib's getListCount, the low 16 bits of the first word
+	static size_t list_count(const hnswlib::tableint* list) {
+		return *reinterpret_cast<const unsigned short*>(list);
+	}
+
+	const void* vector(hnswlib::tableint id) const {
+		return vectors_.get() + id * stride_;
+	}
+
+	float distance(const float* query, hnswlib::tableint id) const {
+		return distance_(query, vector(id), distance_param_);
+	}
+
+	/// @brief a visited tag per element for the calling thread, the array is only cleared when
+	/// the tag wraps around
+	static hnswlib::vl_type* visited_tags(size_t count, hnswlib::vl_type& tag) {
+		thread_local std::vector<hnswlib::vl_type> tags;
+		thread_local hnswlib::vl_type current = 0;
+		if(tags.size() < count) {
+			tags.resize(count, 0);
+		}
+		if(++current == 0) {
+			std::fill(tags.begin(), tags.end(), 0);
+			current = 1;
+		}
+		tag = current;
+		return tags.data();
+	}
+
+	/// @brief HnswSearcher::search_level0<SearchMode::standard> on the CSR links
+	Heap search_level0(const float* query,
+					   hnswlib::tableint entry,
+					   float entry_dist,
+					   size_t ef) const {
+		hnswlib::vl_type tag = 0;
+		hnswlib::vl_type* visited = visited_tags(count_, tag);
+		// a decoded list, a vbyte decoder writes whole groups
+		thread_local std::vector<hnswlib::tableint> decoded;
+		if(decoded.size() < max_degree_ + kernels::LINK_GROUP) {
+			decoded.resize(max_degree_ + kernels::LINK_GROUP);
+		}
+
+		Heap top;
+		Heap candidates;
+		top.emplace(entry_dist, entry);
+		candidates.emplace(-entry_dist, entry);
+		visited[entry] = tag;
+		float lower_bound = entry_dist;
+
+		while(!candidates.empty()) {
+			const Candidate current = candidates.top();
+			if(-current.first > lower_bound) {
+				break;
+			}
+			candidates.pop();
+
+			const hnswlib::tableint* neighbors = links_.data() + offsets_[current.second];
+			size_t size = offsets_[current.second + 1] - offsets_[current.second];
+			if(encoding_ == LinkEncoding::vbyte) {
+				neighbors = decoded.data();
+				size = decode_(encoded_.data() + offsets_[current.second],
+							   current.second,
+							   decoded.data());
+			}
+			if(size == 0) {
+				continue;
+			}
+
+			__builtin_prefetch(visited + neighbors[0]);
+			__builtin_prefetch(vector(neighbors[0]));
+
+			for(size_t j = 0; j < size; j++) {
+				const hnswlib::tableint id = neighbors[j];
+				if(j + 1 < size) {
+					__builtin_prefetch(visited + neighbors[j + 1]);
+					__builtin_prefetch(vector(neighbors[j + 1]));
+				}
+				if(visited[id] == tag) {
+					continue;
+				}
+				visited[id] = tag;
+
+				const float d = distance(query, id);
+				if(top.size() < ef || d < lower_bound) {
+					candidates.emplace(-d, id);
+					top.emplace(d, id);
+					if(top.size() > ef) {
+						top.pop();
+					}
+					lower_bound = top.top().first;
+				}
+			}
+		}
+		return top;
+	}
+
+	Header header_;
+	size_t count_;
+	// bytes from one vector to the next, the vector size rounded up to the alignment
+	size_t stride_;
+	hnswlib::DISTFUNC<float> distance_;
+	const void* distance_param_;
+	LinkEncoding encoding_ = LinkEncoding::plain;
+	// plain: neighbors of element i are links_[offsets_[i], offsets_[i + 1]), vbyte: its list
+	// starts at encoded_[offsets_[i]], followed by LINK_PADDING bytes after the last one
+	std::vector<uint64_t> offsets_;
+	std::vector<hnswlib::tableint> links_;
+	std::vector<uint8_t> encoded_;
+	size_t max_degree_ = 0;
+	std::unique_ptr<char[], FreeDeleter> vectors_;
+	std::vector<hnswlib::labeltype> labels_;
+	// the upper link lists of element i, levels * (max_m + 1) words from upper_offsets_[i]
+	std::vector<uint64_t> upper_offsets_;
+	std::vector<hnswlib::tableint> upper_links_;
+	kernels::LinkDecodeFunction decode_;
+};
+
+/// @brief where the compact copy of the index at `index_path` is saved
+inline std::filesystem::path compact_index_path(const std::filesystem::path& index_path) {
+	return index_path.string() + ".compact";
+}
@@ -0,0 +1,247 @@
+/* Distance kernels for several ISA levels, the best one the cpu supports is picked at runtime */
+#pragma once
+
+#include <cstdlib>
+#include <format>
+#include <hnswlib/hnswlib.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lib/kernels/kernels.hpp"
+
+// hnswlib picks its SIMD kernels with #ifdef __AVX__ / __AVX512F__, i.e. from the flags the
+// benchmark is compiled with. Without -march that is SSE only, and with -march=native the binary
+// crashes on older hosts. The kernels here are compiled once per ISA level (lib/kernels/, each file
+// with its own -m flags) and selected with __builtin_cpu_supports when a space is created, so one
+// binary runs at the best level on every host. HNSW_ISA=<name> forces a lower level.
+//
+// All kernels have hnswlib's signature: (query, vector, size_t* dim) and handle any dim. For the
+// dims of the datasets we benchmark there are also kernels with the dim as a template parameter:
+// the trip count is a constant, there is no tail and the number of accumulators fits the dim. The
+// main loop unrolls by four, not completely: a fully unrolled 960 dim loop spills registers.
+
+/// @brief the float kernels of one ISA level
+struct DistanceKernels {
+	std::string isa;
+	hnswlib::DISTFUNC<float> l2;
+	hnswlib::DISTFUNC<float> ip;
+	// lookups of the dim specialized kernels, nullptr if the level has none
+	hnswlib::DISTFUNC<float> (*l2_fixed)(size_t dim) = nullptr;
+	hnswlib::DISTFUNC<float> (*ip_fixed)(size_t dim) = nullptr;
+	kernels::BoundedDistanceFunction l2_bounded = kernels::l2_sqr_bounded_scalar;
+	kernels::BatchDistanceFunction l2_batch = kernels::l2_sqr_batch_scalar;
+	// squared l2 of two sq8 codes, dist_func_param is a kernels::Sq8Param (lib/sq8.hpp)
+	hnswlib::DISTFUNC<float> sq8_l2 = kernels::sq8_l2_sqr_scalar;
+	// pq lookup table against a pq code, dist_func_param is a kernels::PqParam (lib/pq.hpp)
+	hnswlib::DISTFUNC<float> pq_adc = kernels::pq_adc_scalar;
+	// squared l2 over half precision vectors (lib/half.hpp), both stored and a float query against
+	// a stored one. fp16 conversion needs f16c, the sse level has bf16 kernels only.
+	hnswlib::DISTFUNC<float> bf16_l2 = kernels::l2_sqr_bf16_scalar;
+	hnswlib::DISTFUNC<float> bf16_l2_query = kernels::l2_sqr_fp32_bf16_scalar;
+	hnswlib::DISTFUNC<float> fp16_l2 = kernels::l2_sqr_fp16_scalar;
+	hnswlib::DISTFUNC<float> fp16_l2_query = kernels::l2_sqr_fp32_fp16_scalar;
+	// differing bits of two binary codes (lib/binary.hpp)
+	kernels::HammingFunction hamming = kernels::hamming_scalar;
+	// vbyte neighbor lists of a compact index (lib/compact.hpp), pshufb needs ssse3
+	kernels::LinkDecodeFunction decode_links = kernels::decode_links_scalar;
+
+	/// @brief the specialized l2 kernel for `dim` if there is one, the generic one otherwise
+	hnswlib::DISTFUNC<float> l2_for(size_t dim) const {
+		const hnswlib::DISTFUNC<float> fixed = l2_fixed != nullptr ? l2_fixed(dim) : nullptr;
+		return fixed != nullptr ? fixed : l2;
+	}
+
+	hnswlib::DISTFUNC<float> ip_for(size_t dim) const {
+		const hnswlib::DISTFUNC<float> fixed = ip_fixed != nullptr ? ip_fixed(dim) : nullptr;
+		return fixed != nullptr ? fixed : ip;
+	}
+
+	bool has_fixed(size_t dim) const {
+		return l2_fixed != nullptr && l2_fixed(dim) != nullptr;
+	}
+};
+
+/// @brief every kernel set the cpu can run, best first
+inline std::vector<DistanceKernels> supported_distance_kernels() {
+	std::vector<DistanceKernels> supported;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f")) {
+		supported.push_back({ "avx512",
+							  kernels::l2_sqr_avx512,
+							  kernels::ip_distance_avx512,
+							  kernels::l2_sqr_avx512_fixed,
+							  kernels::ip_distance_avx512_fixed,
+							  kernels::l2_sqr_bounded_avx512,
+							  kernels::l2_sqr_batch_avx512,
+							  kernels::sq8_l2_sqr_avx512,
+							  kernels::pq_adc_avx512,
+							  kernels::l2_sqr_bf16_avx512,
+							  kernels::l2_sqr_fp32_bf16_avx512,
+							  kernels::l2_sqr_fp16_avx512,
+							  kernels::l2_sqr_fp32_fp16_avx512,
+							  __builtin_cpu_supports("avx512vpopcntdq")
+								  ? kernels::hamming_avx512_vpopcntdq
+								  : kernels::hamming_avx2,
+							  kernels::decode_links_avx2 });
+	}
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+	   __builtin_cpu_supports("f16c")) {
+		supported.push_back({ "avx2",
+							  kernels::l2_sqr_avx2,
+							  kernels::ip_distance_avx2,
+							  kernels::l2_sqr_avx2_fixed,
+							  kernels::ip_distance_avx2_fixed,
+							  kernels::l2_sqr_bounded_avx2,
+							  kernels::l2_sqr_batch_avx2,
+							  kernels::sq8_l2_sqr_avx2,
+							  kernels::pq_adc_avx2,
+							  kernels::l2_sqr_bf16_avx2,
+							  kernels::l2_sqr_fp32_bf16_avx2,
+							  kernels::l2_sqr_fp16_avx2,
+							  kernels::l2_sqr_fp32_fp16_avx2,
+							  kernels::hamming_avx2,
+							  kernels::decode_links_avx2 });
+	}
+	supported.push_back({ "sse",
+						  kernels::l2_sqr_sse,
+						  kernels::ip_distance_sse,
+						  kernels::l2_sqr_sse_fixed,
+						  kernels::ip_distance_sse_fixed,
+						  kernels::l2_sqr_bounded_sse,
+						  kernels::l2_sqr_batch_sse,
+						  kernels::sq8_l2_sqr_sse,
+						  kernels::pq_adc_sse,
+						  kernels::l2_sqr_bf16_sse,
+						  kernels::l2_sqr_fp32_bf16_sse });
+#endif
+	supported.push_back({ "scalar", kernels::l2_sqr_scalar, kernels::ip_distance_scalar });
+	return supported;
+}
+
+/// @brief the kernels spaces use: the best supported, or the one named by $HNSW_ISA
+/// @throw std::runtime_error if $HNSW_ISA names a level the cpu (or build) does not support
+inline const DistanceKernels& distance_kernels() {
+	static const DistanceKernels selected = [] {
+		const std::vector<DistanceKernels> supported = supported_distance_kernels();
+		const char* forced = std::getenv("HNSW_ISA");
+		if(forced == nullptr || *forced == '\0') {
+			return supported.front();
+		}
+		for(const DistanceKernels& k : supported) {
+			if(k.isa == forced) {
+				return k;
+			}
+		}
+		throw std::runtime_error(std::format("HNSW_ISA={} is not supported on this cpu", forced));
+	}();
+	return selected;
+}
+
+/// @brief cpu features relevant to the kernels, for the benchmark output
+inline std::string cpu_simd_features() {
+	std::string features;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	// __builtin_cpu_supports only takes literals
+	const auto add = [&](bool supported, const char* feature) {
+		if(supported) {
+			features += features.empty() ? feature : std::string(" ") + feature;
+		}
+	};
+	add(__builtin_cpu_supports("sse4.2"), "sse4.2");
+	add(__builtin_cpu_supports("avx"), "avx");
+	add(__builtin_cpu_supports("avx2"), "avx2");
+	add(__builtin_cpu_supports("fma"), "fma");
+	add(__builtin_cpu_supports("f16c"), "f16c");
+	add(__builtin_cpu_supports("avx512f"), "avx512f");
+	add(__builtin_cpu_supports("avx512bw"), "avx512bw");
+	add(__builtin_cpu_supports("avx512vl"), "avx512vl");
+	add(__builtin_cpu_supports("avx512vnni"), "avx512vnni");
+	add(__builtin_cpu_supports("avx512vpopcntdq"), "avx512vpopcntdq");
+	add(__builtin_cpu_supports("avx512bf16"), "avx512bf16");
+	add(__builtin_cpu_supports("avx512fp16"), "avx512fp16");
+#endif
+	return features;
+}
+
+/// @brief what a float query becomes before the distance of a space over compressed vectors takes
+/// it: an sq8 code (lib/sq8.hpp), a pq lookup table (lib/pq.hpp), a pca projection (lib/pca.hpp)
+class QueryCoder {
+public:
+	virtual ~QueryCoder() = default;
+
+	/// @brief dims of a float query, and of the full vectors a search reranks with
+	virtual size_t dim() const = 0;
+
+	/// @brief bytes of an encoded query
+	virtual size_t query_size() const = 0;
+
+	/// @param out query_size() bytes, aligned for floats
+	virtual void encode_query(const float* query, void* out) const = 0;
+};
+
+/// @brief hnswlib::L2Space with the runtime selected kernel (squared l2, like L2Space)
+class DispatchedL2Space : public hnswlib::SpaceInterface<float> {
+public:
+	/// @param specialized use the kernel specialized for `dim` if there is one
+	explicit DispatchedL2Space(size_t dim, bool specialized = true)
+		: dim_(dim)
+		, specialized_(specialized) {}
+
+	size_t get_data_size() override {
+		return dim_ * sizeof(float);
+	}
+
+	hnswlib::DISTFUNC<float> get_dist_func() override {
+		return specialized_ ? distance_kernels().l2_for(dim_) : distance_kernels().l2;
+	}
+
+	void* get_dist_func_param() override {
+		return &dim_;
+	}
+
+	/// @brief e.g. avx512_960 or avx2 (generic)
+	std::string kernel_name() const {
+		return specialized_ && distance_kernels().has_fixed(dim_)
+				   ? std::format("{}_{}", distance_kernels().isa, dim_)
+				   : distance_kernels().isa;
+	}
+
+private:
+	size_t dim_;
+	const bool specialized_;
+};
+
+/// @brief hnswlib::InnerProductSpace with the runtime selected kernel (1 - inner product)
+class DispatchedIpSpace : public hnswlib::SpaceInterface<float> {
+public:
+	/// @param specialized use the kernel specialized for `dim` if there is one
+	explicit DispatchedIpSpace(size_t dim, bool specialized = true)
+		: dim_(dim)
+		, specialized_(specialized) {}
+
+	size_t get_data_size() override {
+		return dim_ * sizeof(float);
+	}
+
+	hnswlib::DISTFUNC<float> get_dist_func() override {
+		return specialized_ ? distance_kernels().ip_for(dim_) : distance_kernels().ip;
+	}
+
+	void* get_dist_func_param() override {
+		return &dim_;
+	}
+
+	/// @brief e.g. avx512_960 or avx2 (generic)
+	std::string kernel_name() const {
+		return specialized_ && distance_kernels().has_fixed(dim_)
+				   ? std::format("{}_{}", distance_kernels().isa, dim_)
+				   : distance_kernels().isa;
+	}
+
+private:
+	size_t dim_;
+	const bool specialized_;
+};
@@ -1,15 +1,16 @@
 /* Meant to be a helper file to generate embeddings and the ground truth */
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <exception>
 #include <filesystem>
 #include <format>
 #include <fstream>
-#include <hnswlib/hnswlib.h>
+#include <limits>
 #include <memory>
-#include <queue>
-#include <unordered_set>
+#include <numeric>
 
 template <typename T>
 struct Embedding {
@@ -56,32 +57,78 @@ Embedding<T> load_gist_960(const std::filesystem::path& gist_src) {
 	return { std::move(data), dim, nb };
 }
 
-double calculate_recall(const int query_id,
-						const Embedding<int>& ground_truth,
-						std::priority_queue<std::pair<float, hnswlib::labeltype>>& results) {
+/// @brief reads an fvecs/ivecs file a chunk of rows at a time, for files that do not fit in ram
+template <typename T>
+class VecsReader {
+public:
+	explicit VecsReader(const std::filesystem::path& src)
+		: fin_(src, std::ios::binary) {
+		if(!fin_) {
+			throw std::runtime_error(std::format("could not open filename {}", src.string()));
+		}
+		fin_.read(reinterpret_cast<char*>(&dim_), sizeof(int));
+		if(!fin_) {
+			throw std::runtime_error("could not read dimensions");
+		}
+		nb_ = std::filesystem::file_size(src) / (dim_ * sizeof(T) + sizeof(int));
+		fin_.seekg(0, std::ios::beg);
+	}
 
-	const int* truth_ptr = ground_truth.data.get();
+	int dim() const {
+		return dim_;
+	}
 
-	std::unordered_set<int> contains;
-	/// 100, 1000
+	size_t nb() const {
+		return nb_;
+	}
 
-	// std::cout << ground_truth.dim << " " << ground_truth.nb << std::endl;
-	for(int i = 0; i < ground_truth.dim; i++) {
-		const int* vector_id = truth_ptr + (query_id * ground_truth.dim + i);
-		contains.insert(*vector_id);
+	/// @brief read up to max_rows rows into dest (max_rows * dim elements)
+	/// @return number of rows read, 0 at the end of the file
+	size_t read(T* dest, size_t max_rows) {
+		size_t rows = 0;
+		for(; rows < max_rows && next_row_ < nb_; rows++, next_row_++) {
+			int tmp_dim;
+			fin_.read(reinterpret_cast<char*>(&tmp_dim), sizeof(int));
+			assert(tmp_dim == dim_);
+			fin_.read(reinterpret_cast<char*>(dest + rows * dim_), dim_ * sizeof(T));
+		}
+		return rows;
 	}
 
-	int num_hits = 0;
-	assert(contains.size() == 100);
-	// std::cout << contains.size() << std::endl;
-	while(!results.empty()) {
-		auto [dist, label] = results.top();
-		results.pop();
+private:
+	std::ifstream fin_;
+	int dim_;
+	size_t nb_;
+	size_t next_row_ = 0;
+};
 
-		if(contains.contains(label)) {
-			num_hits++;
-		}
+/// @brief read the first max_rows rows (all if 0) of an fvecs/ivecs file
+template <typename T>
+Embedding<T> load_vecs(const std::filesystem::path& src, size_t max_rows = 0) {
+	VecsReader<T> reader(src);
+	const size_t nb = max_rows > 0 ? std::min(max_rows, reader.nb()) : reader.nb();
+	std::unique_ptr<T[]> data = std::make_unique<T[]>(nb * reader.dim());
+	reader.read(data.get(), nb);
+	return { std::move(data), reader.dim(), static_cast<int>(nb) };
+}
+
+/// @brief write nb rows of dim elements in fvecs/ivecs layout
+template <typename T>
+void write_vecs(const std::filesystem::path& dest, const T* data, int dim, size_t nb) {
+	std::ofstream fout(dest, std::ios::binary);
+	if(!fout) {
+		throw std::runtime_error(std::format("could not open filename {}", dest.string()));
 	}
+	for(size_t i = 0; i < nb; i++) {
+		fout.write(reinterpret_cast<const char*>(&dim), sizeof(int));
+		fout.write(reinterpret_cast<const char*>(data + i * dim), dim * sizeof(T));
+	}
+}
 
-	return static_cast<double>(num_hits) / static_cast<double>(ground_truth.dim);
-}
\ No newline at end of file
+/// @brief scale a vector to unit length (for cosine similarity on an inner product space)
+inline void fast_normalize(const float* src, float* dest, size_t dim) {
+	float norm = std::inner_product(src, src + dim, src, 0.0f);
+	norm = 1.0f / (std::sqrt(norm) + std::numeric_limits<float>::epsilon());
+
+	std::transform(src, src + dim, dest, [norm](float x) { return x * norm; });
+}
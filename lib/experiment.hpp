@@ -0,0 +1,166 @@
+/* Experiment spec files: ini-like sections describing datasets, indexes and the parameter grid */
+#pragma once
+
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lib/workload.hpp"
+
+// A spec is a list of sections, each with a type, an optional name and key = value pairs:
+//
+//   # comment
+//   [dataset gist]
+//   dir = ./datasets/gist
+//
+//   [index m48]
+//   dataset = gist
+//   path = ./index/hnsw_m_48_ef_200_l2.bin
+//
+//   [experiment ef_sweep]
+//   indexes = m48
+//   ef = 100 200 300
+//
+// List values are whitespace separated. See experiments/gist.ini for every supported key.
+
+struct SpecSection {
+	std::string type;
+	std::string name;
+	std::map<std::string, std::string> values;
+
+	bool has(const std::string& key) const {
+		return values.contains(key);
+	}
+
+	std::string get(const std::string& key) const {
+		const auto it = values.find(key);
+		if(it == values.end()) {
+			throw std::runtime_error(std::format("[{} {}] is missing '{}'", type, name, key));
+		}
+		return it->second;
+	}
+
+	std::string get(const std::string& key, const std::string& default_value) const {
+		return has(key) ? get(key) : default_value;
+	}
+
+	template <typename T>
+	T get_as(const std::string& key, T default_value) const {
+		if(!has(key)) {
+			return default_value;
+		}
+		T value;
+		std::istringstream ss(get(key));
+		if(!(ss >> value)) {
+			throw std::runtime_error(std::format("[{} {}] '{}' has a bad value", type, name, key));
+		}
+		return value;
+	}
+
+	template <typename T>
+	std::vector<T> get_list(const std::string& key, const std::vector<T>& default_value) const {
+		if(!has(key)) {
+			return default_value;
+		}
+		std::vector<T> list;
+		std::istringstream ss(get(key));
+		T value;
+		while(ss >> value) {
+			list.push_back(value);
+		}
+		return list;
+	}
+};
+
+class ExperimentSpec {
+public:
+	/// @brief parse a spec file
+	/// @throw std::runtime_error with the line number on syntax errors
+	static ExperimentSpec load(const std::filesystem::path& src) {
+		std::ifstream fin(src);
+		if(!fin) {
+			throw std::runtime_error(std::format("could not open filename {}", src.string()));
+		}
+
+		ExperimentSpec spec;
+		std::string line;
+		for(int line_no = 1; std::getline(fin, line); line_no++) {
+			line = trim(line.substr(0, line.find('#')));
+			if(line.empty()) {
+				continue;
+			}
+
+			if(line.front() == '[') {
+				if(line.back() != ']') {
+					throw std::runtime_error(
+						std::format("{}:{}: unterminated section", src.string(), line_no));
+				}
+				SpecSection section;
+				std::istringstream header(line.substr(1, line.size() - 2));
+				header >> section.type >> section.name;
+				spec.sections_.push_back(section);
+				continue;
+			}
+
+			const size_t eq = line.find('=');
+			if(eq == std::string::npos || spec.sections_.empty()) {
+				throw std::runtime_error(std::format(
+					"{}:{}: expected key = value inside a section", src.string(), line_no));
+			}
+			spec.sections_.back().values[trim(line.substr(0, eq))] = trim(line.substr(eq + 1));
+		}
+		return spec;
+	}
+
+	std::vector<const SpecSection*> of_type(const std::string& type) const {
+		std::vector<const SpecSection*> found;
+		for(const SpecSection& section : sections_) {
+			if(section.type == type) {
+				found.push_back(&section);
+			}
+		}
+		return found;
+	}
+
+	const SpecSection& find(const std::string& type, const std::string& name) const {
+		for(const SpecSection& section : sections_) {
+			if(section.type == type && section.name == name) {
+				return section;
+			}
+		}
+		throw std::runtime_error(std::format("no [{} {}] section", type, name));
+	}
+
+private:
+	static std::string trim(const std::string& s) {
+		const size_t begin = s.find_first_not_of(" \t\r");
+		if(begin == std::string::npos) {
+			return "";
+		}
+		return s.substr(begin, s.find_last_not_of(" \t\r") - begin + 1);
+	}
+
+	std::vector<SpecSection> sections_;
+};
+
+/// @brief workload keys of an [experiment] section, same names as the benchmark flags
+inline WorkloadConfig workload_config_from(const SpecSection& section) {
+	WorkloadConfig config;
+	config.distribution = parse_distribution(section.get("workload", "uniform"));
+	config.num_queries = section.get_as<size_t>("num_queries", config.num_queries);
+	config.zipf_skew = section.get_as<double>("zipf_skew", config.zipf_skew);
+	config.repeat = section.get_as<size_t>("repeat", config.repeat);
+	config.burst_probability =
+		section.get_as<double>("burst_probability", config.burst_probability);
+	config.burst_length = section.get_as<size_t>("burst_length", config.burst_length);
+	config.drift_per_query = section.get_as<double>("drift", config.drift_per_query);
+	config.num_perturbed = section.get_as<size_t>("perturbed", config.num_perturbed);
+	config.noise = section.get_as<float>("noise", config.noise);
+	config.seed = section.get_as<uint64_t>("seed", config.seed);
+	return config;
+}
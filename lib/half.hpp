@@ -0,0 +1,129 @@
+/* Half precision hnsw index: vectors stored as fp16 or bf16, distances accumulated in float */
+#pragma once
+
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <hnswlib/hnswlib.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+#include "lib/distance.hpp"
+
+// A GIST vector in fp16 or bf16 is 1920 bytes instead of 3840, so every distance reads half the
+// memory. build_hnsw converts each vector when it inserts it and builds the graph on the half
+// precision vectors (HalfSpace with stored vectors on both sides of the distance). Searches keep
+// the query in float: the index is loaded over a HalfSpace whose distance takes a float query and
+// converts only the stored side, in registers, summing in float. fp16 keeps 11 significant bits
+// within +-65504, bf16 keeps 8 bits over the range of a float. The index is named after its format
+// (hnsw_m_<m>_ef_<ef>_fp16.bin), which is how bench_st_sq recognizes it.
+
+enum class HalfFormat {
+	fp16, // ieee binary16
+	bf16, // the upper half of a float
+};
+
+inline HalfFormat parse_half_format(const std::string& name) {
+	if(name == "fp16")
+		return HalfFormat::fp16;
+	if(name == "bf16")
+		return HalfFormat::bf16;
+	throw std::runtime_error(std::format("unknown half format '{}'", name));
+}
+
+inline std::string half_format_name(HalfFormat format) {
+	return format == HalfFormat::fp16 ? "fp16" : "bf16";
+}
+
+/// @brief the format of the index at `index_path` from its name, none for a float index
+inline std::optional<HalfFormat> half_format_of(const std::filesystem::path& index_path) {
+	const std::string stem = index_path.stem().string();
+	for(const HalfFormat format : { HalfFormat::fp16, HalfFormat::bf16 }) {
+		const std::string suffix = "_" + half_format_name(format);
+		if(stem.size() >= suffix.size() &&
+		   stem.compare(stem.size() - suffix.size(), suffix.size(), suffix) == 0) {
+			return format;
+		}
+	}
+	return std::nullopt;
+}
+
+/// @brief nearest fp16, ties to even, infinity beyond its range
+inline uint16_t float_to_fp16(float f) {
+	const uint32_t bits = std::bit_cast<uint32_t>(f);
+	const uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000u);
+	const uint32_t magnitude = bits & 0x7fffffffu;
+	if(magnitude >= 0x7f800000u) {
+		// infinity stays infinity, nan stays a (quiet) nan
+		return static_cast<uint16_t>(sign | (magnitude > 0x7f800000u ? 0x7e00u : 0x7c00u));
+	}
+	if(magnitude >= 0x477ff000u) {
+		// 65520 and above round to infinity
+		return static_cast<uint16_t>(sign | 0x7c00u);
+	}
+	if(magnitude < 0x38800000u) {
+		// below the smallest normal fp16 (2^-14): a multiple of 2^-24, rounded to even by rint
+		const float scaled = std::bit_cast<float>(magnitude) * 16777216.0f;
+		return static_cast<uint16_t>(sign | static_cast<uint32_t>(std::nearbyint(scaled)));
+	}
+	// rebias the exponent (127 -> 15) and round the 13 dropped mantissa bits to even
+	const uint32_t odd = (magnitude >> 13) & 1u;
+	return static_cast<uint16_t>(sign | ((magnitude - 0x38000000u + 0xfffu + odd) >> 13));
+}
+
+/// @brief nearest bf16, ties to even
+inline uint16_t float_to_bf16(float f) {
+	const uint32_t bits = std::bit_cast<uint32_t>(f);
+	if((bits & 0x7fffffffu) > 0x7f800000u) {
+		return static_cast<uint16_t>((bits >> 16) | 0x40u);
+	}
+	const uint32_t odd = (bits >> 16) & 1u;
+	return static_cast<uint16_t>((bits + 0x7fffu + odd) >> 16);
+}
+
+/// @brief `dim` floats of `x` as `format` in `out`
+inline void to_half(const float* x, size_t dim, HalfFormat format, uint16_t* out) {
+	for(size_t d = 0; d < dim; d++) {
+		out[d] = format == HalfFormat::fp16 ? float_to_fp16(x[d]) : float_to_bf16(x[d]);
+	}
+}
+
+/// @brief hnswlib space over half precision vectors, squared l2 accumulated in float
+class HalfSpace : public hnswlib::SpaceInterface<float> {
+public:
+	/// @param float_queries the first argument of the distance is a float query (searching a
+	/// loaded index) instead of a stored vector (inserting, which compares stored vectors)
+	HalfSpace(size_t dim, HalfFormat format, bool float_queries)
+		: dim_(dim)
+		, format_(format)
+		, float_queries_(float_queries) {}
+
+	size_t get_data_size() override {
+		return dim_ * sizeof(uint16_t);
+	}
+
+	hnswlib::DISTFUNC<float> get_dist_func() override {
+		const DistanceKernels& k = distance_kernels();
+		if(format_ == HalfFormat::fp16) {
+			return float_queries_ ? k.fp16_l2_query : k.fp16_l2;
+		}
+		return float_queries_ ? k.bf16_l2_query : k.bf16_l2;
+	}
+
+	void* get_dist_func_param() override {
+		return &dim_;
+	}
+
+	/// @brief e.g. fp16_avx512
+	std::string kernel_name() const {
+		return half_format_name(format_) + "_" + distance_kernels().isa;
+	}
+
+private:
+	size_t dim_;
+	const HalfFormat format_;
+	const bool float_queries_;
+};
@@ -0,0 +1,219 @@
+/* Helpers to run a benchmark with as little OS noise as possible */
+#pragma once
+
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <hnswlib/hnswlib.h>
+#include <mutex>
+#include <ostream>
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+
+#include "lib/distance.hpp"
+
+/// @brief environment facts that influence latency, recorded next to every result
+struct EnvironmentInfo {
+	std::string cpu_model;
+	std::string governor;
+	double cur_mhz;
+	std::string transparent_hugepages;
+	std::string smt;
+	int core;
+	bool pinned;
+	bool mlocked;
+	bool realtime;
+	// distance kernels the spaces use and the SIMD features of the cpu
+	std::string distance_isa;
+	std::string simd_features;
+};
+
+/// @brief read the first line of a (sysfs/procfs) file
+/// @return the line, or "unknown" if the file does not exist or is not readable
+inline std::string read_first_line(const std::filesystem::path& path) {
+	std::ifstream fin(path);
+	std::string line;
+	if(!fin || !std::getline(fin, line)) {
+		return "unknown";
+	}
+	return line;
+}
+
+/// @brief look up the value of `key` in /proc/cpuinfo (first occurrence)
+inline std::string read_cpuinfo(const std::string& key) {
+	std::ifstream fin("/proc/cpuinfo");
+	std::string line;
+	while(std::getline(fin, line)) {
+		if(line.starts_with(key)) {
+			const size_t colon = line.find(':');
+			if(colon != std::string::npos && colon + 2 <= line.size()) {
+				return line.substr(colon + 2);
+			}
+		}
+	}
+	return "unknown";
+}
+
+/// @brief pin the calling thread to a single cpu
+/// @param core logical cpu id
+/// @throw std::runtime_error if `core` is not a cpu the process may run on
+inline void pin_current_thread(int core) {
+	// CPU_SET outside [0, CPU_SETSIZE) writes out of the set
+	if(core < 0 || core >= CPU_SETSIZE) {
+		throw std::runtime_error(
+			std::format("core {} is not a cpu id, expected 0 to {}", core, CPU_SETSIZE - 1));
+	}
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if(sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) {
+		throw std::runtime_error(
+			std::format("could not read the cpu affinity: {}", std::strerror(errno)));
+	}
+	if(!CPU_ISSET(core, &allowed)) {
+		throw std::runtime_error(std::format(
+			"core {} is not in the affinity mask of the process ({} cpus allowed, see nproc)",
+			core,
+			CPU_COUNT(&allowed)));
+	}
+
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(core, &cpuset);
+
+	const int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+	if(err != 0) {
+		throw std::runtime_error(
+			std::format("could not pin thread to core {}: {}", core, std::strerror(err)));
+	}
+}
+
+/// @brief lock every current and future page of the process into ram
+/// @note needs CAP_IPC_LOCK or a large enough `ulimit -l`
+inline void lock_all_memory() {
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		throw std::runtime_error(std::format("mlockall failed: {}", std::strerror(errno)));
+	}
+}
+
+/// @brief switch the calling thread to SCHED_FIFO just below the maximum priority so
+/// kernel threads (migration, watchdog) can still preempt it
+/// @note needs CAP_SYS_NICE or an rtprio limit
+inline void raise_priority() {
+	sched_param param{};
+	param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+	const int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if(err != 0) {
+		throw std::runtime_error(std::format("could not set SCHED_FIFO: {}", std::strerror(err)));
+	}
+}
+
+/// @brief touch every page in [addr, addr + bytes) so no page fault happens while timing
+/// @return a value derived from the touched bytes so the reads cannot be optimized away
+inline size_t prefault(const void* addr, size_t bytes) {
+	static const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+	const volatile char* ptr = static_cast<const volatile char*>(addr);
+	size_t checksum = 0;
+	for(size_t offset = 0; offset < bytes; offset += page_size) {
+		checksum += ptr[offset];
+	}
+	if(bytes > 0) {
+		checksum += ptr[bytes - 1];
+	}
+	return checksum;
+}
+
+/// @brief prefault level 0 and all upper level link lists of an hnsw index
+template <typename dist_t>
+size_t prefault_hnsw(const hnswlib::HierarchicalNSW<dist_t>& hnsw) {
+	size_t checksum = prefault(hnsw.data_level0_memory_,
+							   hnsw.cur_element_count * hnsw.size_data_per_element_);
+
+	for(size_t i = 0; i < hnsw.cur_element_count; i++) {
+		if(hnsw.element_levels_[i] > 0) {
+			checksum += prefault(hnsw.linkLists_[i],
+								 hnsw.size_links_per_element_ * hnsw.element_levels_[i]);
+		}
+	}
+	return checksum;
+}
+
+/// @brief bytes an hnsw index keeps in memory, by region
+struct HnswMemory {
+	// the level 0 block: vectors (or codes), links and labels
+	size_t level0 = 0;
+	// the part of level0 that is vectors
+	size_t vectors = 0;
+	// upper level link lists
+	size_t upper = 0;
+	// what only mutations need (lock mutexes, the label map, per element levels and link list
+	// pointers) and the visited list pool, estimated from the container sizes
+	size_t bookkeeping = 0;
+};
+
+template <typename dist_t>
+HnswMemory hnsw_memory(const hnswlib::HierarchicalNSW<dist_t>& hnsw) {
+	HnswMemory memory;
+	memory.level0 = hnsw.cur_element_count * hnsw.size_data_per_element_;
+	memory.vectors = hnsw.cur_element_count * hnsw.data_size_;
+	for(size_t i = 0; i < hnsw.cur_element_count; i++) {
+		memory.upper += hnsw.size_links_per_element_ * hnsw.element_levels_[i];
+	}
+	// a label map node holds the pair and a next pointer (and in libstdc++ no cached hash for
+	// integer keys), plus one bucket pointer per bucket; the pool holds at least one visited list
+	memory.bookkeeping =
+		(hnsw.link_list_locks_.size() + hnsw.label_op_locks_.size()) * sizeof(std::mutex) +
+		hnsw.label_lookup_.size() * (sizeof(std::pair<hnswlib::labeltype, hnswlib::tableint>) +
+									 sizeof(void*)) +
+		hnsw.label_lookup_.bucket_count() * sizeof(void*) +
+		hnsw.max_elements_ * (sizeof(int) + sizeof(char*) + sizeof(hnswlib::vl_type));
+	return memory;
+}
+
+/// @brief collect cpu model, frequency governor, current clock, THP and SMT state
+/// @param core the cpu the benchmark thread runs on (frequency data is per cpu)
+inline EnvironmentInfo capture_environment(int core) {
+	const std::filesystem::path cpu_dir =
+		std::filesystem::path("/sys/devices/system/cpu") / std::format("cpu{}", core);
+
+	EnvironmentInfo info{};
+	info.cpu_model = read_cpuinfo("model name");
+	info.governor = read_first_line(cpu_dir / "cpufreq/scaling_governor");
+	info.transparent_hugepages = read_first_line("/sys/kernel/mm/transparent_hugepage/enabled");
+	info.smt = read_first_line("/sys/devices/system/cpu/smt/control");
+	info.core = core;
+
+	// scaling_cur_freq is in kHz, fall back to /proc/cpuinfo when cpufreq is not exposed
+	const std::string cur_khz = read_first_line(cpu_dir / "cpufreq/scaling_cur_freq");
+	try {
+		info.cur_mhz = cur_khz != "unknown" ? std::stod(cur_khz) / 1000.0
+											: std::stod(read_cpuinfo("cpu MHz"));
+	} catch(const std::exception&) {
+		info.cur_mhz = 0.0;
+	}
+
+	info.distance_isa = distance_kernels().isa;
+	info.simd_features = cpu_simd_features();
+	return info;
+}
+
+/// @brief write the environment as `# key = value` lines (csv readers can skip them as comments)
+inline void write_environment(std::ostream& out, const EnvironmentInfo& info) {
+	out << "# cpu_model = " << info.cpu_model << '\n';
+	out << "# governor = " << info.governor << '\n';
+	out << "# cur_mhz = " << info.cur_mhz << '\n';
+	out << "# transparent_hugepages = " << info.transparent_hugepages << '\n';
+	out << "# smt = " << info.smt << '\n';
+	out << "# core = " << info.core << '\n';
+	out << "# pinned = " << info.pinned << '\n';
+	out << "# mlocked = " << info.mlocked << '\n';
+	out << "# realtime = " << info.realtime << '\n';
+	out << "# distance_isa = " << info.distance_isa << '\n';
+	out << "# simd_features = " << info.simd_features << '\n';
+}
@@ -0,0 +1,433 @@
+// Compiled with -mavx2 -mfma -mf16c, only called when the cpu supports all three.
+#include "lib/kernels/kernels.hpp"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+namespace kernels {
+
+namespace {
+
+inline float horizontal_sum(__m256 v) {
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+/// @brief x - y of 8 sq8 codes as floats, exact: the codes are widened to int32 first
+inline __m256 code_difference(const unsigned char* x, const unsigned char* y) {
+	const __m256i xi = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(x)));
+	const __m256i yi = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(y)));
+	return _mm256_cvtepi32_ps(_mm256_sub_epi32(xi, yi));
+}
+
+/// @brief per control byte of a vbyte group: the pshufb mask that moves its four values into
+/// uint32 lanes (0x80 zeroes a byte) and the bytes the group takes
+struct VbyteTables {
+	alignas(16) uint8_t shuffle[256][16];
+	uint8_t length[256];
+};
+
+constexpr VbyteTables make_vbyte_tables() {
+	VbyteTables tables{};
+	for(size_t control = 0; control < 256; control++) {
+		uint8_t offset = 0;
+		for(size_t lane = 0; lane < LINK_GROUP; lane++) {
+			const uint8_t bytes = ((control >> (2 * lane)) & 3u) + 1;
+			for(uint8_t b = 0; b < 4; b++) {
+				const uint8_t source = b < bytes ? offset + b : 0x80;
+				tables.shuffle[control][lane * 4 + b] = source;
+			}
+			offset += bytes;
+		}
+		tables.length[control] = offset;
+	}
+	return tables;
+}
+
+constexpr VbyteTables VBYTE_TABLES = make_vbyte_tables();
+
+template <size_t DIM>
+struct L2Fixed {
+	static float distance(const void* a, const void* b, const void*) {
+		const float* x = static_cast<const float*>(a);
+		const float* y = static_cast<const float*>(b);
+		constexpr size_t ACC = fixed_accumulators<DIM, 8>();
+
+		__m256 sum[ACC];
+#pragma GCC unroll 4
+		for(size_t j = 0; j < ACC; j++) {
+			sum[j] = _mm256_setzero_ps();
+		}
+#pragma GCC unroll 4
+		for(size_t i = 0; i < DIM; i += ACC * 8) {
+#pragma GCC unroll 4
+			for(size_t j = 0; j < ACC; j++) {
+				const size_t o = i + j * 8;
+				const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(x + o), _mm256_loadu_ps(y + o));
+				sum[j] = _mm256_fmadd_ps(d, d, sum[j]);
+			}
+		}
+#pragma GCC unroll 4
+		for(size_t j = 1; j < ACC; j++) {
+			sum[0] = _mm256_add_ps(sum[0], sum[j]);
+		}
+		return horizontal_sum(sum[0]);
+	}
+};
+
+template <size_t DIM>
+struct IpFixed {
+	static float distance(const void* a, const void* b, const void*) {
+		const float* x = static_cast<const float*>(a);
+		const float* y = static_cast<const float*>(b);
+		constexpr size_t ACC = fixed_accumulators<DIM, 8>();
+
+		__m256 sum[ACC];
+#pragma GCC unroll 4
+		for(size_t j = 0; j < ACC; j++) {
+			sum[j] = _mm256_setzero_ps();
+		}
+#pragma GCC unroll 4
+		for(size_t i = 0; i < DIM; i += ACC * 8) {
+#pragma GCC unroll 4
+			for(size_t j = 0; j < ACC; j++) {
+				const size_t o = i + j * 8;
+				sum[j] = _mm256_fmadd_ps(_mm256_loadu_ps(x + o), _mm256_loadu_ps(y + o), sum[j]);
+			}
+		}
+#pragma GCC unroll 4
+		for(size_t j = 1; j < ACC; j++) {
+			sum[0] = _mm256_add_ps(sum[0], sum[j]);
+		}
+		return 1.0f - horizontal_sum(sum[0]);
+	}
+};
+
+// 8 dims as floats from a float, fp16 or bf16 vector
+struct Fp32 {
+	using Storage = float;
+	static __m256 load(const float* p) {
+		return _mm256_loadu_ps(p);
+	}
+};
+
+struct Fp16 {
+	using Storage = uint16_t;
+	static __m256 load(const uint16_t* p) {
+		return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+	}
+};
+
+struct Bf16 {
+	using Storage = uint16_t;
+	static __m256 load(const uint16_t* p) {
+		const __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		const __m256i h = _mm256_cvtepu16_epi32(raw);
+		return _mm256_castsi256_ps(_mm256_slli_epi32(h, 16));
+	}
+};
+
+/// @brief squared l2 of an X and a Y vector, converted to float and accumulated in float. The
+/// last partial block is copied into zero padded buffers, so the tail converts like the rest.
+template <typename X, typename Y>
+float l2_sqr_converted(const void* a, const void* b, const void* dim_ptr) {
+	const auto* x = static_cast<const typename X::Storage*>(a);
+	const auto* y = static_cast<const typename Y::Storage*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+
+	__m256 sum0 = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+	size_t i = 0;
+	for(; i + 16 <= dim; i += 16) {
+		const __m256 d0 = _mm256_sub_ps(X::load(x + i), Y::load(y + i));
+		const __m256 d1 = _mm256_sub_ps(X::load(x + i + 8), Y::load(y + i + 8));
+		sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+		sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+	}
+	if(i < dim) {
+		typename X::Storage x_tail[16] = {};
+		typename Y::Storage y_tail[16] = {};
+		for(size_t j = 0; i + j < dim; j++) {
+			x_tail[j] = x[i + j];
+			y_tail[j] = y[i + j];
+		}
+		const __m256 d0 = _mm256_sub_ps(X::load(x_tail), Y::load(y_tail));
+		const __m256 d1 = _mm256_sub_ps(X::load(x_tail + 8), Y::load(y_tail + 8));
+		sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+		sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+	}
+	return horizontal_sum(_mm256_add_ps(sum0, sum1));
+}
+
+/// @brief bits set in each byte of v, from a 16 entry table per nibble (no popcnt for vectors)
+inline __m256i popcount_bytes(__m256i v) {
+	const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+										   0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	const __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, low));
+	const __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+	return _mm256_add_epi8(lo, hi);
+}
+
+} // namespace
+
+float l2_sqr_avx2(const void* a, const void* b, const void* dim_ptr) {
+	const float* x = static_cast<const float*>(a);
+	const float* y = static_cast<const float*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+
+	// two accumulators hide the fma latency
+	__m256 sum0 = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+	size_t i = 0;
+	for(; i + 16 <= dim; i += 16) {
+		const __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+		const __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8));
+		sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+		sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+	}
+	if(i + 8 <= dim) {
+		const __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+		sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+		i += 8;
+	}
+	float sum = horizontal_sum(_mm256_add_ps(sum0, sum1));
+	for(; i < dim; i++) {
+		const float d = x[i] - y[i];
+		sum += d * d;
+	}
+	return sum;
+}
+
+float ip_distance_avx2(const void* a, const void* b, const void* dim_ptr) {
+	const float* x = static_cast<const float*>(a);
+	const float* y = static_cast<const float*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+
+	__m256 sum0 = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+	size_t i = 0;
+	for(; i + 16 <= dim; i += 16) {
+		sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), sum0);
+		sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), sum1);
+	}
+	if(i + 8 <= dim) {
+		sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), sum0);
+		i += 8;
+	}
+	float sum = horizontal_sum(_mm256_add_ps(sum0, sum1));
+	for(; i < dim; i++) {
+		sum += x[i] * y[i];
+	}
+	return 1.0f - sum;
+}
+
+float l2_sqr_bounded_avx2(
+	const void* a, const void* b, size_t dim, float bound, size_t* dims_done) {
+	const float* x = static_cast<const float*>(a);
+	const float* y = static_cast<const float*>(b);
+
+	__m256 sum0 = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+	size_t i = 0;
+	for(; i + ABANDON_BLOCK <= dim; i += ABANDON_BLOCK) {
+		for(size_t j = i; j < i + ABANDON_BLOCK; j += 16) {
+			const __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x + j), _mm256_loadu_ps(y + j));
+			const __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(x + j + 8), _mm256_loadu_ps(y + j + 8));
+			sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+			sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+		}
+		const float partial = horizontal_sum(_mm256_add_ps(sum0, sum1));
+		if(partial > bound) {
+			if(dims_done != nullptr) {
+				*dims_done = i + ABANDON_BLOCK;
+			}
+			return partial;
+		}
+	}
+	if(dims_done != nullptr) {
+		*dims_done = dim;
+	}
+	// the last partial block goes through the generic kernel
+	const size_t rest = dim - i;
+	const float sum = horizontal_sum(_mm256_add_ps(sum0, sum1));
+	return rest > 0 ? sum + l2_sqr_avx2(x + i, y + i, &rest) : sum;
+}
+
+void l2_sqr_batch_avx2(
+	const void* query, const void* const* vectors, size_t count, size_t dim, float* distances) {
+	const float* q = static_cast<const float*>(query);
+	size_t v = 0;
+	for(; v + BATCH_WIDTH <= count; v += BATCH_WIDTH) {
+		const float* x0 = static_cast<const float*>(vectors[v]);
+		const float* x1 = static_cast<const float*>(vectors[v + 1]);
+		const float* x2 = static_cast<const float*>(vectors[v + 2]);
+		const float* x3 = static_cast<const float*>(vectors[v + 3]);
+		__m256 sum0 = _mm256_setzero_ps();
+		__m256 sum1 = _mm256_setzero_ps();
+		__m256 sum2 = _mm256_setzero_ps();
+		__m256 sum3 = _mm256_setzero_ps();
+		size_t i = 0;
+		for(; i + 8 <= dim; i += 8) {
+			const __m256 qi = _mm256_loadu_ps(q + i);
+			const __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x0 + i), qi);
+			const __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(x1 + i), qi);
+			const __m256 d2 = _mm256_sub_ps(_mm256_loadu_ps(x2 + i), qi);
+			const __m256 d3 = _mm256_sub_ps(_mm256_loadu_ps(x3 + i), qi);
+			sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+			sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+			sum2 = _mm256_fmadd_ps(d2, d2, sum2);
+			sum3 = _mm256_fmadd_ps(d3, d3, sum3);
+		}
+		distances[v] = horizontal_sum(sum0);
+		distances[v + 1] = horizontal_sum(sum1);
+		distances[v + 2] = horizontal_sum(sum2);
+		distances[v + 3] = horizontal_sum(sum3);
+		for(; i < dim; i++) {
+			const float d0 = x0[i] - q[i];
+			const float d1 = x1[i] - q[i];
+			const float d2 = x2[i] - q[i];
+			const float d3 = x3[i] - q[i];
+			distances[v] += d0 * d0;
+			distances[v + 1] += d1 * d1;
+			distances[v + 2] += d2 * d2;
+			distances[v + 3] += d3 * d3;
+		}
+	}
+	for(; v < count; v++) {
+		distances[v] = l2_sqr_avx2(q, vectors[v], &dim);
+	}
+}
+
+float sq8_l2_sqr_avx2(const void* a, const void* b, const void* param_ptr) {
+	const unsigned char* x = static_cast<const unsigned char*>(a);
+	const unsigned char* y = static_cast<const unsigned char*>(b);
+	const Sq8Param& param = *static_cast<const Sq8Param*>(param_ptr);
+	const size_t dim = param.dim;
+	const float* w = param.weights;
+
+	__m256 sum0 = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+	size_t i = 0;
+	for(; i + 16 <= dim; i += 16) {
+		const __m256 d0 = code_difference(x + i, y + i);
+		const __m256 d1 = code_difference(x + i + 8, y + i + 8);
+		sum0 = _mm256_fmadd_ps(_mm256_mul_ps(d0, d0), _mm256_loadu_ps(w + i), sum0);
+		sum1 = _mm256_fmadd_ps(_mm256_mul_ps(d1, d1), _mm256_loadu_ps(w + i + 8), sum1);
+	}
+	float sum = horizontal_sum(_mm256_add_ps(sum0, sum1));
+	for(; i < dim; i++) {
+		const float d = static_cast<float>(static_cast<int>(x[i]) - static_cast<int>(y[i]));
+		sum += w[i] * d * d;
+	}
+	return sum;
+}
+
+float pq_adc_avx2(const void* table_ptr, const void* code_ptr, const void* param_ptr) {
+	const float* table = static_cast<const float*>(table_ptr);
+	const unsigned char* code = static_cast<const unsigned char*>(code_ptr);
+	const size_t m = static_cast<const PqParam*>(param_ptr)->m;
+
+	// 8 subquantizers per gather: entry i * PQ_CENTROIDS + code[i] of the table
+	const __m256i rows = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+											_mm256_set1_epi32(PQ_CENTROIDS));
+	__m256 sum0 = _mm256_setzero_ps();
+	__m256 sum1 = _mm256_setzero_ps();
+	size_t i = 0;
+	for(; i + 16 <= m; i += 16) {
+		const __m256i c0 =
+			_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(code + i)));
+		const __m256i c1 =
+			_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(code + i + 8)));
+		sum0 = _mm256_add_ps(
+			sum0, _mm256_i32gather_ps(table + i * PQ_CENTROIDS, _mm256_add_epi32(rows, c0), 4));
+		sum1 = _mm256_add_ps(
+			sum1,
+			_mm256_i32gather_ps(table + (i + 8) * PQ_CENTROIDS, _mm256_add_epi32(rows, c1), 4));
+	}
+	float result = horizontal_sum(_mm256_add_ps(sum0, sum1));
+	for(; i < m; i++) {
+		result += table[i * PQ_CENTROIDS + code[i]];
+	}
+	return result;
+}
+
+float l2_sqr_bf16_avx2(const void* a, const void* b, const void* dim_ptr) {
+	return l2_sqr_converted<Bf16, Bf16>(a, b, dim_ptr);
+}
+
+float l2_sqr_fp32_bf16_avx2(const void* a, const void* b, const void* dim_ptr) {
+	return l2_sqr_converted<Fp32, Bf16>(a, b, dim_ptr);
+}
+
+float l2_sqr_fp16_avx2(const void* a, const void* b, const void* dim_ptr) {
+	return l2_sqr_converted<Fp16, Fp16>(a, b, dim_ptr);
+}
+
+float l2_sqr_fp32_fp16_avx2(const void* a, const void* b, const void* dim_ptr) {
+	return l2_sqr_converted<Fp32, Fp16>(a, b, dim_ptr);
+}
+
+size_t hamming_avx2(const uint64_t* a, const uint64_t* b, size_t words) {
+	// byte counts summed into the four 64 bit lanes by sad against zero
+	__m256i sum = _mm256_setzero_si256();
+	size_t i = 0;
+	for(; i + 4 <= words; i += 4) {
+		const __m256i x = _mm256_xor_si256(
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(popcount_bytes(x), _mm256_setzero_si256()));
+	}
+	if(i < words) {
+		uint64_t tail[4] = {};
+		for(size_t j = 0; i + j < words; j++) {
+			tail[j] = a[i + j] ^ b[i + j];
+		}
+		const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tail));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(popcount_bytes(x), _mm256_setzero_si256()));
+	}
+	const __m128i s = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	return static_cast<size_t>(_mm_cvtsi128_si64(s) + _mm_extract_epi64(s, 1));
+}
+
+size_t decode_links_avx2(const uint8_t* list, uint32_t id, uint32_t* out) {
+	const size_t count = list[0] | static_cast<size_t>(list[1]) << 8;
+	const uint8_t* control = list + 2;
+	const size_t groups = (count + LINK_GROUP - 1) / LINK_GROUP;
+	const uint8_t* data = control + groups;
+	// a group is one shuffle of the next 16 bytes, then a prefix sum of its deltas on top of the
+	// last neighbor of the group before
+	__m128i previous = _mm_setzero_si128();
+	for(size_t g = 0; g < groups; g++) {
+		const uint8_t c = control[g];
+		const __m128i mask =
+			_mm_load_si128(reinterpret_cast<const __m128i*>(VBYTE_TABLES.shuffle[c]));
+		__m128i values =
+			_mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), mask);
+		data += VBYTE_TABLES.length[c];
+		if(g == 0) {
+			const uint32_t first = static_cast<uint32_t>(_mm_cvtsi128_si32(values));
+			const uint32_t neighbor = id + static_cast<uint32_t>(zigzag_decode(first));
+			values = _mm_insert_epi32(values, static_cast<int>(neighbor), 0);
+		}
+		values = _mm_add_epi32(values, _mm_slli_si128(values, 4));
+		values = _mm_add_epi32(values, _mm_slli_si128(values, 8));
+		values = _mm_add_epi32(values, previous);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + g * LINK_GROUP), values);
+		previous = _mm_shuffle_epi32(values, 0xff);
+	}
+	return count;
+}
+
+DistanceFunction l2_sqr_avx2_fixed(size_t dim) {
+	return find_fixed_kernel<L2Fixed>(dim, SpecializedDims{});
+}
+
+DistanceFunction ip_distance_avx2_fixed(size_t dim) {
+	return find_fixed_kernel<IpFixed>(dim, SpecializedDims{});
+}
+
+} // namespace kernels
+#endif
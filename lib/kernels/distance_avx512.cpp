@@ -0,0 +1,357 @@
+// Compiled with -mavx512f, only called when the cpu supports it.
+#include "lib/kernels/kernels.hpp"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+namespace kernels {
+
+namespace {
+
+// _mm512_reduce_add_ps leaves the result in a zmm register that gcc 12 moves to xmm0 after the
+// vzeroupper, so the caller runs its sse code with dirty upper state (several times slower)
+inline float horizontal_sum(__m512 v) {
+	const __m256 lo = _mm512_castps512_ps256(v);
+	const __m256 hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+	const __m256 s8 = _mm256_add_ps(lo, hi);
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(s8), _mm256_extractf128_ps(s8, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+/// @brief x - y of 16 sq8 codes as floats, exact: the codes are widened to int32 first
+inline __m512 code_difference(const unsigned char* x, const unsigned char* y) {
+	const __m512i xi = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x)));
+	const __m512i yi = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y)));
+	return _mm512_cvtepi32_ps(_mm512_sub_epi32(xi, yi));
+}
+
+template <size_t DIM>
+struct L2Fixed {
+	static float distance(const void* a, const void* b, const void*) {
+		const float* x = static_cast<const float*>(a);
+		const float* y = static_cast<const float*>(b);
+		constexpr size_t ACC = fixed_accumulators<DIM, 16>();
+
+		__m512 sum[ACC];
+#pragma GCC unroll 4
+		for(size_t j = 0; j < ACC; j++) {
+			sum[j] = _mm512_setzero_ps();
+		}
+#pragma GCC unroll 4
+		for(size_t i = 0; i < DIM; i += ACC * 16) {
+#pragma GCC unroll 4
+			for(size_t j = 0; j < ACC; j++) {
+				const size_t o = i + j * 16;
+				const __m512 d = _mm512_sub_ps(_mm512_loadu_ps(x + o), _mm512_loadu_ps(y + o));
+				sum[j] = _mm512_fmadd_ps(d, d, sum[j]);
+			}
+		}
+#pragma GCC unroll 4
+		for(size_t j = 1; j < ACC; j++) {
+			sum[0] = _mm512_add_ps(sum[0], sum[j]);
+		}
+		return horizontal_sum(sum[0]);
+	}
+};
+
+template <size_t DIM>
+struct IpFixed {
+	static float distance(const void* a, const void* b, const void*) {
+		const float* x = static_cast<const float*>(a);
+		const float* y = static_cast<const float*>(b);
+		constexpr size_t ACC = fixed_accumulators<DIM, 16>();
+
+		__m512 sum[ACC];
+#pragma GCC unroll 4
+		for(size_t j = 0; j < ACC; j++) {
+			sum[j] = _mm512_setzero_ps();
+		}
+#pragma GCC unroll 4
+		for(size_t i = 0; i < DIM; i += ACC * 16) {
+#pragma GCC unroll 4
+			for(size_t j = 0; j < ACC; j++) {
+				const size_t o = i + j * 16;
+				sum[j] = _mm512_fmadd_ps(_mm512_loadu_ps(x + o), _mm512_loadu_ps(y + o), sum[j]);
+			}
+		}
+#pragma GCC unroll 4
+		for(size_t j = 1; j < ACC; j++) {
+			sum[0] = _mm512_add_ps(sum[0], sum[j]);
+		}
+		return 1.0f - horizontal_sum(sum[0]);
+	}
+};
+
+// 16 dims as floats from a float, fp16 or bf16 vector
+struct Fp32 {
+	using Storage = float;
+	static __m512 load(const float* p) {
+		return _mm512_loadu_ps(p);
+	}
+};
+
+struct Fp16 {
+	using Storage = uint16_t;
+	static __m512 load(const uint16_t* p) {
+		return _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+	}
+};
+
+struct Bf16 {
+	using Storage = uint16_t;
+	static __m512 load(const uint16_t* p) {
+		const __m256i raw = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+		const __m512i h = _mm512_cvtepu16_epi32(raw);
+		return _mm512_castsi512_ps(_mm512_slli_epi32(h, 16));
+	}
+};
+
+/// @brief squared l2 of an X and a Y vector, converted to float and accumulated in float. The
+/// last partial block is copied into zero padded buffers, so the tail converts like the rest.
+template <typename X, typename Y>
+float l2_sqr_converted(const void* a, const void* b, const void* dim_ptr) {
+	const auto* x = static_cast<const typename X::Storage*>(a);
+	const auto* y = static_cast<const typename Y::Storage*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+
+	__m512 sum0 = _mm512_setzero_ps();
+	__m512 sum1 = _mm512_setzero_ps();
+	size_t i = 0;
+	for(; i + 32 <= dim; i += 32) {
+		const __m512 d0 = _mm512_sub_ps(X::load(x + i), Y::load(y + i));
+		const __m512 d1 = _mm512_sub_ps(X::load(x + i + 16), Y::load(y + i + 16));
+		sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+		sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+	}
+	if(i < dim) {
+		typename X::Storage x_tail[32] = {};
+		typename Y::Storage y_tail[32] = {};
+		for(size_t j = 0; i + j < dim; j++) {
+			x_tail[j] = x[i + j];
+			y_tail[j] = y[i + j];
+		}
+		const __m512 d0 = _mm512_sub_ps(X::load(x_tail), Y::load(y_tail));
+		const __m512 d1 = _mm512_sub_ps(X::load(x_tail + 16), Y::load(y_tail + 16));
+		sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+		sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+	}
+	return horizontal_sum(_mm512_add_ps(sum0, sum1));
+}
+
+} // namespace
+
+float l2_sqr_avx512(const void* a, const void* b, const void* dim_ptr) {
+	const float* x = static_cast<const float*>(a);
+	const float* y = static_cast<const float*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+
+	__m512 sum0 = _mm512_setzero_ps();
+	__m512 sum1 = _mm512_setzero_ps();
+	size_t i = 0;
+	for(; i + 32 <= dim; i += 32) {
+		const __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+		const __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16));
+		sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+		sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+	}
+	if(i + 16 <= dim) {
+		const __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+		sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+		i += 16;
+	}
+	// the tail is a masked load instead of a scalar loop
+	if(i < dim) {
+		const __mmask16 mask = static_cast<__mmask16>((1u << (dim - i)) - 1);
+		const __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x + i),
+									   _mm512_maskz_loadu_ps(mask, y + i));
+		sum1 = _mm512_fmadd_ps(d, d, sum1);
+	}
+	return horizontal_sum(_mm512_add_ps(sum0, sum1));
+}
+
+float ip_distance_avx512(const void* a, const void* b, const void* dim_ptr) {
+	const float* x = static_cast<const float*>(a);
+	const float* y = static_cast<const float*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+
+	__m512 sum0 = _mm512_setzero_ps();
+	__m512 sum1 = _mm512_setzero_ps();
+	size_t i = 0;
+	for(; i + 32 <= dim; i += 32) {
+		sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), sum0);
+		sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), sum1);
+	}
+	if(i + 16 <= dim) {
+		sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), sum0);
+		i += 16;
+	}
+	if(i < dim) {
+		const __mmask16 mask = static_cast<__mmask16>((1u << (dim - i)) - 1);
+		sum1 = _mm512_fmadd_ps(
+			_mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i), sum1);
+	}
+	return 1.0f - horizontal_sum(_mm512_add_ps(sum0, sum1));
+}
+
+float l2_sqr_bounded_avx512(
+	const void* a, const void* b, size_t dim, float bound, size_t* dims_done) {
+	const float* x = static_cast<const float*>(a);
+	const float* y = static_cast<const float*>(b);
+
+	__m512 sum0 = _mm512_setzero_ps();
+	__m512 sum1 = _mm512_setzero_ps();
+	size_t i = 0;
+	for(; i + ABANDON_BLOCK <= dim; i += ABANDON_BLOCK) {
+		for(size_t j = i; j < i + ABANDON_BLOCK; j += 32) {
+			const __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(x + j), _mm512_loadu_ps(y + j));
+			const __m512 d1 =
+				_mm512_sub_ps(_mm512_loadu_ps(x + j + 16), _mm512_loadu_ps(y + j + 16));
+			sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+			sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+		}
+		const float partial = horizontal_sum(_mm512_add_ps(sum0, sum1));
+		if(partial > bound) {
+			if(dims_done != nullptr) {
+				*dims_done = i + ABANDON_BLOCK;
+			}
+			return partial;
+		}
+	}
+	for(; i + 16 <= dim; i += 16) {
+		const __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+		sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+	}
+	if(i < dim) {
+		const __mmask16 mask = static_cast<__mmask16>((1u << (dim - i)) - 1);
+		const __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x + i),
+									   _mm512_maskz_loadu_ps(mask, y + i));
+		sum1 = _mm512_fmadd_ps(d, d, sum1);
+	}
+	if(dims_done != nullptr) {
+		*dims_done = dim;
+	}
+	return horizontal_sum(_mm512_add_ps(sum0, sum1));
+}
+
+void l2_sqr_batch_avx512(
+	const void* query, const void* const* vectors, size_t count, size_t dim, float* distances) {
+	const float* q = static_cast<const float*>(query);
+	size_t v = 0;
+	for(; v + BATCH_WIDTH <= count; v += BATCH_WIDTH) {
+		const float* x0 = static_cast<const float*>(vectors[v]);
+		const float* x1 = static_cast<const float*>(vectors[v + 1]);
+		const float* x2 = static_cast<const float*>(vectors[v + 2]);
+		const float* x3 = static_cast<const float*>(vectors[v + 3]);
+		__m512 sum0 = _mm512_setzero_ps();
+		__m512 sum1 = _mm512_setzero_ps();
+		__m512 sum2 = _mm512_setzero_ps();
+		__m512 sum3 = _mm512_setzero_ps();
+		size_t i = 0;
+		for(; i + 16 <= dim; i += 16) {
+			const __m512 qi = _mm512_loadu_ps(q + i);
+			const __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(x0 + i), qi);
+			const __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(x1 + i), qi);
+			const __m512 d2 = _mm512_sub_ps(_mm512_loadu_ps(x2 + i), qi);
+			const __m512 d3 = _mm512_sub_ps(_mm512_loadu_ps(x3 + i), qi);
+			sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+			sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+			sum2 = _mm512_fmadd_ps(d2, d2, sum2);
+			sum3 = _mm512_fmadd_ps(d3, d3, sum3);
+		}
+		if(i < dim) {
+			const __mmask16 mask = static_cast<__mmask16>((1u << (dim - i)) - 1);
+			const __m512 qi = _mm512_maskz_loadu_ps(mask, q + i);
+			const __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x0 + i), qi);
+			const __m512 d1 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x1 + i), qi);
+			const __m512 d2 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x2 + i), qi);
+			const __m512 d3 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x3 + i), qi);
+			sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+			sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+			sum2 = _mm512_fmadd_ps(d2, d2, sum2);
+			sum3 = _mm512_fmadd_ps(d3, d3, sum3);
+		}
+		distances[v] = horizontal_sum(sum0);
+		distances[v + 1] = horizontal_sum(sum1);
+		distances[v + 2] = horizontal_sum(sum2);
+		distances[v + 3] = horizontal_sum(sum3);
+	}
+	for(; v < count; v++) {
+		distances[v] = l2_sqr_avx512(q, vectors[v], &dim);
+	}
+}
+
+float sq8_l2_sqr_avx512(const void* a, const void* b, const void* param_ptr) {
+	const unsigned char* x = static_cast<const unsigned char*>(a);
+	const unsigned char* y = static_cast<const unsigned char*>(b);
+	const Sq8Param& param = *static_cast<const Sq8Param*>(param_ptr);
+	const size_t dim = param.dim;
+	const float* w = param.weights;
+
+	__m512 sum0 = _mm512_setzero_ps();
+	__m512 sum1 = _mm512_setzero_ps();
+	size_t i = 0;
+	for(; i + 32 <= dim; i += 32) {
+		const __m512 d0 = code_difference(x + i, y + i);
+		const __m512 d1 = code_difference(x + i + 16, y + i + 16);
+		sum0 = _mm512_fmadd_ps(_mm512_mul_ps(d0, d0), _mm512_loadu_ps(w + i), sum0);
+		sum1 = _mm512_fmadd_ps(_mm512_mul_ps(d1, d1), _mm512_loadu_ps(w + i + 16), sum1);
+	}
+	float sum = horizontal_sum(_mm512_add_ps(sum0, sum1));
+	for(; i < dim; i++) {
+		const float d = static_cast<float>(static_cast<int>(x[i]) - static_cast<int>(y[i]));
+		sum += w[i] * d * d;
+	}
+	return sum;
+}
+
+float pq_adc_avx512(const void* table_ptr, const void* code_ptr, const void* param_ptr) {
+	const float* table = static_cast<const float*>(table_ptr);
+	const unsigned char* code = static_cast<const unsigned char*>(code_ptr);
+	const size_t m = static_cast<const PqParam*>(param_ptr)->m;
+
+	// 16 subquantizers per gather: entry i * PQ_CENTROIDS + code[i] of the table
+	const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m512i rows = _mm512_mullo_epi32(lanes, _mm512_set1_epi32(PQ_CENTROIDS));
+	__m512 sum = _mm512_setzero_ps();
+	size_t i = 0;
+	for(; i + 16 <= m; i += 16) {
+		const __m512i c =
+			_mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(code + i)));
+		const __m512i index = _mm512_add_epi32(rows, c);
+		sum = _mm512_add_ps(sum, _mm512_i32gather_ps(index, table + i * PQ_CENTROIDS, 4));
+	}
+	float result = horizontal_sum(sum);
+	for(; i < m; i++) {
+		result += table[i * PQ_CENTROIDS + code[i]];
+	}
+	return result;
+}
+
+float l2_sqr_bf16_avx512(const void* a, const void* b, const void* dim_ptr) {
+	return l2_sqr_converted<Bf16, Bf16>(a, b, dim_ptr);
+}
+
+float l2_sqr_fp32_bf16_avx512(const void* a, const void* b, const void* dim_ptr) {
+	return l2_sqr_converted<Fp32, Bf16>(a, b, dim_ptr);
+}
+
+float l2_sqr_fp16_avx512(const void* a, const void* b, const void* dim_ptr) {
+	return l2_sqr_converted<Fp16, Fp16>(a, b, dim_ptr);
+}
+
+float l2_sqr_fp32_fp16_avx512(const void* a, const void* b, const void* dim_ptr) {
+	return l2_sqr_converted<Fp32, Fp16>(a, b, dim_ptr);
+}
+
+DistanceFunction l2_sqr_avx512_fixed(size_t dim) {
+	return find_fixed_kernel<L2Fixed>(dim, SpecializedDims{});
+}
+
+DistanceFunction ip_distance_avx512_fixed(size_t dim) {
+	return find_fixed_kernel<IpFixed>(dim, SpecializedDims{});
+}
+
+} // namespace kernels
+#endif
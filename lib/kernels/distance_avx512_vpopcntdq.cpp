@@ -0,0 +1,27 @@
+// Compiled with -mavx512f -mavx512vpopcntdq, only called when the cpu supports both.
+#include "lib/kernels/kernels.hpp"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+namespace kernels {
+
+size_t hamming_avx512_vpopcntdq(const uint64_t* a, const uint64_t* b, size_t words) {
+	// 8 words per step, the last partial step masked (a 960 bit code is one full step and 7 words)
+	__m512i sum = _mm512_setzero_si512();
+	size_t i = 0;
+	for(; i + 8 <= words; i += 8) {
+		const __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+		sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(x));
+	}
+	if(i < words) {
+		const __mmask8 rest = static_cast<__mmask8>((1u << (words - i)) - 1);
+		const __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi64(rest, a + i),
+										   _mm512_maskz_loadu_epi64(rest, b + i));
+		sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(x));
+	}
+	return static_cast<size_t>(_mm512_reduce_add_epi64(sum));
+}
+
+} // namespace kernels
+#endif
@@ -0,0 +1,318 @@
+// Baseline x86-64 kernels (sse2), compiled without extra flags.
+#include "lib/kernels/kernels.hpp"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+namespace kernels {
+
+namespace {
+
+inline float horizontal_sum(__m128 v) {
+	v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+	v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+	return _mm_cvtss_f32(v);
+}
+
+template <size_t DIM>
+struct L2Fixed {
+	static float distance(const void* a, const void* b, const void*) {
+		const float* x = static_cast<const float*>(a);
+		const float* y = static_cast<const float*>(b);
+		constexpr size_t ACC = fixed_accumulators<DIM, 4>();
+
+		__m128 sum[ACC];
+#pragma GCC unroll 4
+		for(size_t j = 0; j < ACC; j++) {
+			sum[j] = _mm_setzero_ps();
+		}
+#pragma GCC unroll 4
+		for(size_t i = 0; i < DIM; i += ACC * 4) {
+#pragma GCC unroll 4
+			for(size_t j = 0; j < ACC; j++) {
+				const size_t o = i + j * 4;
+				const __m128 d = _mm_sub_ps(_mm_loadu_ps(x + o), _mm_loadu_ps(y + o));
+				sum[j] = _mm_add_ps(sum[j], _mm_mul_ps(d, d));
+			}
+		}
+#pragma GCC unroll 4
+		for(size_t j = 1; j < ACC; j++) {
+			sum[0] = _mm_add_ps(sum[0], sum[j]);
+		}
+		return horizontal_sum(sum[0]);
+	}
+};
+
+template <size_t DIM>
+struct IpFixed {
+	static float distance(const void* a, const void* b, const void*) {
+		const float* x = static_cast<const float*>(a);
+		const float* y = static_cast<const float*>(b);
+		constexpr size_t ACC = fixed_accumulators<DIM, 4>();
+
+		__m128 sum[ACC];
+#pragma GCC unroll 4
+		for(size_t j = 0; j < ACC; j++) {
+			sum[j] = _mm_setzero_ps();
+		}
+#pragma GCC unroll 4
+		for(size_t i = 0; i < DIM; i += ACC * 4) {
+#pragma GCC unroll 4
+			for(size_t j = 0; j < ACC; j++) {
+				const size_t o = i + j * 4;
+				sum[j] = _mm_add_ps(sum[j], _mm_mul_ps(_mm_loadu_ps(x + o), _mm_loadu_ps(y + o)));
+			}
+		}
+#pragma GCC unroll 4
+		for(size_t j = 1; j < ACC; j++) {
+			sum[0] = _mm_add_ps(sum[0], sum[j]);
+		}
+		return 1.0f - horizontal_sum(sum[0]);
+	}
+};
+
+// 4 dims as floats from a float or bf16 vector (fp16 needs f16c, the avx2 level has it)
+struct Fp32 {
+	using Storage = float;
+	static __m128 load(const float* p) {
+		return _mm_loadu_ps(p);
+	}
+};
+
+struct Bf16 {
+	using Storage = uint16_t;
+	static __m128 load(const uint16_t* p) {
+		// interleaving zeros below the 16 bits is the shift into the upper half of a float
+		const __m128i h = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+		return _mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), h));
+	}
+};
+
+/// @brief squared l2 of an X and a Y vector, converted to float and accumulated in float. The
+/// last partial block is copied into zero padded buffers, so the tail converts like the rest.
+template <typename X, typename Y>
+float l2_sqr_converted(const void* a, const void* b, const void* dim_ptr) {
+	const auto* x = static_cast<const typename X::Storage*>(a);
+	const auto* y = static_cast<const typename Y::Storage*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	size_t i = 0;
+	for(; i + 8 <= dim; i += 8) {
+		const __m128 d0 = _mm_sub_ps(X::load(x + i), Y::load(y + i));
+		const __m128 d1 = _mm_sub_ps(X::load(x + i + 4), Y::load(y + i + 4));
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+	}
+	if(i < dim) {
+		typename X::Storage x_tail[8] = {};
+		typename Y::Storage y_tail[8] = {};
+		for(size_t j = 0; i + j < dim; j++) {
+			x_tail[j] = x[i + j];
+			y_tail[j] = y[i + j];
+		}
+		const __m128 d0 = _mm_sub_ps(X::load(x_tail), Y::load(y_tail));
+		const __m128 d1 = _mm_sub_ps(X::load(x_tail + 4), Y::load(y_tail + 4));
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+	}
+	return horizontal_sum(_mm_add_ps(sum0, sum1));
+}
+
+} // namespace
+
+float l2_sqr_sse(const void* a, const void* b, const void* dim_ptr) {
+	const float* x = static_cast<const float*>(a);
+	const float* y = static_cast<const float*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	size_t i = 0;
+	for(; i + 8 <= dim; i += 8) {
+		const __m128 d0 = _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i));
+		const __m128 d1 = _mm_sub_ps(_mm_loadu_ps(x + i + 4), _mm_loadu_ps(y + i + 4));
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+	}
+	float sum = horizontal_sum(_mm_add_ps(sum0, sum1));
+	for(; i < dim; i++) {
+		const float d = x[i] - y[i];
+		sum += d * d;
+	}
+	return sum;
+}
+
+float ip_distance_sse(const void* a, const void* b, const void* dim_ptr) {
+	const float* x = static_cast<const float*>(a);
+	const float* y = static_cast<const float*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	size_t i = 0;
+	for(; i + 8 <= dim; i += 8) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_loadu_ps(y + i + 4)));
+	}
+	float sum = horizontal_sum(_mm_add_ps(sum0, sum1));
+	for(; i < dim; i++) {
+		sum += x[i] * y[i];
+	}
+	return 1.0f - sum;
+}
+
+float l2_sqr_bounded_sse(
+	const void* a, const void* b, size_t dim, float bound, size_t* dims_done) {
+	const float* x = static_cast<const float*>(a);
+	const float* y = static_cast<const float*>(b);
+
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	size_t i = 0;
+	for(; i + ABANDON_BLOCK <= dim; i += ABANDON_BLOCK) {
+		for(size_t j = i; j < i + ABANDON_BLOCK; j += 8) {
+			const __m128 d0 = _mm_sub_ps(_mm_loadu_ps(x + j), _mm_loadu_ps(y + j));
+			const __m128 d1 = _mm_sub_ps(_mm_loadu_ps(x + j + 4), _mm_loadu_ps(y + j + 4));
+			sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+			sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+		}
+		const float partial = horizontal_sum(_mm_add_ps(sum0, sum1));
+		if(partial > bound) {
+			if(dims_done != nullptr) {
+				*dims_done = i + ABANDON_BLOCK;
+			}
+			return partial;
+		}
+	}
+	if(dims_done != nullptr) {
+		*dims_done = dim;
+	}
+	// the last partial block goes through the generic kernel
+	const size_t rest = dim - i;
+	const float sum = horizontal_sum(_mm_add_ps(sum0, sum1));
+	return rest > 0 ? sum + l2_sqr_sse(x + i, y + i, &rest) : sum;
+}
+
+void l2_sqr_batch_sse(
+	const void* query, const void* const* vectors, size_t count, size_t dim, float* distances) {
+	const float* q = static_cast<const float*>(query);
+	size_t v = 0;
+	for(; v + BATCH_WIDTH <= count; v += BATCH_WIDTH) {
+		const float* x0 = static_cast<const float*>(vectors[v]);
+		const float* x1 = static_cast<const float*>(vectors[v + 1]);
+		const float* x2 = static_cast<const float*>(vectors[v + 2]);
+		const float* x3 = static_cast<const float*>(vectors[v + 3]);
+		__m128 sum0 = _mm_setzero_ps();
+		__m128 sum1 = _mm_setzero_ps();
+		__m128 sum2 = _mm_setzero_ps();
+		__m128 sum3 = _mm_setzero_ps();
+		size_t i = 0;
+		for(; i + 4 <= dim; i += 4) {
+			const __m128 qi = _mm_loadu_ps(q + i);
+			const __m128 d0 = _mm_sub_ps(_mm_loadu_ps(x0 + i), qi);
+			const __m128 d1 = _mm_sub_ps(_mm_loadu_ps(x1 + i), qi);
+			const __m128 d2 = _mm_sub_ps(_mm_loadu_ps(x2 + i), qi);
+			const __m128 d3 = _mm_sub_ps(_mm_loadu_ps(x3 + i), qi);
+			sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+			sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+			sum2 = _mm_add_ps(sum2, _mm_mul_ps(d2, d2));
+			sum3 = _mm_add_ps(sum3, _mm_mul_ps(d3, d3));
+		}
+		distances[v] = horizontal_sum(sum0);
+		distances[v + 1] = horizontal_sum(sum1);
+		distances[v + 2] = horizontal_sum(sum2);
+		distances[v + 3] = horizontal_sum(sum3);
+		for(; i < dim; i++) {
+			const float d0 = x0[i] - q[i];
+			const float d1 = x1[i] - q[i];
+			const float d2 = x2[i] - q[i];
+			const float d3 = x3[i] - q[i];
+			distances[v] += d0 * d0;
+			distances[v + 1] += d1 * d1;
+			distances[v + 2] += d2 * d2;
+			distances[v + 3] += d3 * d3;
+		}
+	}
+	for(; v < count; v++) {
+		distances[v] = l2_sqr_sse(q, vectors[v], &dim);
+	}
+}
+
+float sq8_l2_sqr_sse(const void* a, const void* b, const void* param_ptr) {
+	const unsigned char* x = static_cast<const unsigned char*>(a);
+	const unsigned char* y = static_cast<const unsigned char*>(b);
+	const Sq8Param& param = *static_cast<const Sq8Param*>(param_ptr);
+	const size_t dim = param.dim;
+	const float* w = param.weights;
+
+	// sse2 has no pmovzx: widen 16 codes to int16 with a zero unpack, subtract (-255..255 fits),
+	// then sign extend to int32 with an unpack against itself and an arithmetic shift
+	const __m128i zero = _mm_setzero_si128();
+	__m128 sum0 = _mm_setzero_ps();
+	__m128 sum1 = _mm_setzero_ps();
+	size_t i = 0;
+	for(; i + 16 <= dim; i += 16) {
+		const __m128i xi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i));
+		const __m128i yi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + i));
+		const __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(xi, zero), _mm_unpacklo_epi8(yi, zero));
+		const __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(xi, zero), _mm_unpackhi_epi8(yi, zero));
+		const __m128 d0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16));
+		const __m128 d1 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16));
+		const __m128 d2 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16));
+		const __m128 d3 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16));
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_mul_ps(d0, d0), _mm_loadu_ps(w + i)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_mul_ps(d1, d1), _mm_loadu_ps(w + i + 4)));
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_mul_ps(d2, d2), _mm_loadu_ps(w + i + 8)));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_mul_ps(d3, d3), _mm_loadu_ps(w + i + 12)));
+	}
+	float sum = horizontal_sum(_mm_add_ps(sum0, sum1));
+	for(; i < dim; i++) {
+		const float d = static_cast<float>(static_cast<int>(x[i]) - static_cast<int>(y[i]));
+		sum += w[i] * d * d;
+	}
+	return sum;
+}
+
+float pq_adc_sse(const void* table_ptr, const void* code_ptr, const void* param_ptr) {
+	const float* table = static_cast<const float*>(table_ptr);
+	const unsigned char* code = static_cast<const unsigned char*>(code_ptr);
+	const size_t m = static_cast<const PqParam*>(param_ptr)->m;
+
+	// no gather before avx2, four independent chains of lookups hide the add latency
+	float sum0 = 0.0f;
+	float sum1 = 0.0f;
+	float sum2 = 0.0f;
+	float sum3 = 0.0f;
+	size_t i = 0;
+	for(; i + 4 <= m; i += 4) {
+		sum0 += table[i * PQ_CENTROIDS + code[i]];
+		sum1 += table[(i + 1) * PQ_CENTROIDS + code[i + 1]];
+		sum2 += table[(i + 2) * PQ_CENTROIDS + code[i + 2]];
+		sum3 += table[(i + 3) * PQ_CENTROIDS + code[i + 3]];
+	}
+	for(; i < m; i++) {
+		sum0 += table[i * PQ_CENTROIDS + code[i]];
+	}
+	return (sum0 + sum1) + (sum2 + sum3);
+}
+
+float l2_sqr_bf16_sse(const void* a, const void* b, const void* dim_ptr) {
+	return l2_sqr_converted<Bf16, Bf16>(a, b, dim_ptr);
+}
+
+float l2_sqr_fp32_bf16_sse(const void* a, const void* b, const void* dim_ptr) {
+	return l2_sqr_converted<Fp32, Bf16>(a, b, dim_ptr);
+}
+
+DistanceFunction l2_sqr_sse_fixed(size_t dim) {
+	return find_fixed_kernel<L2Fixed>(dim, SpecializedDims{});
+}
+
+DistanceFunction ip_distance_sse_fixed(size_t dim) {
+	return find_fixed_kernel<IpFixed>(dim, SpecializedDims{});
+}
+
+} // namespace kernels
+#endif
@@ -0,0 +1,330 @@
+/* Distance kernel declarations, the only header the per ISA translation units include */
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// lib/kernels/distance_*.cpp are compiled with -mavx2 / -mavx512f. Any inline function they
+// instantiate from a header (std::string, std::vector, ...) could be the copy the linker keeps for
+// the whole program and fault on a cpu without that ISA, so they only include this file, which
+// has nothing but the kernels and constexpr helpers.
+
+namespace kernels {
+
+/// @brief hnswlib::DISTFUNC<float>
+using DistanceFunction = float (*)(const void*, const void*, const void*);
+
+/// @brief squared l2 that gives up once the partial sum exceeds `bound`
+/// @param dims_done if not null, set to the dims summed before returning
+/// @return the distance, or a partial sum larger than `bound` if it was abandoned
+using BoundedDistanceFunction =
+	float (*)(const void* a, const void* b, size_t dim, float bound, size_t* dims_done);
+
+/// @brief squared l2 from one query to `count` vectors, written to `distances`. The vectors are
+/// streamed side by side (four at a time), so each query block is loaded once per four vectors
+/// and four independent streams of loads are in flight.
+using BatchDistanceFunction = void (*)(
+	const void* query, const void* const* vectors, size_t count, size_t dim, float* distances);
+
+/// @brief number of differing bits of two binary codes of `words` 64 bit words (lib/binary.hpp)
+using HammingFunction = size_t (*)(const uint64_t* a, const uint64_t* b, size_t words);
+
+/// @brief decode the vbyte encoded level 0 neighbor list of element `id` (lib/compact.hpp) into
+/// `out`, which has room for the count rounded up to LINK_GROUP
+/// @return the number of neighbors
+using LinkDecodeFunction = size_t (*)(const uint8_t* list, uint32_t id, uint32_t* out);
+
+/// @brief vectors a batch kernel streams side by side
+constexpr size_t BATCH_WIDTH = 4;
+
+/// @brief dims summed between two checks of a bounded kernel: a horizontal sum per block is
+/// cheap against 128 dims of loads, a finer check rarely abandons sooner
+constexpr size_t ABANDON_BLOCK = 128;
+
+/// @brief dist_func_param of the sq8 kernels (lib/sq8.hpp). Code c of dim d stands for
+/// min[d] + c * step[d], so the squared l2 of two codes is the sum of weights[d] * (a - b)^2 with
+/// weights[d] = step[d]^2. dim comes first, like the size_t of the float kernels.
+struct Sq8Param {
+	size_t dim;
+	const float* weights;
+};
+
+/// @brief centroids per subquantizer of a pq code, one byte each
+constexpr size_t PQ_CENTROIDS = 256;
+
+/// @brief dist_func_param of the pq kernels (lib/pq.hpp). The first argument of a pq distance is
+/// the query's lookup table, m rows of PQ_CENTROIDS squared l2s from the query's subvector to each
+/// centroid, the second a code of m bytes. dim (of the vectors) comes first like elsewhere.
+struct PqParam {
+	size_t dim;
+	size_t m;
+};
+
+/// @brief values per control byte of a vbyte neighbor list
+constexpr size_t LINK_GROUP = 4;
+
+/// @brief bytes a vbyte decoder may read past the end of the last list, a group is loaded whole
+constexpr size_t LINK_PADDING = 16;
+
+constexpr uint32_t zigzag_encode(int32_t v) {
+	return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+}
+
+constexpr int32_t zigzag_decode(uint32_t v) {
+	return static_cast<int32_t>((v >> 1) ^ (0u - (v & 1u)));
+}
+
+/// @brief the float an ieee half (fp16) stands for
+constexpr float fp16_to_float(uint16_t h) {
+	const uint32_t sign = static_cast<uint32_t>(h & 0x8000u) << 16;
+	const uint32_t exponent = (h >> 10) & 0x1fu;
+	const uint32_t mantissa = h & 0x3ffu;
+	if(exponent == 0) {
+		// zero or subnormal: mantissa * 2^-24
+		const float value = static_cast<float>(mantissa) * 5.9604645e-8f;
+		return sign != 0 ? -value : value;
+	}
+	if(exponent == 0x1f) {
+		return std::bit_cast<float>(sign | 0x7f800000u | (mantissa << 13));
+	}
+	return std::bit_cast<float>(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+/// @brief the float a bfloat16 stands for, its upper half
+constexpr float bf16_to_float(uint16_t h) {
+	return std::bit_cast<float>(static_cast<uint32_t>(h) << 16);
+}
+
+/// @brief dims with a compile time specialized kernel
+using SpecializedDims = std::integer_sequence<size_t, 128, 768, 960, 1536>;
+
+/// @brief Kernel<DIM>::distance for the DIM of `Dims` that equals `dim`
+/// @return nullptr if `dim` is not specialized
+template <template <size_t> typename Kernel, size_t... Dims>
+DistanceFunction find_fixed_kernel(size_t dim, std::integer_sequence<size_t, Dims...>) {
+	DistanceFunction found = nullptr;
+	((dim == Dims ? (found = Kernel<Dims>::distance, true) : false) || ...);
+	return found;
+}
+
+/// @brief independent accumulators of a fixed dim kernel with `WIDTH` floats per register: four
+/// cover the fma latency, short dims that are not a multiple of four registers get fewer
+template <size_t DIM, size_t WIDTH>
+constexpr size_t fixed_accumulators() {
+	static_assert(DIM % WIDTH == 0, "specialized dims must be a multiple of the register width");
+	return DIM % (4 * WIDTH) == 0 ? 4 : DIM % (2 * WIDTH) == 0 ? 2 : 1;
+}
+
+inline float l2_sqr_scalar(const void* a, const void* b, const void* dim_ptr) {
+	const float* x = static_cast<const float*>(a);
+	const float* y = static_cast<const float*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+	float sum = 0.0f;
+	for(size_t i = 0; i < dim; i++) {
+		const float d = x[i] - y[i];
+		sum += d * d;
+	}
+	return sum;
+}
+
+inline float l2_sqr_bounded_scalar(
+	const void* a, const void* b, size_t dim, float bound, size_t* dims_done) {
+	const float* x = static_cast<const float*>(a);
+	const float* y = static_cast<const float*>(b);
+	float sum = 0.0f;
+	size_t i = 0;
+	while(i < dim) {
+		const size_t end = i + ABANDON_BLOCK < dim ? i + ABANDON_BLOCK : dim;
+		for(; i < end; i++) {
+			const float d = x[i] - y[i];
+			sum += d * d;
+		}
+		if(sum > bound) {
+			break;
+		}
+	}
+	if(dims_done != nullptr) {
+		*dims_done = i;
+	}
+	return sum;
+}
+
+inline void l2_sqr_batch_scalar(
+	const void* query, const void* const* vectors, size_t count, size_t dim, float* distances) {
+	for(size_t v = 0; v < count; v++) {
+		distances[v] = l2_sqr_scalar(query, vectors[v], &dim);
+	}
+}
+
+inline float sq8_l2_sqr_scalar(const void* a, const void* b, const void* param_ptr) {
+	const unsigned char* x = static_cast<const unsigned char*>(a);
+	const unsigned char* y = static_cast<const unsigned char*>(b);
+	const Sq8Param& param = *static_cast<const Sq8Param*>(param_ptr);
+	float sum = 0.0f;
+	for(size_t i = 0; i < param.dim; i++) {
+		const float d = static_cast<float>(static_cast<int>(x[i]) - static_cast<int>(y[i]));
+		sum += param.weights[i] * d * d;
+	}
+	return sum;
+}
+
+inline float pq_adc_scalar(const void* table_ptr, const void* code_ptr, const void* param_ptr) {
+	const float* table = static_cast<const float*>(table_ptr);
+	const unsigned char* code = static_cast<const unsigned char*>(code_ptr);
+	const size_t m = static_cast<const PqParam*>(param_ptr)->m;
+	float sum = 0.0f;
+	for(size_t i = 0; i < m; i++) {
+		sum += table[i * PQ_CENTROIDS + code[i]];
+	}
+	return sum;
+}
+
+// half precision vectors (lib/half.hpp), accumulated in float: both stored (inserts) or a float
+// query against a stored vector (searches)
+inline float l2_sqr_fp16_scalar(const void* a, const void* b, const void* dim_ptr) {
+	const uint16_t* x = static_cast<const uint16_t*>(a);
+	const uint16_t* y = static_cast<const uint16_t*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+	float sum = 0.0f;
+	for(size_t i = 0; i < dim; i++) {
+		const float d = fp16_to_float(x[i]) - fp16_to_float(y[i]);
+		sum += d * d;
+	}
+	return sum;
+}
+
+inline float l2_sqr_fp32_fp16_scalar(const void* a, const void* b, const void* dim_ptr) {
+	const float* x = static_cast<const float*>(a);
+	const uint16_t* y = static_cast<const uint16_t*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+	float sum = 0.0f;
+	for(size_t i = 0; i < dim; i++) {
+		const float d = x[i] - fp16_to_float(y[i]);
+		sum += d * d;
+	}
+	return sum;
+}
+
+inline float l2_sqr_bf16_scalar(const void* a, const void* b, const void* dim_ptr) {
+	const uint16_t* x = static_cast<const uint16_t*>(a);
+	const uint16_t* y = static_cast<const uint16_t*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+	float sum = 0.0f;
+	for(size_t i = 0; i < dim; i++) {
+		const float d = bf16_to_float(x[i]) - bf16_to_float(y[i]);
+		sum += d * d;
+	}
+	return sum;
+}
+
+inline float l2_sqr_fp32_bf16_scalar(const void* a, const void* b, const void* dim_ptr) {
+	const float* x = static_cast<const float*>(a);
+	const uint16_t* y = static_cast<const uint16_t*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+	float sum = 0.0f;
+	for(size_t i = 0; i < dim; i++) {
+		const float d = x[i] - bf16_to_float(y[i]);
+		sum += d * d;
+	}
+	return sum;
+}
+
+inline size_t hamming_scalar(const uint64_t* a, const uint64_t* b, size_t words) {
+	size_t bits = 0;
+	for(size_t i = 0; i < words; i++) {
+		bits += static_cast<size_t>(std::popcount(a[i] ^ b[i]));
+	}
+	return bits;
+}
+
+/// @brief a vbyte neighbor list (stream vbyte): the count n as uint16, n / LINK_GROUP control
+/// bytes rounded up, then the values. Bits 2 * (i % 4) of control byte i / 4 are the bytes of value
+/// i minus one, the value is stored little endian in that many bytes. The neighbors are sorted:
+/// value 0 is the zigzag encoded difference of the first one to `id`, value i the difference to
+/// neighbor i - 1. The last group is padded with one byte zeros.
+inline size_t decode_links_scalar(const uint8_t* list, uint32_t id, uint32_t* out) {
+	const size_t count = list[0] | static_cast<size_t>(list[1]) << 8;
+	const uint8_t* control = list + 2;
+	const uint8_t* data = control + (count + LINK_GROUP - 1) / LINK_GROUP;
+	uint32_t neighbor = id;
+	for(size_t i = 0; i < count; i++) {
+		const size_t bytes = ((control[i / LINK_GROUP] >> (2 * (i % LINK_GROUP))) & 3u) + 1;
+		uint32_t value = 0;
+		for(size_t b = 0; b < bytes; b++) {
+			value |= static_cast<uint32_t>(data[b]) << (8 * b);
+		}
+		data += bytes;
+		neighbor += i == 0 ? static_cast<uint32_t>(zigzag_decode(value)) : value;
+		out[i] = neighbor;
+	}
+	return count;
+}
+
+inline float ip_distance_scalar(const void* a, const void* b, const void* dim_ptr) {
+	const float* x = static_cast<const float*>(a);
+	const float* y = static_cast<const float*>(b);
+	const size_t dim = *static_cast<const size_t*>(dim_ptr);
+	float sum = 0.0f;
+	for(size_t i = 0; i < dim; i++) {
+		sum += x[i] * y[i];
+	}
+	return 1.0f - sum;
+}
+
+#if defined(__x86_64__)
+// lib/kernels/distance_sse.cpp
+float l2_sqr_sse(const void* a, const void* b, const void* dim_ptr);
+float ip_distance_sse(const void* a, const void* b, const void* dim_ptr);
+DistanceFunction l2_sqr_sse_fixed(size_t dim);
+DistanceFunction ip_distance_sse_fixed(size_t dim);
+float l2_sqr_bounded_sse(
+	const void* a, const void* b, size_t dim, float bound, size_t* dims_done);
+void l2_sqr_batch_sse(
+	const void* query, const void* const* vectors, size_t count, size_t dim, float* distances);
+float sq8_l2_sqr_sse(const void* a, const void* b, const void* param_ptr);
+float pq_adc_sse(const void* table_ptr, const void* code_ptr, const void* param_ptr);
+float l2_sqr_bf16_sse(const void* a, const void* b, const void* dim_ptr);
+float l2_sqr_fp32_bf16_sse(const void* a, const void* b, const void* dim_ptr);
+
+// lib/kernels/distance_avx2.cpp, avx2 + fma + f16c
+float l2_sqr_avx2(const void* a, const void* b, const void* dim_ptr);
+float ip_distance_avx2(const void* a, const void* b, const void* dim_ptr);
+DistanceFunction l2_sqr_avx2_fixed(size_t dim);
+DistanceFunction ip_distance_avx2_fixed(size_t dim);
+float l2_sqr_bounded_avx2(
+	const void* a, const void* b, size_t dim, float bound, size_t* dims_done);
+void l2_sqr_batch_avx2(
+	const void* query, const void* const* vectors, size_t count, size_t dim, float* distances);
+float sq8_l2_sqr_avx2(const void* a, const void* b, const void* param_ptr);
+float pq_adc_avx2(const void* table_ptr, const void* code_ptr, const void* param_ptr);
+float l2_sqr_bf16_avx2(const void* a, const void* b, const void* dim_ptr);
+float l2_sqr_fp32_bf16_avx2(const void* a, const void* b, const void* dim_ptr);
+float l2_sqr_fp16_avx2(const void* a, const void* b, const void* dim_ptr);
+float l2_sqr_fp32_fp16_avx2(const void* a, const void* b, const void* dim_ptr);
+size_t hamming_avx2(const uint64_t* a, const uint64_t* b, size_t words);
+size_t decode_links_avx2(const uint8_t* list, uint32_t id, uint32_t* out);
+
+// lib/kernels/distance_avx512.cpp, avx512f
+float l2_sqr_avx512(const void* a, const void* b, const void* dim_ptr);
+float ip_distance_avx512(const void* a, const void* b, const void* dim_ptr);
+DistanceFunction l2_sqr_avx512_fixed(size_t dim);
+DistanceFunction ip_distance_avx512_fixed(size_t dim);
+float l2_sqr_bounded_avx512(
+	const void* a, const void* b, size_t dim, float bound, size_t* dims_done);
+void l2_sqr_batch_avx512(
+	const void* query, const void* const* vectors, size_t count, size_t dim, float* distances);
+float sq8_l2_sqr_avx512(const void* a, const void* b, const void* param_ptr);
+float pq_adc_avx512(const void* table_ptr, const void* code_ptr, const void* param_ptr);
+float l2_sqr_bf16_avx512(const void* a, const void* b, const void* dim_ptr);
+float l2_sqr_fp32_bf16_avx512(const void* a, const void* b, const void* dim_ptr);
+float l2_sqr_fp16_avx512(const void* a, const void* b, const void* dim_ptr);
+float l2_sqr_fp32_fp16_avx512(const void* a, const void* b, const void* dim_ptr);
+
+// lib/kernels/distance_avx512_vpopcntdq.cpp, avx512f + avx512vpopcntdq, which not every avx512
+// cpu has: the avx512 level uses it if the cpu does and the avx2 kernel otherwise
+size_t hamming_avx512_vpopcntdq(const uint64_t* a, const uint64_t* b, size_t words);
+#endif
+
+} // namespace kernels
@@ -0,0 +1,126 @@
+/* PCA projected hnsw index: the graph over the leading components, results reranked in full */
+#pragma once
+
+#include <cstdint>
+#include <faiss/VectorTransform.h>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lib/distance.hpp"
+
+// GIST's 960 dims are far from independent, most of the variance is in a few hundred principal
+// components. A pca index is an ordinary float l2 index over the vectors projected to the leading
+// out_dim components (faiss::PCAMatrix trained on a sample of the base set): level 0 shrinks with
+// out_dim and so does every distance of a search. The projection is saved next to the index
+// (<index>.pca). A search projects the query, traverses with the index' ef and reranks the ef
+// candidates with the full dimensional l2 against the base set (HnswSearcher::use_query_coder).
+
+/// @brief y = A x + b to the leading principal components
+class PcaProjection : public QueryCoder {
+public:
+	/// @brief principal components of the `n` vectors of `data` (a sample of the base set)
+	static PcaProjection train(const float* data, size_t n, size_t dim, size_t out_dim) {
+		if(out_dim == 0 || out_dim > dim) {
+			throw std::runtime_error(
+				std::format("pca: cannot project {} dims to {}", dim, out_dim));
+		}
+		faiss::PCAMatrix pca(dim, out_dim);
+		pca.train(n, data);
+		return PcaProjection(dim, out_dim, std::move(pca.A), std::move(pca.b));
+	}
+
+	/// @throw std::runtime_error if `src` is not a projection written by save()
+	static PcaProjection load(const std::filesystem::path& src) {
+		std::ifstream fin(src, std::ios::binary);
+		if(!fin) {
+			throw std::runtime_error(std::format("could not open filename {}", src.string()));
+		}
+		uint64_t header[2] = {};
+		fin.read(reinterpret_cast<char*>(header), sizeof(header));
+		const size_t dim = header[0];
+		const size_t out_dim = header[1];
+		if(!fin || out_dim == 0 || out_dim > dim) {
+			throw std::runtime_error(std::format("could not read projection {}", src.string()));
+		}
+		std::vector<float> matrix(out_dim * dim);
+		std::vector<float> bias(out_dim);
+		fin.read(reinterpret_cast<char*>(matrix.data()), matrix.size() * sizeof(float));
+		fin.read(reinterpret_cast<char*>(bias.data()), bias.size() * sizeof(float));
+		if(!fin) {
+			throw std::runtime_error(std::format("could not read projection {}", src.string()));
+		}
+		return PcaProjection(dim, out_dim, std::move(matrix), std::move(bias));
+	}
+
+	/// @brief dim and out_dim as uint64, then A (out_dim x dim floats, row major) and b
+	void save(const std::filesystem::path& dst) const {
+		std::ofstream fout(dst, std::ios::binary);
+		if(!fout) {
+			throw std::runtime_error(std::format("could not open filename {}", dst.string()));
+		}
+		const uint64_t header[2] = { dim_, out_dim_ };
+		fout.write(reinterpret_cast<const char*>(header), sizeof(header));
+		fout.write(reinterpret_cast<const char*>(matrix_.data()), matrix_.size() * sizeof(float));
+		fout.write(reinterpret_cast<const char*>(bias_.data()), bias_.size() * sizeof(float));
+	}
+
+	size_t dim() const override {
+		return dim_;
+	}
+
+	size_t out_dim() const {
+		return out_dim_;
+	}
+
+	/// @param out out_dim() floats
+	void project(const float* x, float* out) const {
+		// column by column: y += x[j] * A[:, j] vectorizes, a dot product per row would not
+		// (a float sum is not reassociated without -ffast-math)
+		std::copy(bias_.begin(), bias_.end(), out);
+		for(size_t j = 0; j < dim_; j++) {
+			const float xj = x[j];
+			const float* column = columns_.data() + j * out_dim_;
+			for(size_t i = 0; i < out_dim_; i++) {
+				out[i] += xj * column[i];
+			}
+		}
+	}
+
+	size_t query_size() const override {
+		return out_dim_ * sizeof(float);
+	}
+
+	void encode_query(const float* query, void* out) const override {
+		project(query, static_cast<float*>(out));
+	}
+
+private:
+	PcaProjection(size_t dim, size_t out_dim, std::vector<float> matrix, std::vector<float> bias)
+		: dim_(dim)
+		, out_dim_(out_dim)
+		, matrix_(std::move(matrix))
+		, bias_(std::move(bias))
+		, columns_(matrix_.size()) {
+		for(size_t i = 0; i < out_dim_; i++) {
+			for(size_t j = 0; j < dim_; j++) {
+				columns_[j * out_dim_ + i] = matrix_[i * dim_ + j];
+			}
+		}
+	}
+
+	size_t dim_;
+	size_t out_dim_;
+	// faiss' A, row major, and its columns
+	std::vector<float> matrix_;
+	std::vector<float> bias_;
+	std::vector<float> columns_;
+};
+
+/// @brief where the projection of the pca index at `index_path` is saved
+inline std::filesystem::path pca_projection_path(const std::filesystem::path& index_path) {
+	return index_path.string() + ".pca";
+}
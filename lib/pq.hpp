@@ -0,0 +1,236 @@
+/* Product quantized hnsw index: m byte codes in the graph, distances from query lookup tables */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <faiss/VectorTransform.h>
+#include <faiss/impl/ProductQuantizer.h>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <hnswlib/hnswlib.h>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lib/distance.hpp"
+
+// A vector is split into m subvectors of dim / m dims, each stored as the byte index of the
+// nearest of 256 centroids trained for its subspace (faiss::ProductQuantizer on a sample of the
+// base set), optionally after a rotation that balances the variance over the subspaces
+// (faiss::OPQMatrix). A GIST vector becomes m bytes instead of 3840.
+//
+// A search computes the squared l2 from every query subvector to every centroid once (the lookup
+// table, m * 256 floats) and the distance to a code is the sum of m table entries (asymmetric
+// distance computation, the kernels gather 8 or 16 entries at once). The hnswlib index is a
+// HierarchicalNSW over PqSpace whose "query" is that table. hnswlib inserts by comparing two
+// stored elements, which a table lookup cannot do, so build_hnsw builds the graph on the float
+// vectors and then swaps in the codes. The quantizer is saved next to the index (<index>.pq).
+
+/// @brief product quantizer with 256 centroids per subspace and an optional rotation
+class PqQuantizer : public QueryCoder {
+public:
+	/// @brief train on the `n` vectors of `data` (a sample of the base set)
+	/// @param m subquantizers, must divide dim
+	/// @param opq learn a rotation first (faiss::OPQMatrix)
+	static PqQuantizer train(const float* data, size_t n, size_t dim, size_t m, bool opq) {
+		if(m == 0 || dim % m != 0) {
+			throw std::runtime_error(std::format("pq: {} subquantizers do not divide {}", m, dim));
+		}
+		std::vector<float> rotation;
+		std::vector<float> rotated;
+		if(opq) {
+			faiss::OPQMatrix matrix(dim, m);
+			matrix.train(n, data);
+			rotation = matrix.A;
+			rotated.resize(n * dim);
+			matrix.apply_noalloc(n, data, rotated.data());
+			data = rotated.data();
+		}
+		faiss::ProductQuantizer pq(dim, m, 8);
+		pq.train(n, data);
+		return PqQuantizer(dim, m, std::move(pq.centroids), std::move(rotation));
+	}
+
+	/// @throw std::runtime_error if `src` is not a quantizer written by save()
+	static PqQuantizer load(const std::filesystem::path& src) {
+		std::ifstream fin(src, std::ios::binary);
+		if(!fin) {
+			throw std::runtime_error(std::format("could not open filename {}", src.string()));
+		}
+		uint64_t header[3] = {};
+		fin.read(reinterpret_cast<char*>(header), sizeof(header));
+		const size_t dim = header[0];
+		const size_t m = header[1];
+		if(!fin || m == 0 || dim % m != 0) {
+			throw std::runtime_error(std::format("could not read quantizer {}", src.string()));
+		}
+		std::vector<float> centroids(dim * kernels::PQ_CENTROIDS);
+		std::vector<float> rotation(header[2] != 0 ? dim * dim : 0);
+		fin.read(reinterpret_cast<char*>(centroids.data()), centroids.size() * sizeof(float));
+		fin.read(reinterpret_cast<char*>(rotation.data()), rotation.size() * sizeof(float));
+		if(!fin) {
+			throw std::runtime_error(std::format("could not read quantizer {}", src.string()));
+		}
+		return PqQuantizer(dim, m, std::move(centroids), std::move(rotation));
+	}
+
+	/// @brief dim, m and whether there is a rotation as uint64, then the centroids (m * 256 *
+	/// dim / m floats, faiss' layout) and the dim x dim rotation if there is one
+	void save(const std::filesystem::path& dst) const {
+		std::ofstream fout(dst, std::ios::binary);
+		if(!fout) {
+			throw std::runtime_error(std::format("could not open filename {}", dst.string()));
+		}
+		const uint64_t header[3] = { dim_, m_, rotated() ? 1u : 0u };
+		fout.write(reinterpret_cast<const char*>(header), sizeof(header));
+		fout.write(reinterpret_cast<const char*>(centroids_.data()),
+				   centroids_.size() * sizeof(float));
+		fout.write(reinterpret_cast<const char*>(rotation_.data()),
+				   rotation_.size() * sizeof(float));
+	}
+
+	size_t dim() const override {
+		return dim_;
+	}
+
+	size_t m() const {
+		return m_;
+	}
+
+	bool rotated() const {
+		return !rotation_.empty();
+	}
+
+	/// @brief index of the nearest centroid of every subvector
+	void encode(const float* x, uint8_t* code) const {
+		thread_local std::vector<float> buffer;
+		x = rotate(x, buffer);
+		const hnswlib::DISTFUNC<float> l2 = distance_kernels().l2;
+		for(size_t i = 0; i < m_; i++) {
+			float best = std::numeric_limits<float>::max();
+			for(size_t c = 0; c < kernels::PQ_CENTROIDS; c++) {
+				const float d = l2(x + i * dsub_, centroid(i, c), &dsub_);
+				if(d < best) {
+					best = d;
+					code[i] = static_cast<uint8_t>(c);
+				}
+			}
+		}
+	}
+
+	size_t query_size() const override {
+		return m_ * kernels::PQ_CENTROIDS * sizeof(float);
+	}
+
+	/// @brief the lookup table of `query`: m rows of the squared l2 to each centroid
+	void encode_query(const float* query, void* out) const override {
+		thread_local std::vector<float> buffer;
+		query = rotate(query, buffer);
+		float* table = static_cast<float*>(out);
+		// a subvector has only a few dims, so the loops run over the 256 centroids of a subspace
+		// (by_dim_, contiguous per dim) and vectorize, the table costs one pass over the centroids
+		for(size_t i = 0; i < m_; i++) {
+			float* row = table + i * kernels::PQ_CENTROIDS;
+			std::fill_n(row, kernels::PQ_CENTROIDS, 0.0f);
+			for(size_t j = 0; j < dsub_; j++) {
+				const float q = query[i * dsub_ + j];
+				const float* c = by_dim_.data() + (i * dsub_ + j) * kernels::PQ_CENTROIDS;
+				for(size_t k = 0; k < kernels::PQ_CENTROIDS; k++) {
+					const float d = q - c[k];
+					row[k] += d * d;
+				}
+			}
+		}
+	}
+
+private:
+	PqQuantizer(size_t dim, size_t m, std::vector<float> centroids, std::vector<float> rotation)
+		: dim_(dim)
+		, m_(m)
+		, dsub_(dim / m)
+		, centroids_(std::move(centroids))
+		, by_dim_(centroids_.size())
+		, rotation_(std::move(rotation))
+		, columns_(rotation_.size()) {
+		for(size_t i = 0; i < m_; i++) {
+			for(size_t c = 0; c < kernels::PQ_CENTROIDS; c++) {
+				for(size_t j = 0; j < dsub_; j++) {
+					by_dim_[(i * dsub_ + j) * kernels::PQ_CENTROIDS + c] = centroid(i, c)[j];
+				}
+			}
+		}
+		for(size_t row = 0; row < rotation_.size() / std::max<size_t>(dim_, 1); row++) {
+			for(size_t j = 0; j < dim_; j++) {
+				columns_[j * dim_ + row] = rotation_[row * dim_ + j];
+			}
+		}
+	}
+
+	const float* centroid(size_t subspace, size_t c) const {
+		return centroids_.data() + (subspace * kernels::PQ_CENTROIDS + c) * dsub_;
+	}
+
+	/// @brief x times the rotation (faiss' y = A x) in `buffer`, or x itself without one
+	const float* rotate(const float* x, std::vector<float>& buffer) const {
+		if(!rotated()) {
+			return x;
+		}
+		// column by column: y += x[j] * A[:, j] vectorizes, a dot product per row would not
+		// (a float sum is not reassociated without -ffast-math)
+		buffer.assign(dim_, 0.0f);
+		for(size_t j = 0; j < dim_; j++) {
+			const float xj = x[j];
+			const float* column = columns_.data() + j * dim_;
+			for(size_t row = 0; row < dim_; row++) {
+				buffer[row] += xj * column[row];
+			}
+		}
+		return buffer.data();
+	}
+
+	size_t dim_;
+	size_t m_;
+	size_t dsub_;
+	// faiss' layout: subspace, centroid, dim
+	std::vector<float> centroids_;
+	// the same by subspace, dim, centroid
+	std::vector<float> by_dim_;
+	// faiss' A, row major, and its columns
+	std::vector<float> rotation_;
+	std::vector<float> columns_;
+};
+
+/// @brief where the quantizer of the pq index at `index_path` is saved
+inline std::filesystem::path pq_quantizer_path(const std::filesystem::path& index_path) {
+	return index_path.string() + ".pq";
+}
+
+/// @brief hnswlib space over pq codes. The first argument of its distance is a lookup table
+/// (PqQuantizer::encode_query), so an index over it is searched, never built with addPoint.
+class PqSpace : public hnswlib::SpaceInterface<float> {
+public:
+	explicit PqSpace(const PqQuantizer& quantizer)
+		: param_{ quantizer.dim(), quantizer.m() } {}
+
+	size_t get_data_size() override {
+		return param_.m;
+	}
+
+	hnswlib::DISTFUNC<float> get_dist_func() override {
+		return distance_kernels().pq_adc;
+	}
+
+	void* get_dist_func_param() override {
+		return &param_;
+	}
+
+	/// @brief e.g. pq_avx512
+	std::string kernel_name() const {
+		return "pq_" + distance_kernels().isa;
+	}
+
+private:
+	kernels::PqParam param_;
+};
@@ -0,0 +1,162 @@
+/* Compact binary log of issued queries, for capturing real traffic and replaying it */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <hnswlib/hnswlib.h>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "lib/embeddings.hpp"
+
+// File layout (little endian):
+//   header: "HQLG" | uint32 version | uint32 dim | uint32 reserved
+//   record: uint64 timestamp_ns | uint32 k | uint32 ef | uint32 filter_size
+//           | uint32 allowed_labels[filter_size] | float vector[dim]
+// timestamp_ns is relative to the start of the capture and does not decrease from one record to
+// the next, filter_size == 0 means unfiltered and ef == 0 means "use whatever ef the index is set
+// to"
+
+inline constexpr char QUERY_LOG_MAGIC[4] = { 'H', 'Q', 'L', 'G' };
+inline constexpr uint32_t QUERY_LOG_VERSION = 1;
+
+struct QueryLogEntry {
+	uint64_t timestamp_ns;
+	uint32_t k;
+	uint32_t ef;
+	// [filter_begin, filter_begin + filter_size) in QueryLog::filters, sorted
+	size_t filter_begin;
+	uint32_t filter_size;
+};
+
+struct QueryLog {
+	// one row per entry, in log order
+	Embedding<float> vectors;
+	std::vector<QueryLogEntry> entries;
+	std::vector<uint32_t> filters;
+
+	const float* vector(size_t i) const {
+		return vectors.data.get() + static_cast<size_t>(vectors.dim) * i;
+	}
+};
+
+/// @brief appends queries to a log file, safe to call from several threads
+class QueryLogWriter {
+public:
+	QueryLogWriter(const std::filesystem::path& path, uint32_t dim)
+		: fout_(path, std::ios::binary)
+		, dim_(dim) {
+		if(!fout_) {
+			throw std::runtime_error(std::format("could not open filename {}", path.string()));
+		}
+		const uint32_t reserved = 0;
+		fout_.write(QUERY_LOG_MAGIC, sizeof(QUERY_LOG_MAGIC));
+		fout_.write(reinterpret_cast<const char*>(&QUERY_LOG_VERSION), sizeof(uint32_t));
+		fout_.write(reinterpret_cast<const char*>(&dim_), sizeof(uint32_t));
+		fout_.write(reinterpret_cast<const char*>(&reserved), sizeof(uint32_t));
+	}
+
+	void append(uint64_t timestamp_ns,
+				const float* vector,
+				uint32_t k,
+				uint32_t ef,
+				const std::vector<uint32_t>& allowed_labels = {}) {
+		const uint32_t filter_size = allowed_labels.size();
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		fout_.write(reinterpret_cast<const char*>(&timestamp_ns), sizeof(uint64_t));
+		fout_.write(reinterpret_cast<const char*>(&k), sizeof(uint32_t));
+		fout_.write(reinterpret_cast<const char*>(&ef), sizeof(uint32_t));
+		fout_.write(reinterpret_cast<const char*>(&filter_size), sizeof(uint32_t));
+		fout_.write(reinterpret_cast<const char*>(allowed_labels.data()),
+					sizeof(uint32_t) * filter_size);
+		fout_.write(reinterpret_cast<const char*>(vector), sizeof(float) * dim_);
+	}
+
+private:
+	std::ofstream fout_;
+	const uint32_t dim_;
+	std::mutex mutex_;
+};
+
+/// @brief read a whole query log
+/// @param log_src path to the log file
+/// @return entries plus their vectors as an Embedding so they can be used like a query set
+inline std::unique_ptr<QueryLog> load_query_log(const std::filesystem::path& log_src) {
+	std::ifstream fin(log_src, std::ios::binary);
+	if(!fin) {
+		throw std::runtime_error(std::format("could not open filename {}", log_src.string()));
+	}
+
+	char magic[4];
+	uint32_t version, dim, reserved;
+	fin.read(magic, sizeof(magic));
+	fin.read(reinterpret_cast<char*>(&version), sizeof(uint32_t));
+	fin.read(reinterpret_cast<char*>(&dim), sizeof(uint32_t));
+	fin.read(reinterpret_cast<char*>(&reserved), sizeof(uint32_t));
+	if(!fin || std::memcmp(magic, QUERY_LOG_MAGIC, sizeof(magic)) != 0) {
+		throw std::runtime_error(std::format("{} is not a query log", log_src.string()));
+	}
+	if(version != QUERY_LOG_VERSION) {
+		throw std::runtime_error(std::format("unsupported query log version {}", version));
+	}
+
+	std::vector<QueryLogEntry> entries;
+	std::vector<uint32_t> filters;
+	std::vector<float> vectors;
+	while(true) {
+		QueryLogEntry entry{};
+		fin.read(reinterpret_cast<char*>(&entry.timestamp_ns), sizeof(uint64_t));
+		if(fin.eof()) {
+			break;
+		}
+		fin.read(reinterpret_cast<char*>(&entry.k), sizeof(uint32_t));
+		fin.read(reinterpret_cast<char*>(&entry.ef), sizeof(uint32_t));
+		fin.read(reinterpret_cast<char*>(&entry.filter_size), sizeof(uint32_t));
+
+		entry.filter_begin = filters.size();
+		filters.resize(filters.size() + entry.filter_size);
+		fin.read(reinterpret_cast<char*>(filters.data() + entry.filter_begin),
+				 sizeof(uint32_t) * entry.filter_size);
+		std::sort(filters.begin() + entry.filter_begin, filters.end());
+
+		vectors.resize(vectors.size() + dim);
+		fin.read(reinterpret_cast<char*>(vectors.data() + vectors.size() - dim),
+				 sizeof(float) * dim);
+		if(!fin) {
+			throw std::runtime_error(
+				std::format("truncated record {} in {}", entries.size(), log_src.string()));
+		}
+		entries.push_back(entry);
+	}
+
+	std::unique_ptr<float[]> data = std::make_unique<float[]>(vectors.size());
+	std::copy(vectors.begin(), vectors.end(), data.get());
+
+	return std::unique_ptr<QueryLog>(new QueryLog{
+		Embedding<float>{ std::move(data), static_cast<int>(dim), static_cast<int>(entries.size()) },
+		std::move(entries),
+		std::move(filters) });
+}
+
+/// @brief hnswlib filter that only admits the labels of a sorted list
+class AllowedLabelsFilter : public hnswlib::BaseFilterFunctor {
+public:
+	AllowedLabelsFilter(const uint32_t* begin, const uint32_t* end)
+		: begin_(begin)
+		, end_(end) {}
+
+	bool operator()(hnswlib::labeltype label) override {
+		return std::binary_search(begin_, end_, static_cast<uint32_t>(label));
+	}
+
+private:
+	const uint32_t* begin_;
+	const uint32_t* end_;
+};
@@ -0,0 +1,190 @@
+/* Result quality metrics against a ground truth, for any k up to the ground truth depth */
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <format>
+#include <hnswlib/hnswlib.h>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "lib/embeddings.hpp"
+
+using SearchResult = std::vector<std::pair<float, hnswlib::labeltype>>;
+
+/// @brief copy an hnswlib result queue into a vector, nearest first (the queue is not modified)
+inline SearchResult
+to_sorted_result(std::priority_queue<std::pair<float, hnswlib::labeltype>> results) {
+	SearchResult sorted(results.size());
+	for(size_t i = results.size(); i > 0; i--) {
+		sorted[i - 1] = results.top();
+		results.pop();
+	}
+	return sorted;
+}
+
+/// @brief all metrics are averaged over the evaluated queries
+struct QualityMetrics {
+	size_t k;
+	// |top k results ∩ top k ground truth| / k
+	double recall;
+	// fraction of queries whose first result is the true nearest neighbor
+	double recall_1_at_1;
+	// mean over ranks of result distance / true distance at the same rank (>= 1, nan without
+	// ground truth distances)
+	double distance_ratio;
+	// mean average precision of the top k results
+	double map;
+	// like recall, but a result within the k-th true distance counts as a hit even if the ground
+	// truth picked another id among equidistant neighbors (nan without ground truth distances)
+	double tie_aware_recall;
+};
+
+class RecallEvaluator {
+public:
+	/// @param gt_ids ivecs ground truth, one row of ids per query, nearest first
+	/// @param gt_distances optional fvecs of the matching distances (as returned by the index,
+	/// i.e. squared l2 for L2Space)
+	explicit RecallEvaluator(const Embedding<int>& gt_ids,
+							 const Embedding<float>* gt_distances = nullptr)
+		: gt_ids_(gt_ids)
+		, gt_distances_(gt_distances) {
+		if(gt_distances_ != nullptr &&
+		   (gt_distances_->nb != gt_ids_.nb || gt_distances_->dim != gt_ids_.dim)) {
+			throw std::runtime_error("ground truth ids and distances have different shapes");
+		}
+	}
+
+	size_t depth() const {
+		return gt_ids_.dim;
+	}
+
+	/// @brief metrics of a single query
+	/// @param result nearest first, may be shorter than k
+	QualityMetrics evaluate(size_t query_id, const SearchResult& result, size_t k) const {
+		check_k(k);
+
+		const int* truth = gt_ids_.data.get() + depth() * query_id;
+		const size_t n = std::min(k, result.size());
+
+		// sorted copies of both top k lists, intersected with a merge
+		std::vector<hnswlib::labeltype> truth_sorted(truth, truth + k);
+		std::vector<hnswlib::labeltype> found_sorted(n);
+		for(size_t i = 0; i < n; i++) {
+			found_sorted[i] = result[i].second;
+		}
+		std::sort(truth_sorted.begin(), truth_sorted.end());
+		std::sort(found_sorted.begin(), found_sorted.end());
+
+		size_t hits = 0;
+		for(size_t a = 0, b = 0; a < truth_sorted.size() && b < found_sorted.size();) {
+			if(truth_sorted[a] < found_sorted[b]) {
+				a++;
+			} else if(found_sorted[b] < truth_sorted[a]) {
+				b++;
+			} else {
+				hits++;
+				a++;
+				b++;
+			}
+		}
+
+		// average precision: precision at every rank that holds a relevant result
+		double precision_sum = 0.0;
+		size_t relevant_so_far = 0;
+		for(size_t i = 0; i < n; i++) {
+			if(std::binary_search(truth_sorted.begin(), truth_sorted.end(), result[i].second)) {
+				relevant_so_far++;
+				precision_sum += static_cast<double>(relevant_so_far) / (i + 1);
+			}
+		}
+
+		QualityMetrics metrics{};
+		metrics.k = k;
+		metrics.recall = static_cast<double>(hits) / k;
+		metrics.recall_1_at_1 =
+			n > 0 && result[0].second == static_cast<hnswlib::labeltype>(truth[0]);
+		metrics.map = precision_sum / k;
+		metrics.distance_ratio = std::numeric_limits<double>::quiet_NaN();
+		metrics.tie_aware_recall = std::numeric_limits<double>::quiet_NaN();
+
+		if(gt_distances_ != nullptr) {
+			const float* truth_distance = gt_distances_->data.get() + depth() * query_id;
+
+			// distances are squared l2, the ratio is defined on the actual distances
+			double ratio_sum = 0.0;
+			size_t ratio_count = 0;
+			for(size_t i = 0; i < n; i++) {
+				if(truth_distance[i] > 0.0f) {
+					ratio_sum += std::sqrt(result[i].first / truth_distance[i]);
+					ratio_count++;
+				}
+			}
+			metrics.distance_ratio = ratio_count ? ratio_sum / ratio_count : 1.0;
+
+			const float bound = truth_distance[k - 1] * (1.0f + TIE_EPSILON);
+			size_t tie_hits = 0;
+			for(size_t i = 0; i < n; i++) {
+				tie_hits += result[i].first <= bound;
+			}
+			metrics.tie_aware_recall = static_cast<double>(std::min(tie_hits, k)) / k;
+		}
+		return metrics;
+	}
+
+	/// @brief metrics averaged over all queries, query i is results[i], evaluated in parallel
+	/// @throw std::runtime_error if there are no results or more than ground truth rows
+	QualityMetrics evaluate(const std::vector<SearchResult>& results, size_t k) const {
+		// an average over no query is 0 / 0, which must not reach a result file
+		if(results.empty()) {
+			throw std::runtime_error("no results to evaluate");
+		}
+		if(results.size() > static_cast<size_t>(gt_ids_.nb)) {
+			throw std::runtime_error("more results than ground truth rows");
+		}
+		// exceptions must not escape the parallel region
+		check_k(k);
+
+		double recall = 0.0, recall_1_at_1 = 0.0, distance_ratio = 0.0, map = 0.0, tie = 0.0;
+		const long n = results.size();
+
+#pragma omp parallel for reduction(+ : recall, recall_1_at_1, distance_ratio, map, tie)
+		for(long q = 0; q < n; q++) {
+			const QualityMetrics m = evaluate(q, results[q], k);
+			recall += m.recall;
+			recall_1_at_1 += m.recall_1_at_1;
+			distance_ratio += m.distance_ratio;
+			map += m.map;
+			tie += m.tie_aware_recall;
+		}
+
+		return { k, recall / n, recall_1_at_1 / n, distance_ratio / n, map / n, tie / n };
+	}
+
+private:
+	void check_k(size_t k) const {
+		if(k == 0 || k > depth()) {
+			throw std::runtime_error(
+				std::format("k = {} must be in [1, {}] (ground truth depth)", k, depth()));
+		}
+	}
+
+	// relative slack on the k-th true distance for float noise in tie-aware recall
+	static constexpr float TIE_EPSILON = 1e-5f;
+
+	const Embedding<int>& gt_ids_;
+	const Embedding<float>* gt_distances_;
+};
+
+/// @brief recall@k of a single query against an ivecs ground truth
+/// @param k the k the search was asked for: a search returning fewer results loses recall
+inline double
+calculate_recall(const int query_id,
+				 const Embedding<int>& ground_truth,
+				 const std::priority_queue<std::pair<float, hnswlib::labeltype>>& results,
+				 size_t k) {
+	return RecallEvaluator(ground_truth).evaluate(query_id, to_sorted_result(results), k).recall;
+}
@@ -0,0 +1,412 @@
+/* Benchmark results as json lines: run metadata, per configuration summaries and raw samples */
+#pragma once
+
+#include <cctype>
+#include <cmath>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lib/isolation.hpp"
+#include "lib/stats.hpp"
+
+// One json object per line. The first line describes the machine, every other line one
+// configuration (cell) of a benchmark:
+//
+//   {"record": "env", "env": {"cpu_model": "...", "governor": "performance", ...}}
+//   {"record": "result", "params": {"bench": "bench_st_sq", "test": "same_vector", "ef": 100, ...},
+//    "summary": {"count": 1000, "mean": 812.3, "variance": ..., "p50": ..., "p99": ..., ...},
+//    "metrics": {"recall": 0.97}, "samples": [801, 799, ...]}
+//
+// params identify the configuration, summary is over the latency samples (us unless a "unit"
+// param says otherwise, absent if there are none), metrics are everything else measured (recall,
+// qps, ...). samples are only written when the writer keeps them. In python:
+// pd.json_normalize(map(json.loads, open(path))).
+
+struct ResultRecord {
+	std::map<std::string, std::string> params;
+	Summary summary;
+	std::map<std::string, double> metrics;
+	std::vector<double> samples;
+
+	double metric(const std::string& name, double default_value = NAN) const {
+		const auto it = metrics.find(name);
+		return it == metrics.end() ? default_value : it->second;
+	}
+};
+
+struct ResultSet {
+	std::map<std::string, std::string> env;
+	std::vector<ResultRecord> records;
+};
+
+namespace json {
+
+inline std::string quote(const std::string& s) {
+	std::string out = "\"";
+	for(const char c : s) {
+		switch(c) {
+		case '"':
+			out += "\\\"";
+			break;
+		case '\\':
+			out += "\\\\";
+			break;
+		case '\n':
+			out += "\\n";
+			break;
+		case '\t':
+			out += "\\t";
+			break;
+		default:
+			if(static_cast<unsigned char>(c) < 0x20) {
+				out += std::format("\\u{:04x}", static_cast<int>(c));
+			} else {
+				out += c;
+			}
+		}
+	}
+	return out + "\"";
+}
+
+inline std::string number(double x) {
+	// json has no nan/inf
+	return std::isfinite(x) ? std::format("{}", x) : "null";
+}
+
+/// @brief numbers stay numbers so pandas reads ef, k, ... as numeric columns
+inline std::string param(const std::string& value) {
+	size_t parsed = 0;
+	try {
+		std::stod(value, &parsed);
+	} catch(const std::exception&) {
+		parsed = 0;
+	}
+	// stod also takes "nan", "inf", hex and a leading '+' or '.', json does not
+	const bool numeric = !value.empty() && parsed == value.size() &&
+						 (value.front() == '-' || std::isdigit(value.front())) &&
+						 std::isdigit(value.back()) &&
+						 value.find_first_of("xX") == std::string::npos;
+	return numeric ? value : quote(value);
+}
+
+/// @brief parsed json value, only what the result store writes (no unicode escapes beyond ascii)
+struct Value {
+	enum class Type { null, boolean, number, string, array, object };
+	Type type = Type::null;
+	bool boolean = false;
+	double number = 0.0;
+	std::string string;
+	std::vector<Value> array;
+	std::map<std::string, Value> object;
+
+	/// @brief scalars as text, the way they were written
+	std::string text() const {
+		switch(type) {
+		case Type::boolean:
+			return boolean ? "true" : "false";
+		case Type::number:
+			return std::format("{}", number);
+		case Type::string:
+			return string;
+		default:
+			return "";
+		}
+	}
+
+	double as_number() const {
+		return type == Type::number ? number : NAN;
+	}
+};
+
+class Parser {
+public:
+	explicit Parser(const std::string& text)
+		: text_(text) {}
+
+	Value parse() {
+		Value value = parse_value();
+		skip_space();
+		if(pos_ != text_.size()) {
+			fail("trailing characters");
+		}
+		return value;
+	}
+
+private:
+	[[noreturn]] void fail(const std::string& what) const {
+		throw std::runtime_error(std::format("json: {} at offset {}", what, pos_));
+	}
+
+	void skip_space() {
+		while(pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_]))) {
+			pos_++;
+		}
+	}
+
+	bool consume(char c) {
+		skip_space();
+		if(pos_ < text_.size() && text_[pos_] == c) {
+			pos_++;
+			return true;
+		}
+		return false;
+	}
+
+	void expect(char c) {
+		if(!consume(c)) {
+			fail(std::format("expected '{}'", c));
+		}
+	}
+
+	bool consume_word(const std::string& word) {
+		if(text_.compare(pos_, word.size(), word) == 0) {
+			pos_ += word.size();
+			return true;
+		}
+		return false;
+	}
+
+	std::string parse_string() {
+		expect('"');
+		std::string out;
+		while(pos_ < text_.size() && text_[pos_] != '"') {
+			char c = text_[pos_++];
+			if(c == '\\') {
+				if(pos_ >= text_.size()) {
+					fail("unterminated escape");
+				}
+				c = text_[pos_++];
+				switch(c) {
+				case 'n':
+					c = '\n';
+					break;
+				case 't':
+					c = '\t';
+					break;
+				case 'u':
+					c = static_cast<char>(std::stoi(text_.substr(pos_, 4), nullptr, 16));
+					pos_ += 4;
+					break;
+				default:
+					break;
+				}
+			}
+			out += c;
+		}
+		expect('"');
+		return out;
+	}
+
+	Value parse_value() {
+		skip_space();
+		if(pos_ >= text_.size()) {
+			fail("unexpected end");
+		}
+
+		Value value;
+		const char c = text_[pos_];
+		if(c == '{') {
+			value.type = Value::Type::object;
+			pos_++;
+			if(consume('}')) {
+				return value;
+			}
+			do {
+				skip_space();
+				std::string key = parse_string();
+				expect(':');
+				value.object[key] = parse_value();
+			} while(consume(','));
+			expect('}');
+		} else if(c == '[') {
+			value.type = Value::Type::array;
+			pos_++;
+			if(consume(']')) {
+				return value;
+			}
+			do {
+				value.array.push_back(parse_value());
+			} while(consume(','));
+			expect(']');
+		} else if(c == '"') {
+			value.type = Value::Type::string;
+			value.string = parse_string();
+		} else if(consume_word("true")) {
+			value.type = Value::Type::boolean;
+			value.boolean = true;
+		} else if(consume_word("false")) {
+			value.type = Value::Type::boolean;
+		} else if(consume_word("null")) {
+			value.type = Value::Type::null;
+		} else {
+			size_t parsed = 0;
+			try {
+				value.number = std::stod(text_.substr(pos_, 32), &parsed);
+			} catch(const std::exception&) {
+				fail("bad value");
+			}
+			value.type = Value::Type::number;
+			pos_ += parsed;
+		}
+		return value;
+	}
+
+	const std::string& text_;
+	size_t pos_ = 0;
+};
+
+} // namespace json
+
+/// @brief appends result records to a json lines file, safe to call from several threads
+class ResultWriter {
+public:
+	/// @param keep_samples also write the raw latency samples of every record
+	ResultWriter(const std::filesystem::path& path, const EnvironmentInfo& env, bool keep_samples)
+		: out_(path)
+		, keep_samples_(keep_samples) {
+		if(!out_) {
+			throw std::runtime_error(std::format("could not open filename {}", path.string()));
+		}
+		out_ << "{\"record\": \"env\", \"env\": {"
+			 << std::format("\"cpu_model\": {}, \"governor\": {}, \"cur_mhz\": {}, "
+							"\"transparent_hugepages\": {}, \"smt\": {}, \"core\": {}, "
+							"\"pinned\": {}, \"mlocked\": {}, \"realtime\": {}, "
+							"\"distance_isa\": {}, \"simd_features\": {}",
+							json::quote(env.cpu_model),
+							json::quote(env.governor),
+							json::number(env.cur_mhz),
+							json::quote(env.transparent_hugepages),
+							json::quote(env.smt),
+							env.core,
+							env.pinned,
+							env.mlocked,
+							env.realtime,
+							json::quote(env.distance_isa),
+							json::quote(env.simd_features))
+			 << "}}\n";
+	}
+
+	/// @param samples latencies in us, summarized always and written if samples are kept
+	void write(const std::map<std::string, std::string>& params,
+			   const std::vector<double>& samples,
+			   const std::map<std::string, double>& metrics = {}) {
+		std::string line = "{\"record\": \"result\", \"params\": {";
+		const char* sep = "";
+		for(const auto& [key, value] : params) {
+			line += std::format("{}{}: {}", sep, json::quote(key), json::param(value));
+			sep = ", ";
+		}
+		line += "}";
+
+		if(!samples.empty()) {
+			const Summary s = summarize(samples);
+			line += std::format(", \"summary\": {{\"count\": {}, \"mean\": {}, \"variance\": {}, "
+								"\"min\": {}, \"p50\": {}, \"p90\": {}, \"p95\": {}, \"p99\": {}, "
+								"\"p999\": {}, \"max\": {}}}",
+								s.count,
+								json::number(s.mean),
+								json::number(s.variance),
+								json::number(s.min),
+								json::number(s.p50),
+								json::number(s.p90),
+								json::number(s.p95),
+								json::number(s.p99),
+								json::number(s.p999),
+								json::number(s.max));
+		}
+
+		line += ", \"metrics\": {";
+		sep = "";
+		for(const auto& [key, value] : metrics) {
+			line += std::format("{}{}: {}", sep, json::quote(key), json::number(value));
+			sep = ", ";
+		}
+		line += "}";
+
+		if(keep_samples_ && !samples.empty()) {
+			line += ", \"samples\": [";
+			sep = "";
+			for(const double x : samples) {
+				line += std::format("{}{}", sep, x);
+				sep = ", ";
+			}
+			line += "]";
+		}
+		line += "}\n";
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		out_ << line;
+		out_.flush();
+	}
+
+private:
+	std::ofstream out_;
+	const bool keep_samples_;
+	std::mutex mutex_;
+};
+
+/// @brief read a file written by ResultWriter
+/// @throw std::runtime_error with the line number on malformed lines
+inline ResultSet load_results(const std::filesystem::path& src) {
+	std::ifstream fin(src);
+	if(!fin) {
+		throw std::runtime_error(std::format("could not open filename {}", src.string()));
+	}
+
+	ResultSet set;
+	std::string line;
+	for(int line_no = 1; std::getline(fin, line); line_no++) {
+		if(line.empty()) {
+			continue;
+		}
+		json::Value value;
+		try {
+			value = json::Parser(line).parse();
+		} catch(const std::exception& err) {
+			throw std::runtime_error(std::format("{}:{}: {}", src.string(), line_no, err.what()));
+		}
+
+		const std::string record = value.object["record"].string;
+		if(record == "env") {
+			for(const auto& [key, field] : value.object["env"].object) {
+				set.env[key] = field.text();
+			}
+			continue;
+		}
+		if(record != "result") {
+			continue;
+		}
+
+		ResultRecord r;
+		for(const auto& [key, field] : value.object["params"].object) {
+			r.params[key] = field.text();
+		}
+		auto& summary = value.object["summary"].object;
+		if(!summary.empty()) {
+			r.summary.count = static_cast<size_t>(summary["count"].as_number());
+			r.summary.mean = summary["mean"].as_number();
+			r.summary.variance = summary["variance"].as_number();
+			r.summary.min = summary["min"].as_number();
+			r.summary.p50 = summary["p50"].as_number();
+			r.summary.p90 = summary["p90"].as_number();
+			r.summary.p95 = summary["p95"].as_number();
+			r.summary.p99 = summary["p99"].as_number();
+			r.summary.p999 = summary["p999"].as_number();
+			r.summary.max = summary["max"].as_number();
+		}
+		for(const auto& [key, field] : value.object["metrics"].object) {
+			r.metrics[key] = field.as_number();
+		}
+		for(const json::Value& x : value.object["samples"].array) {
+			r.samples.push_back(x.number);
+		}
+		set.records.push_back(std::move(r));
+	}
+	return set;
+}
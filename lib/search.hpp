@@ -0,0 +1,520 @@
+/* hnsw search loop over an hnswlib index, for search variants hnswlib does not have */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <hnswlib/hnswlib.h>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lib/binary.hpp"
+#include "lib/distance.hpp"
+#include "lib/upper.hpp"
+
+// HnswSearcher runs the two phases of HierarchicalNSW::searchKnn (greedy descent through the upper
+// layers, best first search with ef on level 0) on the index' own memory, so a variant of the
+// inner loop can be compared against the library on the same graph. Like hnswlib's bare bone
+// search it ignores deleted elements and filters. The variants assume an l2 index. An index over
+// compressed or projected vectors (lib/sq8.hpp, lib/pq.hpp, lib/pca.hpp) is searched with
+// hnswlib's loop on the encoded query and optionally reranked, see use_query_coder(). The greedy
+// descent can run on a compact replica of the upper levels instead (lib/upper.hpp).
+
+enum class SearchMode {
+	hnswlib, // HierarchicalNSW::searchKnn
+	standard, // the loop below with the space's distance, i.e. hnswlib's loop
+	early_abandon, // give up on a distance once it exceeds the ef-th best so far
+	batched, // filter a node's neighbors first, then one batch kernel call for all fresh ones
+	prefilter, // skip the l2 of neighbors whose binary code is far from the query's
+};
+
+inline SearchMode parse_search_mode(const std::string& name) {
+	if(name == "hnswlib")
+		return SearchMode::hnswlib;
+	if(name == "standard")
+		return SearchMode::standard;
+	if(name == "early_abandon")
+		return SearchMode::early_abandon;
+	if(name == "batched")
+		return SearchMode::batched;
+	if(name == "prefilter")
+		return SearchMode::prefilter;
+	throw std::runtime_error(std::format("unknown search mode '{}'", name));
+}
+
+/// @brief work done by searches, summed over however many were run
+struct SearchStats {
+	size_t queries = 0;
+	size_t hops = 0;
+	// distances started, abandoned ones included
+	size_t distances = 0;
+	size_t abandoned = 0;
+	// dims summed over all distances, dims * distances without early abandoning
+	size_t dims = 0;
+	// fresh neighbors dropped by the prefilter without a distance
+	size_t pruned = 0;
+	// wall time of the greedy descent through the upper levels and of the level 0 search
+	size_t descent_ns = 0;
+	size_t level0_ns = 0;
+
+	void add(const SearchStats& other) {
+		queries += other.queries;
+		hops += other.hops;
+		distances += other.distances;
+		abandoned += other.abandoned;
+		dims += other.dims;
+		pruned += other.pruned;
+		descent_ns += other.descent_ns;
+		level0_ns += other.level0_ns;
+	}
+
+	/// @brief as result metrics (per query averages and fractions)
+	std::map<std::string, double> metrics(size_t dim) const {
+		if(queries == 0 || distances == 0) {
+			return {};
+		}
+		return { { "hops_per_query", static_cast<double>(hops) / queries },
+				 { "distances_per_query", static_cast<double>(distances) / queries },
+				 { "abandoned_fraction", static_cast<double>(abandoned) / distances },
+				 { "dims_fraction", static_cast<double>(dims) / (distances * dim) },
+				 { "pruned_fraction", static_cast<double>(pruned) / (pruned + distances) },
+				 { "descent_us_per_query", descent_ns / 1000.0 / queries },
+				 { "level0_us_per_query", level0_ns / 1000.0 / queries } };
+	}
+};
+
+class HnswSearcher {
+public:
+	using Result = std::priority_queue<std::pair<float, hnswlib::labeltype>>;
+
+	HnswSearcher(hnswlib::HierarchicalNSW<float>& index, SearchMode mode)
+		: index_(index)
+		, mode_(mode)
+		, dim_(*static_cast<const size_t*>(index.dist_func_param_))
+		, bounded_(distance_kernels().l2_bounded)
+		, batch_(distance_kernels().l2_batch)
+		, hamming_(distance_kernels().hamming) {}
+
+	SearchMode mode() const {
+		return mode_;
+	}
+
+	/// @brief permute the dims of every stored vector by decreasing variance (estimated on up to
+	/// `sample` vectors), so an abandoned distance is abandoned after fewer dims. Queries are
+	/// permuted the same way by search(), l2 does not change.
+	/// @note after this, search the index only through this searcher
+	void reorder_dimensions(size_t sample) {
+		const size_t n = std::min<size_t>(sample, index_.cur_element_count);
+		const size_t stride =
+			std::max<size_t>(1, index_.cur_element_count / std::max<size_t>(n, 1));
+		std::vector<double> sum(dim_, 0.0);
+		std::vector<double> squares(dim_, 0.0);
+		for(size_t i = 0; i < n; i++) {
+			const float* v = vector(i * stride);
+			for(size_t d = 0; d < dim_; d++) {
+				sum[d] += v[d];
+				squares[d] += static_cast<double>(v[d]) * v[d];
+			}
+		}
+		std::vector<double> variance(dim_);
+		for(size_t d = 0; d < dim_; d++) {
+			const double mean = sum[d] / std::max<size_t>(n, 1);
+			variance[d] = squares[d] / std::max<size_t>(n, 1) - mean * mean;
+		}
+
+		// order[i] = the original dim stored at position i
+		order_.resize(dim_);
+		std::iota(order_.begin(), order_.end(), 0);
+		std::stable_sort(order_.begin(), order_.end(), [&](size_t a, size_t b) {
+			return variance[a] > variance[b];
+		});
+
+		std::vector<float> permuted(dim_);
+		for(size_t id = 0; id < index_.cur_element_count; id++) {
+			float* v = reinterpret_cast<float*>(index_.getDataByInternalId(id));
+			for(size_t d = 0; d < dim_; d++) {
+				permuted[d] = v[order_[d]];
+			}
+			std::copy(permuted.begin(), permuted.end(), v);
+		}
+	}
+
+	bool reordered() const {
+		return !order_.empty();
+	}
+
+	/// @brief for an index over compressed vectors: queries are encoded with `coder` and searchKnn
+	/// traverses the codes with the index' ef. If `rerank_vectors` (the full vectors, coder.dim()
+	/// floats per label) is not null, the ef candidates are reranked with the exact l2.
+	/// @throw std::runtime_error unless the mode is hnswlib and the dims are not reordered
+	void use_query_coder(const QueryCoder& coder, const float* rerank_vectors) {
+		if(mode_ != SearchMode::hnswlib || reordered()) {
+			throw std::runtime_error(
+				"a compressed index is only searched in hnswlib mode, unreordered");
+		}
+		coder_ = &coder;
+		rerank_vectors_ = rerank_vectors;
+	}
+
+	/// @brief the binary codes of the index for SearchMode::prefilter. Once there are ef results,
+	/// a fresh neighbor only gets its l2 if its hamming distance to the query is at most
+	/// `multiplier` times the one of the worst result: lower keeps fewer neighbors (fewer
+	/// distances, lower recall), a large multiplier keeps all of them.
+	/// @note `codes` must be built after any reorder_dimensions() and outlive the searcher
+	void use_prefilter(const BinaryCodes& codes, float multiplier) {
+		codes_ = &codes;
+		prefilter_multiplier_ = multiplier;
+	}
+
+	/// @brief run the greedy descent on `replica` (lib/upper.hpp) instead of the index
+	/// @note `replica` must be built after any reorder_dimensions() and outlive the searcher
+	void use_upper_replica(const UpperReplica& replica) {
+		upper_ = &replica;
+	}
+
+	/// @brief k nearest neighbors with the index' ef (HierarchicalNSW::setEf)
+	/// @param stats if not null, the work of this search is added to it
+	Result search(const float* query, size_t k, SearchStats* stats = nullptr) const {
+		if(coder_ != nullptr) {
+			return search_encoded(query, k);
+		}
+		thread_local std::vector<float> permuted;
+		if(reordered()) {
+			permuted.resize(dim_);
+			for(size_t d = 0; d < dim_; d++) {
+				permuted[d] = query[order_[d]];
+			}
+			query = permuted.data();
+		}
+
+		switch(mode_) {
+		case SearchMode::hnswlib:
+			return index_.searchKnn(query, k);
+		case SearchMode::standard:
+			return search_impl<SearchMode::standard>(query, k, stats);
+		case SearchMode::early_abandon:
+			return search_impl<SearchMode::early_abandon>(query, k, stats);
+		case SearchMode::batched:
+			return search_impl<SearchMode::batched>(query, k, stats);
+		case SearchMode::prefilter:
+			if(codes_ == nullptr) {
+				throw std::runtime_error("prefilter search without binary codes (use_prefilter)");
+			}
+			return search_impl<SearchMode::prefilter>(query, k, stats);
+		}
+		return {};
+	}
+
+private:
+	using Candidate = std::pair<float, hnswlib::tableint>;
+	using Heap = std::priority_queue<Candidate,
+									 std::vector<Candidate>,
+									 hnswlib::HierarchicalNSW<float>::CompareByFirst>;
+
+	const float* vector(hnswlib::tableint id) const {
+		return reinterpret_cast<const float*>(index_.getDataByInternalId(id));
+	}
+
+	Result search_encoded(const float* query, size_t k) const {
+		// floats, so a lookup table is aligned
+		thread_local std::vector<float> encoded;
+		thread_local std::vector<hnswlib::labeltype> labels;
+		thread_local std::vector<const void*> vectors;
+		thread_local std::vector<float> distances;
+		encoded.resize((coder_->query_size() + sizeof(float) - 1) / sizeof(float));
+		coder_->encode_query(query, encoded.data());
+		if(rerank_vectors_ == nullptr) {
+			return index_.searchKnn(encoded.data(), k);
+		}
+
+		// the candidates are scattered over the full vectors, the batch kernel streams four of
+		// them at a time instead of waiting on one after the other
+		Result candidates = index_.searchKnn(encoded.data(), std::max(index_.ef_, k));
+		labels.clear();
+		vectors.clear();
+		while(!candidates.empty()) {
+			labels.push_back(candidates.top().second);
+			vectors.push_back(rerank_vectors_ + candidates.top().second * coder_->dim());
+			candidates.pop();
+		}
+		distances.resize(labels.size());
+		batch_(query, vectors.data(), vectors.size(), coder_->dim(), distances.data());
+
+		Result result;
+		for(size_t i = 0; i < labels.size(); i++) {
+			result.emplace(distances[i], labels[i]);
+			if(result.size() > k) {
+				result.pop();
+			}
+		}
+		return result;
+	}
+
+	template <SearchMode MODE>
+	float
+	distance(const float* query, hnswlib::tableint id, float bound, SearchStats& stats) const {
+		stats.distances++;
+		if constexpr(MODE == SearchMode::early_abandon) {
+			size_t dims = 0;
+			const float d = bounded_(query, vector(id), dim_, bound, &dims);
+			stats.dims += dims;
+			stats.abandoned += dims < dim_ ? 1 : 0;
+			return d;
+		} else {
+			stats.dims += dim_;
+			return index_.fstdistfunc_(query, vector(id), index_.dist_func_param_);
+		}
+	}
+
+	template <SearchMode MODE>
+	Result search_impl(const float* query, size_t k, SearchStats* stats_out) const {
+		Result result;
+		if(index_.cur_element_count == 0) {
+			return result;
+		}
+		SearchStats stats;
+		stats.queries = 1;
+		// the phases are only timed for a caller that collects stats
+		using clock = std::chrono::steady_clock;
+		const clock::time_point start = stats_out != nullptr ? clock::now() : clock::time_point();
+
+		// greedy descent, a neighbor only matters if it is closer than the current node
+		hnswlib::tableint current = index_.enterpoint_node_;
+		if(upper_ != nullptr) {
+			const size_t distances = stats.distances;
+			current = upper_->descend(query, stats.hops, stats.distances);
+			stats.dims += (stats.distances - distances) * dim_;
+		}
+		float current_dist = distance<SearchMode::standard>(query, current, 0.0f, stats);
+		for(int level = upper_ != nullptr ? 0 : index_.maxlevel_; level > 0; level--) {
+			bool changed = true;
+			while(changed) {
+				changed = false;
+				hnswlib::linklistsizeint* list = index_.get_linklist(current, level);
+				const int size = index_.getListCount(list);
+				const hnswlib::tableint* neighbors =
+					reinterpret_cast<const hnswlib::tableint*>(list + 1);
+				stats.hops++;
+				for(int i = 0; i < size; i++) {
+					const float d = distance<MODE>(query, neighbors[i], current_dist, stats);
+					if(d < current_dist) {
+						current_dist = d;
+						current = neighbors[i];
+						changed = true;
+					}
+				}
+			}
+		}
+
+		const clock::time_point descended =
+			stats_out != nullptr ? clock::now() : clock::time_point();
+
+		thread_local std::vector<uint64_t> query_code;
+		if constexpr(MODE == SearchMode::prefilter) {
+			query_code.resize(codes_->words());
+			codes_->encode(query, query_code.data());
+		}
+		Heap top = search_level0<MODE>(
+			query, query_code.data(), current, current_dist, std::max(index_.ef_, k), stats);
+		if(stats_out != nullptr) {
+			const clock::time_point end = clock::now();
+			stats.descent_ns = std::chrono::nanoseconds(descended - start).count();
+			stats.level0_ns = std::chrono::nanoseconds(end - descended).count();
+		}
+		while(top.size() > k) {
+			top.pop();
+		}
+		while(!top.empty()) {
+			result.emplace(top.top().first, index_.getExternalLabel(top.top().second));
+			top.pop();
+		}
+		if(stats_out != nullptr) {
+			stats_out->add(stats);
+		}
+		return result;
+	}
+
+	/// @brief HierarchicalNSW::searchBaseLayerST<true>. early_abandon bounds the distance by the
+	/// worst of the ef results once there are ef of them (a farther neighbor would be dropped
+	/// anyway). batched first drops visited neighbors and prefetches the rest, then computes all
+	/// their distances in one call, so up to 2 * M vectors are loaded at once instead of one at a
+	/// time behind the heap updates. prefilter first drops visited neighbors and the ones whose
+	/// code (`query_code` against BinaryCodes) is too far, prefetches the vectors of the rest and
+	/// then computes their distances one by one.
+	template <SearchMode MODE>
+	Heap search_level0(const float* query,
+					   const uint64_t* query_code,
+					   hnswlib::tableint entry,
+					   float entry_dist,
+					   size_t ef,
+					   SearchStats& stats) const {
+		hnswlib::VisitedList* vl = index_.visited_list_pool_->getFreeVisitedList();
+		hnswlib::vl_type* visited = vl->mass;
+		const hnswlib::vl_type tag = vl->curV;
+
+		Heap top;
+		Heap candidates;
+		top.emplace(entry_dist, entry);
+		candidates.emplace(-entry_dist, entry);
+		visited[entry] = tag;
+		float lower_bound = entry_dist;
+
+		// fresh neighbors of the current node, for the batched and prefilter modes, only ever grown
+		// so a search allocates nothing once a thread has run one
+		thread_local std::vector<hnswlib::tableint> batch_ids;
+		thread_local std::vector<const void*> batch_vectors;
+		thread_local std::vector<float> batch_distances;
+		if constexpr(MODE == SearchMode::prefilter || MODE == SearchMode::batched) {
+			if(batch_ids.size() < index_.maxM0_) {
+				batch_ids.resize(index_.maxM0_);
+			}
+		}
+		if constexpr(MODE == SearchMode::batched) {
+			if(batch_vectors.size() < index_.maxM0_) {
+				batch_vectors.resize(index_.maxM0_);
+				batch_distances.resize(index_.maxM0_);
+			}
+		}
+
+		while(!candidates.empty()) {
+			const Candidate current = candidates.top();
+			if(-current.first > lower_bound) {
+				break;
+			}
+			candidates.pop();
+
+			hnswlib::linklistsizeint* list = index_.get_linklist0(current.second);
+			const size_t size = index_.getListCount(list);
+			const hnswlib::tableint* neighbors =
+				reinterpret_cast<const hnswlib::tableint*>(list + 1);
+			stats.hops++;
+
+			if constexpr(MODE == SearchMode::batched) {
+				for(size_t j = 0; j < size; j++) {
+					__builtin_prefetch(visited + neighbors[j]);
+				}
+				size_t fresh = 0;
+				for(size_t j = 0; j < size; j++) {
+					const hnswlib::tableint id = neighbors[j];
+					if(visited[id] == tag) {
+						continue;
+					}
+					visited[id] = tag;
+					batch_ids[fresh] = id;
+					batch_vectors[fresh] = vector(id);
+					__builtin_prefetch(batch_vectors[fresh]);
+					fresh++;
+				}
+				batch_(query, batch_vectors.data(), fresh, dim_, batch_distances.data());
+				stats.distances += fresh;
+				stats.dims += fresh * dim_;
+
+				for(size_t j = 0; j < fresh; j++) {
+					const float d = batch_distances[j];
+					if(top.size() < ef || d < lower_bound) {
+						candidates.emplace(-d, batch_ids[j]);
+						top.emplace(d, batch_ids[j]);
+						if(top.size() > ef) {
+							top.pop();
+						}
+						lower_bound = top.top().first;
+					}
+				}
+				continue;
+			}
+
+			if constexpr(MODE == SearchMode::prefilter) {
+				for(size_t j = 0; j < size; j++) {
+					__builtin_prefetch(visited + neighbors[j]);
+					__builtin_prefetch(codes_->code(neighbors[j]));
+				}
+				// the bound of the worst result when the node is expanded, the results it adds
+				// only tighten it
+				const bool full = top.size() >= ef;
+				const size_t words = codes_->words();
+				const size_t bound =
+					full ? static_cast<size_t>(
+							   prefilter_multiplier_ *
+							   hamming_(query_code, codes_->code(top.top().second), words))
+						 : std::numeric_limits<size_t>::max();
+				size_t fresh = 0;
+				for(size_t j = 0; j < size; j++) {
+					const hnswlib::tableint id = neighbors[j];
+					if(visited[id] == tag) {
+						continue;
+					}
+					visited[id] = tag;
+					if(full && hamming_(query_code, codes_->code(id), words) > bound) {
+						stats.pruned++;
+						continue;
+					}
+					batch_ids[fresh++] = id;
+					__builtin_prefetch(vector(id));
+				}
+
+				for(size_t j = 0; j < fresh; j++) {
+					const hnswlib::tableint id = batch_ids[j];
+					const float d = distance<MODE>(query, id, lower_bound, stats);
+					if(top.size() < ef || d < lower_bound) {
+						candidates.emplace(-d, id);
+						top.emplace(d, id);
+						if(top.size() > ef) {
+							top.pop();
+						}
+						lower_bound = top.top().first;
+					}
+				}
+				continue;
+			}
+
+			__builtin_prefetch(visited + neighbors[0]);
+			__builtin_prefetch(vector(neighbors[0]));
+
+			for(size_t j = 0; j < size; j++) {
+				const hnswlib::tableint id = neighbors[j];
+				if(j + 1 < size) {
+					__builtin_prefetch(visited + neighbors[j + 1]);
+					__builtin_prefetch(vector(neighbors[j + 1]));
+				}
+				if(visited[id] == tag) {
+					continue;
+				}
+				visited[id] = tag;
+
+				const bool full = top.size() >= ef;
+				const float bound = full ? lower_bound : std::numeric_limits<float>::infinity();
+				const float d = distance<MODE>(query, id, bound, stats);
+				if(!full || d < lower_bound) {
+					candidates.emplace(-d, id);
+					top.emplace(d, id);
+					if(top.size() > ef) {
+						top.pop();
+					}
+					lower_bound = top.top().first;
+				}
+			}
+		}
+
+		index_.visited_list_pool_->releaseVisitedList(vl);
+		return top;
+	}
+
+	hnswlib::HierarchicalNSW<float>& index_;
+	const SearchMode mode_;
+	const size_t dim_;
+	const kernels::BoundedDistanceFunction bounded_;
+	const kernels::BatchDistanceFunction batch_;
+	const kernels::HammingFunction hamming_;
+	std::vector<size_t> order_;
+	const QueryCoder* coder_ = nullptr;
+	const float* rerank_vectors_ = nullptr;
+	const BinaryCodes* codes_ = nullptr;
+	float prefilter_multiplier_ = 1.0f;
+	const UpperReplica* upper_ = nullptr;
+};
@@ -0,0 +1,149 @@
+/* 8 bit scalar quantized hnsw index: the graph is built and traversed on codes, results reranked */
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <hnswlib/hnswlib.h>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lib/distance.hpp"
+
+// A float GIST vector is 3840 bytes, every distance of a search reads one from memory. An sq8
+// index stores one byte per dim instead: code c of dim d stands for min[d] + c * step[d], with min
+// and max trained per dim at build time. The hnswlib index is an ordinary HierarchicalNSW over
+// Sq8Space (a quarter of the level 0 block), the quantizer is saved next to it (<index>.sq8) and
+// the full vectors stay in a separate region (the base set, by label). A search encodes the query,
+// traverses on the codes and reranks the ef candidates with the exact l2 (HnswSearcher).
+
+/// @brief per dim min/max scalar quantizer to one byte per dim
+class Sq8Quantizer : public QueryCoder {
+public:
+	/// @brief min and max of every dim over the `n` vectors of `data`
+	static Sq8Quantizer train(const float* data, size_t n, size_t dim) {
+		std::vector<float> min(dim, std::numeric_limits<float>::max());
+		std::vector<float> max(dim, std::numeric_limits<float>::lowest());
+		for(size_t i = 0; i < n; i++) {
+			const float* x = data + i * dim;
+			for(size_t d = 0; d < dim; d++) {
+				min[d] = std::min(min[d], x[d]);
+				max[d] = std::max(max[d], x[d]);
+			}
+		}
+		std::vector<float> step(dim);
+		for(size_t d = 0; d < dim; d++) {
+			step[d] = n > 0 ? (max[d] - min[d]) / 255.0f : 0.0f;
+			min[d] = n > 0 ? min[d] : 0.0f;
+		}
+		return Sq8Quantizer(std::move(min), std::move(step));
+	}
+
+	/// @throw std::runtime_error if `src` is not a quantizer written by save()
+	static Sq8Quantizer load(const std::filesystem::path& src) {
+		std::ifstream fin(src, std::ios::binary);
+		if(!fin) {
+			throw std::runtime_error(std::format("could not open filename {}", src.string()));
+		}
+		uint64_t dim = 0;
+		fin.read(reinterpret_cast<char*>(&dim), sizeof(dim));
+		std::vector<float> min(dim);
+		std::vector<float> step(dim);
+		fin.read(reinterpret_cast<char*>(min.data()), dim * sizeof(float));
+		fin.read(reinterpret_cast<char*>(step.data()), dim * sizeof(float));
+		if(!fin || dim == 0) {
+			throw std::runtime_error(std::format("could not read quantizer {}", src.string()));
+		}
+		return Sq8Quantizer(std::move(min), std::move(step));
+	}
+
+	/// @brief dim as uint64, then min and step as dim floats each
+	void save(const std::filesystem::path& dst) const {
+		std::ofstream fout(dst, std::ios::binary);
+		if(!fout) {
+			throw std::runtime_error(std::format("could not open filename {}", dst.string()));
+		}
+		const uint64_t dim = min_.size();
+		fout.write(reinterpret_cast<const char*>(&dim), sizeof(dim));
+		fout.write(reinterpret_cast<const char*>(min_.data()), dim * sizeof(float));
+		fout.write(reinterpret_cast<const char*>(step_.data()), dim * sizeof(float));
+	}
+
+	size_t dim() const override {
+		return min_.size();
+	}
+
+	/// @brief nearest code of every dim, values outside the trained range are clamped
+	void encode(const float* x, uint8_t* code) const {
+		for(size_t d = 0; d < min_.size(); d++) {
+			const float c = step_[d] > 0.0f ? std::nearbyint((x[d] - min_[d]) / step_[d]) : 0.0f;
+			code[d] = static_cast<uint8_t>(std::clamp(c, 0.0f, 255.0f));
+		}
+	}
+
+	size_t query_size() const override {
+		return min_.size();
+	}
+
+	/// @brief queries are encoded like the vectors (the kernels compare two codes)
+	void encode_query(const float* query, void* out) const override {
+		encode(query, static_cast<uint8_t*>(out));
+	}
+
+	/// @brief step^2 per dim, the weights of the sq8 kernels
+	const std::vector<float>& weights() const {
+		return weights_;
+	}
+
+private:
+	Sq8Quantizer(std::vector<float> min, std::vector<float> step)
+		: min_(std::move(min))
+		, step_(std::move(step))
+		, weights_(step_.size()) {
+		for(size_t d = 0; d < step_.size(); d++) {
+			weights_[d] = step_[d] * step_[d];
+		}
+	}
+
+	std::vector<float> min_;
+	std::vector<float> step_;
+	std::vector<float> weights_;
+};
+
+/// @brief where the quantizer of the sq8 index at `index_path` is saved
+inline std::filesystem::path sq8_quantizer_path(const std::filesystem::path& index_path) {
+	return index_path.string() + ".sq8";
+}
+
+/// @brief hnswlib space over sq8 codes: squared l2 between the vectors two codes stand for
+/// @note the quantizer must outlive the space
+class Sq8Space : public hnswlib::SpaceInterface<float> {
+public:
+	explicit Sq8Space(const Sq8Quantizer& quantizer)
+		: param_{ quantizer.dim(), quantizer.weights().data() } {}
+
+	size_t get_data_size() override {
+		return param_.dim;
+	}
+
+	hnswlib::DISTFUNC<float> get_dist_func() override {
+		return distance_kernels().sq8_l2;
+	}
+
+	void* get_dist_func_param() override {
+		return &param_;
+	}
+
+	/// @brief e.g. sq8_avx512
+	std::string kernel_name() const {
+		return "sq8_" + distance_kernels().isa;
+	}
+
+private:
+	kernels::Sq8Param param_;
+};
@@ -0,0 +1,195 @@
+/* Summary statistics of latency samples and tests to compare two runs */
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <utility>
+#include <vector>
+
+/// @brief summary of one latency distribution, in the unit of the samples
+struct Summary {
+	size_t count = 0;
+	double mean = 0.0;
+	// unbiased sample variance
+	double variance = 0.0;
+	double min = 0.0;
+	double p50 = 0.0;
+	double p90 = 0.0;
+	double p95 = 0.0;
+	double p99 = 0.0;
+	double p999 = 0.0;
+	double max = 0.0;
+
+	double stddev() const {
+		return std::sqrt(variance);
+	}
+};
+
+/// @brief nearest rank percentile of sorted samples
+/// @param q quantile in [0, 1]
+inline double percentile_sorted(const std::vector<double>& sorted, double q) {
+	if(sorted.empty()) {
+		return 0.0;
+	}
+	const size_t rank = static_cast<size_t>(std::ceil(q * sorted.size()));
+	return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+inline Summary summarize(std::vector<double> samples) {
+	Summary s;
+	s.count = samples.size();
+	if(samples.empty()) {
+		return s;
+	}
+
+	s.mean = std::accumulate(samples.begin(), samples.end(), 0.0) / s.count;
+	double squares = 0.0;
+	for(const double x : samples) {
+		squares += (x - s.mean) * (x - s.mean);
+	}
+	s.variance = s.count > 1 ? squares / (s.count - 1) : 0.0;
+
+	std::sort(samples.begin(), samples.end());
+	s.min = samples.front();
+	s.p50 = percentile_sorted(samples, 0.50);
+	s.p90 = percentile_sorted(samples, 0.90);
+	s.p95 = percentile_sorted(samples, 0.95);
+	s.p99 = percentile_sorted(samples, 0.99);
+	s.p999 = percentile_sorted(samples, 0.999);
+	s.max = samples.back();
+	return s;
+}
+
+/// @brief summary of several summaries of the same configuration (e.g. repetitions) when the raw
+/// samples were not kept: count, mean and variance are pooled exactly, min/max are the extremes,
+/// percentiles are count weighted means of the per summary percentiles (an approximation)
+inline Summary combine(const std::vector<Summary>& parts) {
+	Summary s;
+	for(const Summary& p : parts) {
+		s.count += p.count;
+	}
+	if(s.count == 0) {
+		return s;
+	}
+
+	double squares = 0.0;
+	s.min = parts.front().min;
+	s.max = parts.front().max;
+	for(const Summary& p : parts) {
+		const double w = static_cast<double>(p.count) / s.count;
+		s.mean += w * p.mean;
+		s.p50 += w * p.p50;
+		s.p90 += w * p.p90;
+		s.p95 += w * p.p95;
+		s.p99 += w * p.p99;
+		s.p999 += w * p.p999;
+		s.min = std::min(s.min, p.min);
+		s.max = std::max(s.max, p.max);
+	}
+	for(const Summary& p : parts) {
+		squares += (p.count > 1 ? p.variance * (p.count - 1) : 0.0) +
+				   p.count * (p.mean - s.mean) * (p.mean - s.mean);
+	}
+	s.variance = s.count > 1 ? squares / (s.count - 1) : 0.0;
+	return s;
+}
+
+/// @brief nearest rank percentile of unsorted samples (reorders them)
+inline double percentile(std::vector<double>& samples, double q) {
+	if(samples.empty()) {
+		return 0.0;
+	}
+	const size_t rank = static_cast<size_t>(std::ceil(q * samples.size()));
+	const auto nth = samples.begin() + (std::clamp<size_t>(rank, 1, samples.size()) - 1);
+	std::nth_element(samples.begin(), nth, samples.end());
+	return *nth;
+}
+
+/// @brief one sided Mann-Whitney U test (normal approximation with tie and continuity correction)
+/// @return p-value of the hypothesis that `candidate` is stochastically greater than `baseline`
+inline double mann_whitney_greater(const std::vector<double>& baseline,
+								   const std::vector<double>& candidate) {
+	const size_t n1 = baseline.size();
+	const size_t n2 = candidate.size();
+	const size_t n = n1 + n2;
+	if(n1 == 0 || n2 == 0) {
+		return 1.0;
+	}
+
+	// (value, from candidate)
+	std::vector<std::pair<double, bool>> all;
+	all.reserve(n);
+	for(const double x : baseline) {
+		all.emplace_back(x, false);
+	}
+	for(const double x : candidate) {
+		all.emplace_back(x, true);
+	}
+	std::sort(all.begin(), all.end());
+
+	// ties get the mean of their ranks, latencies in whole us have lots of them
+	double rank_sum = 0.0;
+	double tie_term = 0.0;
+	for(size_t i = 0; i < n;) {
+		size_t j = i;
+		while(j < n && all[j].first == all[i].first) {
+			j++;
+		}
+		const double rank = (i + 1 + j) / 2.0;
+		for(size_t t = i; t < j; t++) {
+			rank_sum += all[t].second ? rank : 0.0;
+		}
+		const double ties = j - i;
+		tie_term += ties * ties * ties - ties;
+		i = j;
+	}
+
+	const double u = rank_sum - n2 * (n2 + 1) / 2.0;
+	const double mean = n1 * n2 / 2.0;
+	const double variance =
+		n1 * n2 / 12.0 * ((n + 1) - tie_term / (static_cast<double>(n) * (n - 1)));
+	if(variance <= 0.0) {
+		return 1.0;
+	}
+	const double z = (u - mean - 0.5) / std::sqrt(variance);
+	return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
+
+/// @brief percentile bootstrap confidence interval of stat(candidate) / stat(baseline)
+/// @param stat statistic of a (resampled) sample, may reorder it
+/// @param confidence e.g. 0.99 for a 99% interval
+template <typename Stat>
+std::pair<double, double> bootstrap_ratio_ci(const std::vector<double>& baseline,
+											 const std::vector<double>& candidate,
+											 Stat stat,
+											 size_t iterations,
+											 double confidence,
+											 uint64_t seed) {
+	std::mt19937_64 rng(seed);
+	std::uniform_int_distribution<size_t> pick_a(0, baseline.size() - 1);
+	std::uniform_int_distribution<size_t> pick_b(0, candidate.size() - 1);
+
+	std::vector<double> a(baseline.size());
+	std::vector<double> b(candidate.size());
+	std::vector<double> ratios(iterations);
+	for(size_t it = 0; it < iterations; it++) {
+		for(double& x : a) {
+			x = baseline[pick_a(rng)];
+		}
+		for(double& x : b) {
+			x = candidate[pick_b(rng)];
+		}
+		const double denominator = stat(a);
+		ratios[it] = denominator > 0.0 ? stat(b) / denominator : NAN;
+	}
+
+	std::erase_if(ratios, [](double r) { return std::isnan(r); });
+	if(ratios.empty()) {
+		return { NAN, NAN };
+	}
+	const double tail = (1.0 - confidence) / 2.0;
+	return { percentile(ratios, tail), percentile(ratios, 1.0 - tail) };
+}
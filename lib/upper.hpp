@@ -0,0 +1,205 @@
+/* Compact replica of the upper levels of an hnsw index, for the greedy descent of a search */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <format>
+#include <hnswlib/hnswlib.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lib/distance.hpp"
+#include "lib/sq8.hpp"
+
+// The greedy descent of a search reads the links and full vectors of the elements above level 0:
+// about one element in M, spread over the whole level 0 block, and their link lists malloced one
+// by one. UpperReplica copies only those elements, renumbered densely in decreasing level (the few
+// nodes of the top levels first): the links of every level in CSR over the local ids and the
+// vectors next to each other, as floats or as sq8 codes trained on them (a quarter of the bytes,
+// small enough to stay in L2/L3 for a few ten thousand elements). The descent runs on the replica
+// and hands the element of level 1 it ends on to the level 0 search, prefetching the vectors of a
+// node's neighbors before their distances. With floats the descent is the same as on the index.
+// With codes the query is encoded first (a few microseconds for 960 dims, only worth it when the
+// floats do not stay cached) and the descent can end elsewhere, which changes where the level 0
+// search starts, not what it computes.
+
+class UpperReplica {
+public:
+	/// @brief copy the upper levels of `index` (float vectors of `dim` dims)
+	/// @param quantized keep sq8 codes instead of the floats
+	UpperReplica(const hnswlib::HierarchicalNSW<float>& index, size_t dim, bool quantized)
+		: dim_(dim) {
+		const size_t count = index.cur_element_count;
+		for(size_t id = 0; id < count; id++) {
+			if(index.element_levels_[id] > 0 && id != index.enterpoint_node_) {
+				ids_.push_back(id);
+			}
+		}
+		std::stable_sort(ids_.begin(), ids_.end(), [&](hnswlib::tableint a, hnswlib::tableint b) {
+			return index.element_levels_[a] > index.element_levels_[b];
+		});
+		if(count > 0) {
+			ids_.insert(ids_.begin(), index.enterpoint_node_);
+		}
+		const int max_level = count > 0 ? index.maxlevel_ : 0;
+
+		std::vector<uint32_t> local(count, NONE);
+		for(size_t i = 0; i < ids_.size(); i++) {
+			local[ids_[i]] = i;
+		}
+
+		// level l holds the first nodes_[l] elements, those of level >= l
+		nodes_.assign(max_level + 1, 0);
+		for(hnswlib::tableint id : ids_) {
+			for(int level = 1; level <= index.element_levels_[id]; level++) {
+				nodes_[level]++;
+			}
+		}
+		offsets_.resize(max_level + 1);
+		links_.resize(max_level + 1);
+		for(int level = 1; level <= max_level; level++) {
+			offsets_[level].reserve(nodes_[level] + 1);
+			offsets_[level].push_back(0);
+			for(size_t i = 0; i < nodes_[level]; i++) {
+				const hnswlib::linklistsizeint* list = index.get_linklist(ids_[i], level);
+				const hnswlib::tableint* neighbors =
+					reinterpret_cast<const hnswlib::tableint*>(list + 1);
+				for(size_t j = 0; j < *reinterpret_cast<const uint16_t*>(list); j++) {
+					if(local[neighbors[j]] == NONE) {
+						throw std::runtime_error(
+							std::format("element {} links to {} above its level",
+										ids_[i],
+										neighbors[j]));
+					}
+					links_[level].push_back(local[neighbors[j]]);
+				}
+				offsets_[level].push_back(links_[level].size());
+			}
+		}
+
+		std::vector<float> vectors(ids_.size() * dim_);
+		for(size_t i = 0; i < ids_.size(); i++) {
+			const float* v = reinterpret_cast<const float*>(index.getDataByInternalId(ids_[i]));
+			std::copy(v, v + dim_, vectors.data() + i * dim_);
+		}
+		if(quantized) {
+			quantizer_.emplace(Sq8Quantizer::train(vectors.data(), ids_.size(), dim_));
+			codes_.resize(ids_.size() * dim_);
+			for(size_t i = 0; i < ids_.size(); i++) {
+				quantizer_->encode(vectors.data() + i * dim_, codes_.data() + i * dim_);
+			}
+			sq8_param_ = { dim_, quantizer_->weights().data() };
+			distance_ = distance_kernels().sq8_l2;
+			param_ = &sq8_param_;
+		} else {
+			vectors_ = std::move(vectors);
+			distance_ = distance_kernels().l2_for(dim_);
+			param_ = &dim_;
+		}
+	}
+
+	UpperReplica(const UpperReplica&) = delete;
+	UpperReplica& operator=(const UpperReplica&) = delete;
+
+	/// @brief greedy descent from the entry point down to level 1
+	/// @return internal id of the element of level 1 it ends on
+	/// @param hops, distances incremented by the nodes expanded and the distances computed
+	hnswlib::tableint descend(const float* query, size_t& hops, size_t& distances) const {
+		thread_local std::vector<uint8_t> query_code;
+		const void* q = query;
+		if(quantizer_) {
+			query_code.resize(dim_);
+			quantizer_->encode(query, query_code.data());
+			q = query_code.data();
+		}
+
+		uint32_t current = 0;
+		float current_dist = distance(q, current);
+		distances++;
+		for(size_t level = nodes_.size() - 1; level > 0; level--) {
+			const std::vector<uint32_t>& offsets = offsets_[level];
+			const uint32_t* links = links_[level].data();
+			bool changed = true;
+			while(changed) {
+				changed = false;
+				hops++;
+				const uint32_t end = offsets[current + 1];
+				for(uint32_t j = offsets[current]; j < end; j++) {
+					__builtin_prefetch(vector(links[j]));
+				}
+				for(uint32_t j = offsets[current]; j < end; j++) {
+					const float d = distance(q, links[j]);
+					distances++;
+					if(d < current_dist) {
+						current_dist = d;
+						current = links[j];
+						changed = true;
+					}
+				}
+			}
+		}
+		return ids_[current];
+	}
+
+	bool quantized() const {
+		return quantizer_.has_value();
+	}
+
+	/// @brief elements above level 0
+	size_t size() const {
+		return ids_.size();
+	}
+
+	/// @brief vectors or codes
+	size_t vector_bytes() const {
+		return vectors_.size() * sizeof(float) + codes_.size();
+	}
+
+	/// @brief links, offsets and the map to internal ids
+	size_t link_bytes() const {
+		size_t bytes = ids_.size() * sizeof(hnswlib::tableint);
+		for(size_t level = 0; level < links_.size(); level++) {
+			bytes += (links_[level].size() + offsets_[level].size()) * sizeof(uint32_t);
+		}
+		return bytes;
+	}
+
+	size_t memory_bytes() const {
+		return vector_bytes() + link_bytes();
+	}
+
+	/// @brief e.g. upper_sq8_avx512
+	std::string kernel_name() const {
+		return std::format("upper_{}_{}", quantized() ? "sq8" : "fp32", distance_kernels().isa);
+	}
+
+private:
+	static constexpr uint32_t NONE = UINT32_MAX;
+
+	const void* vector(uint32_t node) const {
+		if(quantizer_) {
+			return codes_.data() + node * dim_;
+		}
+		return vectors_.data() + node * dim_;
+	}
+
+	float distance(const void* query, uint32_t node) const {
+		return distance_(query, vector(node), param_);
+	}
+
+	size_t dim_;
+	// internal id of every local node, the entry point first, then by decreasing level
+	std::vector<hnswlib::tableint> ids_;
+	// per level: nodes on it, CSR offsets (nodes + 1) and neighbors as local ids
+	std::vector<size_t> nodes_;
+	std::vector<std::vector<uint32_t>> offsets_;
+	std::vector<std::vector<uint32_t>> links_;
+	std::vector<float> vectors_;
+	std::vector<uint8_t> codes_;
+	std::optional<Sq8Quantizer> quantizer_;
+	kernels::Sq8Param sq8_param_{};
+	hnswlib::DISTFUNC<float> distance_;
+	const void* param_;
+};
@@ -1,8 +1,46 @@
+#pragma once
+
 #include <atomic>
+#include <chrono>
+#include <fstream>
+#include <format>
+#include <iostream>
 #include <mutex>
 #include <thread>
+#include <unistd.h>
 #include <vector>
 
+template <typename T>
+struct std::formatter<std::vector<T>> {
+	constexpr auto parse(std::format_parse_context& ctx) {
+		return ctx.begin();
+	}
+
+	auto format(const std::vector<T>& vec, std::format_context& ctx) const {
+		auto out = ctx.out();
+		*out++ = '{';
+		for(auto it = vec.begin(); it != vec.end(); ++it) {
+			if(it != vec.begin()) {
+				*out++ = ',';
+				*out++ = ' ';
+			}
+			out = std::format_to(out, "{}", *it);
+		}
+		*out++ = '}';
+		return out;
+	}
+};
+
+/// @brief resident set size of this process in bytes (from /proc/self/statm), 0 if unavailable
+inline size_t resident_bytes() {
+	std::ifstream statm("/proc/self/statm");
+	size_t total_pages = 0, resident_pages = 0;
+	if(!(statm >> total_pages >> resident_pages)) {
+		return 0;
+	}
+	return resident_pages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
 // Multithreaded executor
 // The helper function copied from python_bindings/bindings.cpp (and that itself is copied from nmslib)
 // An alternative is using #pragme omp parallel for or any other C++ threading
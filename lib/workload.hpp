@@ -0,0 +1,261 @@
+/* Generates query sequences that look like real traffic instead of one vector N times */
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lib/argparser.hpp"
+#include "lib/embeddings.hpp"
+#include "lib/isolation.hpp"
+
+enum class Distribution {
+	uniform, // every query in the pool is equally likely
+	zipf, // a few hot queries, long tail (rank r has weight 1 / r^skew)
+	repeat, // each query is issued `repeat` times back to back
+	burst, // uniform background with bursts of one hot query
+	drift, // zipf whose hot set slides through the pool over time
+};
+
+inline Distribution parse_distribution(const std::string& name) {
+	if(name == "uniform")
+		return Distribution::uniform;
+	if(name == "zipf")
+		return Distribution::zipf;
+	if(name == "repeat")
+		return Distribution::repeat;
+	if(name == "burst")
+		return Distribution::burst;
+	if(name == "drift")
+		return Distribution::drift;
+	throw std::runtime_error(std::format("unknown workload distribution '{}'", name));
+}
+
+struct WorkloadConfig {
+	Distribution distribution = Distribution::uniform;
+	size_t num_queries = 10000; // length of the generated sequence
+	double zipf_skew = 1.0; // zipf and drift
+	size_t repeat = 10; // repeat
+	double burst_probability = 0.01; // burst: chance that a query starts a burst
+	size_t burst_length = 50; // burst
+	double drift_per_query = 0.01; // drift: pool positions the hot set moves per query
+	size_t num_perturbed = 0; // perturbed base vectors appended to the pool
+	float noise = 0.05f; // perturbation stddev relative to the per dimension rms of the vector
+	uint64_t seed = 42;
+};
+
+struct Workload {
+	// the query set followed by the perturbed base vectors
+	Embedding<float> pool;
+	// pool ids below this are original queries and have ground truth
+	size_t num_original;
+	// pool id of every query in issue order
+	std::vector<size_t> sequence;
+
+	const float* query(size_t pool_id) const {
+		return pool.data.get() + static_cast<size_t>(pool.dim) * pool_id;
+	}
+};
+
+/// @brief samples ranks in [0, n) with probability proportional to 1 / (rank + 1)^skew
+class ZipfSampler {
+public:
+	ZipfSampler(size_t n, double skew)
+		: cdf_(n) {
+		double sum = 0.0;
+		for(size_t rank = 0; rank < n; rank++) {
+			sum += 1.0 / std::pow(static_cast<double>(rank + 1), skew);
+			cdf_[rank] = sum;
+		}
+		for(double& c : cdf_) {
+			c /= sum;
+		}
+	}
+
+	template <typename Rng>
+	size_t operator()(Rng& rng) {
+		const double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+		const auto it = std::lower_bound(cdf_.begin(), cdf_.end(), u);
+		return std::min<size_t>(it - cdf_.begin(), cdf_.size() - 1);
+	}
+
+private:
+	std::vector<double> cdf_;
+};
+
+/// @brief build the pool of candidate queries and the sequence they are issued in
+/// @param queries the query set, every query is a pool entry with ground truth
+/// @param base base vectors to perturb, only read if config.num_perturbed > 0
+inline std::unique_ptr<Workload> generate_workload(const Embedding<float>& queries,
+								  const Embedding<float>* base,
+								  const WorkloadConfig& config) {
+	if(config.num_perturbed > 0 && (base == nullptr || base->dim != queries.dim)) {
+		throw std::runtime_error("perturbed queries need a base set of the same dimension");
+	}
+
+	std::mt19937_64 rng(config.seed);
+	const size_t dim = queries.dim;
+	const size_t num_original = queries.nb;
+	const size_t pool_size = num_original + config.num_perturbed;
+
+	std::unique_ptr<float[]> pool = std::make_unique<float[]>(pool_size * dim);
+	std::memcpy(pool.get(), queries.data.get(), sizeof(float) * num_original * dim);
+
+	std::normal_distribution<float> gaussian(0.0f, 1.0f);
+	for(size_t i = 0; i < config.num_perturbed; i++) {
+		const size_t row = std::uniform_int_distribution<size_t>(0, base->nb - 1)(rng);
+		const float* src = base->data.get() + dim * row;
+		float* dest = pool.get() + dim * (num_original + i);
+
+		const float rms = std::sqrt(std::inner_product(src, src + dim, src, 0.0f) / dim);
+		for(size_t d = 0; d < dim; d++) {
+			dest[d] = src[d] + config.noise * rms * gaussian(rng);
+		}
+	}
+
+	// hot queries are a random permutation of the pool, not simply the first ids
+	std::vector<size_t> by_popularity(pool_size);
+	std::iota(by_popularity.begin(), by_popularity.end(), 0);
+	std::shuffle(by_popularity.begin(), by_popularity.end(), rng);
+
+	std::uniform_int_distribution<size_t> uniform(0, pool_size - 1);
+	std::vector<size_t> sequence;
+	sequence.reserve(config.num_queries);
+
+	switch(config.distribution) {
+	case Distribution::uniform:
+		while(sequence.size() < config.num_queries) {
+			sequence.push_back(uniform(rng));
+		}
+		break;
+	case Distribution::zipf: {
+		ZipfSampler zipf(pool_size, config.zipf_skew);
+		while(sequence.size() < config.num_queries) {
+			sequence.push_back(by_popularity[zipf(rng)]);
+		}
+		break;
+	}
+	case Distribution::repeat:
+		while(sequence.size() < config.num_queries) {
+			const size_t id = uniform(rng);
+			for(size_t r = 0; r < config.repeat && sequence.size() < config.num_queries; r++) {
+				sequence.push_back(id);
+			}
+		}
+		break;
+	case Distribution::burst: {
+		std::bernoulli_distribution starts_burst(config.burst_probability);
+		while(sequence.size() < config.num_queries) {
+			const size_t id = uniform(rng);
+			const size_t length = starts_burst(rng) ? config.burst_length : 1;
+			for(size_t r = 0; r < length && sequence.size() < config.num_queries; r++) {
+				sequence.push_back(id);
+			}
+		}
+		break;
+	}
+	case Distribution::drift: {
+		ZipfSampler zipf(pool_size, config.zipf_skew);
+		for(size_t t = 0; t < config.num_queries; t++) {
+			const size_t offset = static_cast<size_t>(config.drift_per_query * t);
+			sequence.push_back(by_popularity[(zipf(rng) + offset) % pool_size]);
+		}
+		break;
+	}
+	}
+
+	return std::unique_ptr<Workload>(new Workload{
+		Embedding<float>{ std::move(pool), static_cast<int>(dim), static_cast<int>(pool_size) },
+		num_original,
+		std::move(sequence) });
+}
+
+/// @brief register the workload knobs shared by the benchmarks
+inline void add_workload_arguments(argparse::ArgumentParser& program) {
+	program.add_argument("--workload")
+		.help("query distribution: uniform, zipf, repeat, burst or drift")
+		.default_value(std::string("uniform"));
+	program.add_argument("--num-queries")
+		.help("number of queries in the workload")
+		.default_value(10000)
+		.scan<'i', int>();
+	program.add_argument("--zipf-skew")
+		.help("zipf exponent for zipf and drift")
+		.default_value(1.0)
+		.scan<'g', double>();
+	program.add_argument("--repeat")
+		.help("back to back repetitions per query for repeat")
+		.default_value(10)
+		.scan<'i', int>();
+	program.add_argument("--burst-probability")
+		.help("probability that a query starts a burst")
+		.default_value(0.01)
+		.scan<'g', double>();
+	program.add_argument("--burst-length")
+		.help("number of queries in a burst")
+		.default_value(50)
+		.scan<'i', int>();
+	program.add_argument("--drift")
+		.help("pool positions the hot set moves per query for drift")
+		.default_value(0.01)
+		.scan<'g', double>();
+	program.add_argument("--perturbed")
+		.help("number of perturbed base vectors to add to the query pool (loads gist_base)")
+		.default_value(0)
+		.scan<'i', int>();
+	program.add_argument("--noise")
+		.help("perturbation stddev relative to the rms of the base vector")
+		.default_value(0.05)
+		.scan<'g', double>();
+	program.add_argument("--seed").help("workload seed").default_value(42).scan<'i', int>();
+}
+
+inline WorkloadConfig workload_config_from(const argparse::ArgumentParser& program) {
+	WorkloadConfig config;
+	config.distribution = parse_distribution(program.get<std::string>("--workload"));
+	config.num_queries = program.get<int>("--num-queries");
+	config.zipf_skew = program.get<double>("--zipf-skew");
+	config.repeat = program.get<int>("--repeat");
+	config.burst_probability = program.get<double>("--burst-probability");
+	config.burst_length = program.get<int>("--burst-length");
+	config.drift_per_query = program.get<double>("--drift");
+	config.num_perturbed = program.get<int>("--perturbed");
+	config.noise = static_cast<float>(program.get<double>("--noise"));
+	config.seed = program.get<int>("--seed");
+	return config;
+}
+
+/// @brief write one row per issued query: position, pool id, latency and recall
+/// @param recall negative for queries without ground truth, written as an empty field
+inline void write_workload_csv(const std::filesystem::path& csv_filename,
+							   const EnvironmentInfo& env,
+							   const Workload& workload,
+							   const std::vector<uint64_t>& latency,
+							   const std::vector<double>& recall) {
+	std::cout << "writing to file: " << csv_filename.string() << std::endl;
+	std::ofstream fout(csv_filename);
+	if(!fout.is_open()) {
+		std::cerr << "cannot open file: " << csv_filename << std::endl;
+		return;
+	}
+
+	write_environment(fout, env);
+	fout << "seq, query id, latency (us), recall\n";
+	for(size_t seq = 0; seq < workload.sequence.size(); seq++) {
+		fout << seq << ", " << workload.sequence[seq] << ", " << latency[seq] << ", ";
+		if(recall[seq] >= 0.0) {
+			fout << recall[seq];
+		}
+		fout << '\n';
+	}
+}
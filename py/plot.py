@@ -49,7 +49,7 @@ if __name__ == '__main__':
 
     metadata = CsvMetadata(filename.name)
 
-    df = pd.read_csv(filename)
+    df = pd.read_csv(filename, comment='#')
 
     # # plot
 
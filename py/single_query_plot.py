@@ -52,7 +52,7 @@ if __name__ == '__main__':
     metadata = CsvMetadata(filename.name)
 
     print("reading csv")
-    df = pd.read_csv(filename)
+    df = pd.read_csv(filename, comment='#')
 
     # plot
     title = []
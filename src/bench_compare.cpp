@@ -0,0 +1,247 @@
+#include "lib/argparser.hpp"
+#include "lib/backends.hpp"
+#include "lib/embeddings.hpp"
+#include "lib/isolation.hpp"
+#include "lib/recall.hpp"
+#include "lib/utils.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <numeric>
+#include <omp.h>
+#include <vector>
+
+namespace chrono = std::chrono;
+namespace fs = std::filesystem;
+
+// Apples-to-apples comparison of hnswlib and faiss: every backend is built on the same base
+// vectors, queried single threaded with the same queries and timing code, and scored with the
+// same RecallEvaluator. At the end the fastest configuration of every backend that reaches each
+// target recall is printed (matched operating points).
+
+struct OperatingPoint {
+	std::string backend;
+	double build_seconds;
+	size_t memory_bytes;
+	int search_param;
+	QualityMetrics quality;
+	double qps;
+	double mean_us;
+	double p99_us;
+};
+
+int main(int argc, char** argv) {
+	argparse::ArgumentParser program("bench_compare");
+
+	program.add_argument("gist_dir").help("path to base gist directory");
+	program.add_argument("res_path").help("path to directory to write result");
+	program.add_argument("--backends")
+		.help("backend specs: hnswlib,M=..,efc=..[,index=path][,storage=fp16|bf16] | "
+			  "faiss_hnsw,M=..,efc=.. | ivf_flat,nlist=.. | ivf_pq,nlist=..,m=..,nbits=.. | flat")
+		.default_value(std::vector<std::string>{ "hnswlib,M=32,efc=200",
+												 "faiss_hnsw,M=32,efc=200",
+												 "ivf_flat,nlist=4096",
+												 "ivf_pq,nlist=4096,m=96",
+												 "flat" })
+		.nargs(argparse::nargs_pattern::at_least_one);
+	program.add_argument("--ef")
+		.help("ef sweep for the hnsw backends")
+		.default_value(std::vector<int>{ 16, 32, 64, 128, 256, 512 })
+		.scan<'i', int>()
+		.nargs(argparse::nargs_pattern::at_least_one);
+	program.add_argument("--nprobe")
+		.help("nprobe sweep for the ivf backends")
+		.default_value(std::vector<int>{ 1, 4, 16, 64, 256 })
+		.scan<'i', int>()
+		.nargs(argparse::nargs_pattern::at_least_one);
+	program.add_argument("-k").help("neighbors per query").default_value(10).scan<'i', int>();
+	program.add_argument("--nb")
+		.help("only index the first nb base vectors (needs a matching --groundtruth)")
+		.default_value(0)
+		.scan<'i', int>();
+	program.add_argument("--groundtruth")
+		.help("ivecs ground truth (default: gist_groundtruth.ivecs)")
+		.default_value(std::string(""));
+	program.add_argument("--target-recall")
+		.help("recall levels to report matched operating points at")
+		.default_value(std::vector<double>{ 0.9, 0.95, 0.99 })
+		.scan<'g', double>()
+		.nargs(argparse::nargs_pattern::at_least_one);
+
+	try {
+		program.parse_args(argc, argv);
+	} catch(const std::exception& err) {
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		return 1;
+	}
+
+	const fs::path gist_dir{ program.get<std::string>("gist_dir") };
+	const fs::path res_path{ program.get<std::string>("res_path") };
+	const auto backend_specs = program.get<std::vector<std::string>>("--backends");
+	const auto ef_sweep = program.get<std::vector<int>>("--ef");
+	const auto nprobe_sweep = program.get<std::vector<int>>("--nprobe");
+	const size_t k = program.get<int>("-k");
+	const auto target_recall = program.get<std::vector<double>>("--target-recall");
+	const fs::path gist_groundtruth = program.get<std::string>("--groundtruth").empty()
+										  ? gist_dir / "gist_groundtruth.ivecs"
+										  : fs::path(program.get<std::string>("--groundtruth"));
+
+	const auto GIST_B = load_vecs<float>(gist_dir / "gist_base.fvecs", program.get<int>("--nb"));
+	const auto GIST_Q = load_gist_960<float>(gist_dir / "gist_query.fvecs");
+	const auto GIST_GT = load_gist_960<int>(gist_groundtruth);
+	const RecallEvaluator evaluator(GIST_GT);
+	std::cout << std::format("gist base with NB = {}, queries with NB = {}, gt depth = {}",
+							 GIST_B.nb,
+							 GIST_Q.nb,
+							 GIST_GT.dim)
+			  << std::endl;
+
+	const int max_threads = omp_get_max_threads();
+	std::vector<OperatingPoint> points;
+	std::vector<std::string> backend_names;
+
+	for(const std::string& spec : backend_specs) {
+		auto backend = make_backend(spec, GIST_B.dim);
+		backend_names.push_back(backend->name());
+		std::cout << std::format("building {}", backend->name()) << std::endl;
+
+		omp_set_num_threads(max_threads);
+		const size_t rss_before = resident_bytes();
+		auto start = chrono::high_resolution_clock::now();
+		backend->build(GIST_B);
+		auto end = chrono::high_resolution_clock::now();
+		const double build_seconds = chrono::duration<double>(end - start).count();
+		std::cout << std::format("\tbuild: {:.1f}s, index: {} MiB, rss delta: {} MiB",
+								 build_seconds,
+								 backend->memory_bytes() >> 20,
+								 (resident_bytes() - rss_before) >> 20)
+				  << std::endl;
+
+		// latency is compared single threaded, faiss would otherwise parallelize inside a query
+		omp_set_num_threads(1);
+
+		std::vector<int> sweep{ 0 };
+		if(backend->search_param_name() == "ef") {
+			sweep = ef_sweep;
+		} else if(backend->search_param_name() == "nprobe") {
+			sweep = nprobe_sweep;
+		}
+
+		for(const int param : sweep) {
+			if(!backend->search_param_name().empty()) {
+				backend->set_search_param(param);
+			}
+
+			std::vector<SearchResult> results(GIST_Q.nb);
+			std::vector<double> latency_us(GIST_Q.nb);
+			for(int q = 0; q < GIST_Q.nb; q++) {
+				const float* query = GIST_Q.data.get() + static_cast<size_t>(GIST_Q.dim) * q;
+				auto start = chrono::high_resolution_clock::now();
+				results[q] = backend->search(query, k);
+				auto end = chrono::high_resolution_clock::now();
+				latency_us[q] = chrono::duration<double, std::micro>(end - start).count();
+			}
+
+			const double total_us = std::accumulate(latency_us.begin(), latency_us.end(), 0.0);
+			std::sort(latency_us.begin(), latency_us.end());
+			OperatingPoint point{ backend->name(),
+								  build_seconds,
+								  backend->memory_bytes(),
+								  param,
+								  evaluator.evaluate(results, k),
+								  GIST_Q.nb / (total_us / 1e6),
+								  total_us / GIST_Q.nb,
+								  latency_us[latency_us.size() * 99 / 100] };
+			std::cout << std::format("\t{} = {}: recall@{} = {:.2f}%, qps = {:.1f}, p99 = {:.1f}us",
+									 backend->search_param_name(),
+									 param,
+									 k,
+									 point.quality.recall * 100,
+									 point.qps,
+									 point.p99_us)
+					  << std::endl;
+			points.push_back(point);
+		}
+	}
+	omp_set_num_threads(max_threads);
+
+	fs::path csv_filename = res_path / fs::path(std::format(
+										   "4-CMP-CPU_dim_960_nb_{}_K_{}_comparison.csv", GIST_B.nb, k));
+	std::cout << "writing to file: " << csv_filename.string() << std::endl;
+	std::ofstream fout(csv_filename);
+	if(fout.is_open()) {
+		write_environment(fout, capture_environment(sched_getcpu()));
+		// backend names contain commas, so they are quoted
+		fout << "backend, build (s), memory (bytes), search param, recall, 1-recall@1, map, qps, "
+				"mean (us), p99 (us)\n";
+		for(const OperatingPoint& p : points) {
+			fout << std::format("\"{}\", {}, {}, {}, {}, {}, {}, {}, {}, {}\n",
+								p.backend,
+								p.build_seconds,
+								p.memory_bytes,
+								p.search_param,
+								p.quality.recall,
+								p.quality.recall_1_at_1,
+								p.quality.map,
+								p.qps,
+								p.mean_us,
+								p.p99_us);
+		}
+	} else {
+		std::cerr << "cannot open file: " << csv_filename << std::endl;
+	}
+
+	// matched operating points: the fastest setting of every backend at or above each recall
+	for(const double target : target_recall) {
+		std::cout << std::format("recall@{} >= {:.2f}:", k, target) << std::endl;
+		for(const std::string& name : backend_names) {
+			const OperatingPoint* best = nullptr;
+			for(const OperatingPoint& p : points) {
+				if(p.backend == name && p.quality.recall >= target &&
+				   (best == nullptr || p.qps > best->qps)) {
+					best = &p;
+				}
+			}
+			if(best == nullptr) {
+				std::cout << std::format("\t{:40} not reached", name) << std::endl;
+			} else {
+				std::cout << std::format("\t{:40} param = {:4}, qps = {:8.1f}, p99 = {:8.1f}us, "
+										 "memory = {} MiB",
+										 name,
+										 best->search_param,
+										 best->qps,
+										 best->p99_us,
+										 best->memory_bytes >> 20)
+						  << std::endl;
+			}
+		}
+	}
+
+	// half precision storage against the same hnswlib backend over floats, setting by setting
+	for(const OperatingPoint& half : points) {
+		const size_t storage = half.backend.find(",storage=");
+		if(storage == std::string::npos) {
+			continue;
+		}
+		for(const OperatingPoint& full : points) {
+			if(full.backend != half.backend.substr(0, storage) ||
+			   full.search_param != half.search_param) {
+				continue;
+			}
+			std::cout << std::format("{} vs fp32 at ef = {}: recall {:+.2f} points, qps x{:.2f}, "
+									 "p99 x{:.2f}, memory x{:.2f}",
+									 half.backend,
+									 half.search_param,
+									 (half.quality.recall - full.quality.recall) * 100,
+									 half.qps / full.qps,
+									 half.p99_us / full.p99_us,
+									 static_cast<double>(half.memory_bytes) / full.memory_bytes)
+					  << std::endl;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,245 @@
+#include "lib/argparser.hpp"
+#include "lib/compact.hpp"
+#include "lib/distance.hpp"
+#include "lib/embeddings.hpp"
+#include "lib/isolation.hpp"
+#include "lib/recall.hpp"
+#include "lib/query_log.hpp"
+#include "lib/utils.hpp"
+#include "lib/workload.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <hnswlib/hnswlib.h>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+namespace chrono = std::chrono;
+namespace fs = std::filesystem;
+
+// We want to benchmark throughput and latency when many threads query one index concurrently
+// with queries drawn from a workload (see lib/workload.hpp). With --frozen every thread count also
+// runs on the index loaded read only (lib/compact.hpp), which takes no lock on a search.
+
+// the K to run the queries on
+inline constexpr size_t QUERY_K = 100;
+
+int main(int argc, char** argv) {
+	argparse::ArgumentParser program("bench_mt");
+
+	program.add_argument("gist_dir").help("path to base gist directory");
+	program.add_argument("res_path").help("path to directory to write result");
+	program.add_argument("index_path").help("path to hnsw index file");
+	program.add_argument("-t")
+		.help("list of space separated thread counts")
+		.default_value(std::vector<int>{ 1, 2, 4, 8, 16, 32 })
+		.scan<'i', int>()
+		.nargs(argparse::nargs_pattern::at_least_one);
+	program.add_argument("--ef").help("search ef").default_value(100).scan<'i', int>();
+	program.add_argument("--capture")
+		.help("write the queries of the first thread count to this query log")
+		.default_value(std::string(""));
+	program.add_argument("--frozen")
+		.help("also load the index frozen (lib/compact.hpp: read only, no locks, separate level 0 "
+			  "arrays) and run every thread count on both, reporting the memory saved")
+		.default_value(false)
+		.implicit_value(true);
+	add_workload_arguments(program);
+
+	try {
+		program.parse_args(argc, argv);
+	} catch(const std::exception& err) {
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		return 1;
+	}
+
+	const fs::path gist_dir{ program.get<std::string>("gist_dir") };
+	const fs::path res_path{ program.get<std::string>("res_path") };
+	const fs::path index_path{ program.get<std::string>("index_path") };
+	const std::vector<int> thread_counts = program.get<std::vector<int>>("-t");
+	const int ef = program.get<int>("--ef");
+	const WorkloadConfig workload_config = workload_config_from(program);
+	const std::string capture_path = program.get<std::string>("--capture");
+	const bool frozen = program.get<bool>("--frozen");
+
+	const fs::path gist_query = gist_dir / "gist_query.fvecs";
+	const fs::path gist_groundtruth = gist_dir / "gist_groundtruth.ivecs";
+
+	std::cout << "Configurations: " << std::endl;
+	std::cout << std::format("\tTHREADS = {}", thread_counts) << std::endl;
+	std::cout << std::format("\tEF = {}", ef) << std::endl;
+	std::cout << std::format("\tWORKLOAD = {}", program.get<std::string>("--workload"))
+			  << std::endl;
+	std::cout << std::format("\tTOP_K = {}", QUERY_K) << std::endl;
+
+	const auto GIST_Q = load_gist_960<float>(gist_query);
+	const auto GIST_GT = load_gist_960<int>(gist_groundtruth);
+
+	std::unique_ptr<Workload> workload;
+	if(workload_config.num_perturbed > 0) {
+		const auto GIST_B = load_gist_960<float>(gist_dir / "gist_base.fvecs");
+		workload = generate_workload(GIST_Q, &GIST_B, workload_config);
+	} else {
+		workload = generate_workload(GIST_Q, nullptr, workload_config);
+	}
+	const size_t n = workload->sequence.size();
+	if(n == 0) {
+		throw std::runtime_error("empty workload, --num-queries must be at least 1");
+	}
+
+	std::cout << std::format("loading from file: {}", index_path.string()) << std::endl;
+	std::cout << std::format("distance kernels: {} (cpu: {})",
+							 distance_kernels().isa,
+							 cpu_simd_features())
+			  << std::endl;
+	DispatchedL2Space space(960);
+	const size_t rss_before = resident_bytes();
+	hnswlib::HierarchicalNSW<float> alg_hnsw = hnswlib::HierarchicalNSW<float>(&space, index_path);
+	alg_hnsw.setEf(ef);
+	const size_t rss_hnswlib = resident_bytes() - rss_before;
+
+	// loaded from the file rather than copied from alg_hnsw, as a read only server would: the
+	// compact copy build_hnsw saved if there is one, the hnswlib file otherwise
+	std::optional<CompactIndex> frozen_index;
+	if(frozen) {
+		const fs::path frozen_path = fs::exists(compact_index_path(index_path))
+										 ? compact_index_path(index_path)
+										 : index_path;
+		const size_t rss_before_frozen = resident_bytes();
+		frozen_index.emplace(CompactIndex::load(frozen_path, space));
+		const size_t rss_frozen = resident_bytes() - rss_before_frozen;
+		const HnswMemory memory = hnsw_memory(alg_hnsw);
+		const size_t hnswlib_bytes = memory.level0 + memory.upper + memory.bookkeeping;
+		const size_t frozen_bytes = frozen_index->level0_bytes() + frozen_index->upper_bytes();
+		std::cout << std::format("hnswlib: {} MiB resident (level 0 {} MiB, upper {} MiB, "
+								 "bookkeeping ~{} MiB)",
+								 rss_hnswlib >> 20,
+								 memory.level0 >> 20,
+								 memory.upper >> 20,
+								 memory.bookkeeping >> 20)
+				  << std::endl;
+		std::cout << std::format("frozen ({}, {} links): {} MiB resident (level 0 {} MiB, upper "
+								 "{} MiB), {} MiB saved ({:.1f}%)",
+								 frozen_path.filename().string(),
+								 link_encoding_name(frozen_index->encoding()),
+								 rss_frozen >> 20,
+								 frozen_index->level0_bytes() >> 20,
+								 frozen_index->upper_bytes() >> 20,
+								 (static_cast<double>(hnswlib_bytes) - frozen_bytes) / (1 << 20),
+								 100.0 * (1.0 - static_cast<double>(frozen_bytes) / hnswlib_bytes))
+				  << std::endl;
+	}
+
+	EnvironmentInfo env = capture_environment(sched_getcpu());
+
+	std::unique_ptr<QueryLogWriter> capture;
+	if(!capture_path.empty()) {
+		capture = std::make_unique<QueryLogWriter>(capture_path, workload->pool.dim);
+	}
+
+	const auto run = [&](const std::string& layout, int threads, const auto& search) {
+		std::cout << std::format("threads: {} ({})", threads, layout) << std::endl;
+		std::vector<uint64_t> latency(n);
+		std::vector<double> recall(n, -1.0);
+		// kept per query and scored after the loop, the recall is not part of the timed span
+		std::vector<std::invoke_result_t<decltype(search), const float*>> outputs(n);
+		std::vector<chrono::high_resolution_clock::time_point> started(n);
+		std::vector<chrono::high_resolution_clock::time_point> finished(n);
+		const auto capture_start = chrono::high_resolution_clock::now();
+
+		ParallelFor(0, n, threads, [&](size_t seq, size_t) {
+			const size_t pool_id = workload->sequence[seq];
+			auto start = chrono::high_resolution_clock::now();
+			auto output = search(workload->query(pool_id));
+			auto end = chrono::high_resolution_clock::now();
+			latency[seq] = chrono::duration_cast<chrono::microseconds>(end - start).count();
+			started[seq] = start;
+			finished[seq] = end;
+			outputs[seq] = std::move(output);
+		});
+
+		// written after the loop, in start order: appending from the workers would serialize
+		// them on the writer's lock and log the queries in completion order
+		if(capture) {
+			std::vector<size_t> order(n);
+			std::iota(order.begin(), order.end(), 0);
+			std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+				return started[a] < started[b];
+			});
+			for(const size_t seq : order) {
+				const auto since_start = started[seq] - capture_start;
+				capture->append(chrono::duration_cast<chrono::nanoseconds>(since_start).count(),
+								workload->query(workload->sequence[seq]),
+								QUERY_K,
+								ef);
+			}
+			capture.reset();
+		}
+
+		// ParallelFor's progress printer sleeps in 1s steps, so take the wall time from the
+		// first query start to the last query end instead of timing the call
+		const double seconds =
+			chrono::duration<double>(*std::max_element(finished.begin(), finished.end()) -
+									 *std::min_element(started.begin(), started.end()))
+				.count();
+
+		// only queries from the query set have ground truth
+		for(size_t seq = 0; seq < n; seq++) {
+			const size_t pool_id = workload->sequence[seq];
+			if(pool_id < workload->num_original) {
+				recall[seq] = calculate_recall(pool_id, GIST_GT, outputs[seq], QUERY_K);
+			}
+		}
+
+		std::vector<uint64_t> sorted = latency;
+		std::sort(sorted.begin(), sorted.end());
+		double recall_sum = 0.0;
+		size_t recall_count = 0;
+		for(const double r : recall) {
+			if(r >= 0.0) {
+				recall_sum += r;
+				recall_count++;
+			}
+		}
+		std::cout << std::format("\tqps: {:.1f}, mean: {:.1f}us, p99: {}us, recall: {:.2f}%",
+								 n / seconds,
+								 std::accumulate(sorted.begin(), sorted.end(), 0.0) / n,
+								 sorted[std::min(n - 1, n * 99 / 100)],
+								 recall_count ? 100.0 * recall_sum / recall_count : 0.0)
+				  << std::endl;
+
+		const std::string index_name =
+			index_path.filename().string() + (layout == "hnswlib" ? "" : "_" + layout);
+		write_workload_csv(res_path /
+							   fs::path(std::format(
+								   "3-MT-CPU_dim_960_nb_1000000_{}_searchef_{}_threads_{}_{}_workload_latencies.csv",
+								   index_name,
+								   ef,
+								   threads,
+								   program.get<std::string>("--workload"))),
+						   env,
+						   *workload,
+						   latency,
+						   recall);
+	};
+
+	for(const int threads : thread_counts) {
+		run("hnswlib", threads, [&](const float* query) {
+			return alg_hnsw.searchKnn(query, QUERY_K);
+		});
+		if(frozen_index) {
+			run("frozen", threads, [&](const float* query) {
+				return frozen_index->search(query, QUERY_K, ef);
+			});
+		}
+	}
+
+	return 0;
+}
@@ -1,21 +1,36 @@
+#include "lib/arena.hpp"
 #include "lib/argparser.hpp"
+#include "lib/binary.hpp"
+#include "lib/cache_control.hpp"
+#include "lib/compact.hpp"
+#include "lib/distance.hpp"
 #include "lib/embeddings.hpp"
+#include "lib/half.hpp"
+#include "lib/isolation.hpp"
+#include "lib/pca.hpp"
+#include "lib/pq.hpp"
+#include "lib/recall.hpp"
+#include "lib/result_store.hpp"
+#include "lib/search.hpp"
+#include "lib/sq8.hpp"
+#include "lib/upper.hpp"
 #include "lib/utils.hpp"
+#include "lib/workload.hpp"
 
-#include <cassert>
+#include <algorithm>
 #include <chrono>
 #include <filesystem>
 #include <format>
 #include <hnswlib/hnswlib.h>
+#include <map>
+#include <numeric>
+#include <optional>
 #include <random>
 #include <vector>
 
 namespace chrono = std::chrono;
 namespace fs = std::filesystem;
 
-// CONFIGURE HNSW
-int EF[] = { 100, 150, 200, 250, 300 };
-
 // We want to benchmark a few items
 //
 // 1. performance querying a single query multiple times
@@ -23,18 +38,39 @@ int EF[] = { 100, 150, 200, 250, 300 };
 // 3. recall of querying different queries of top k = 100, and possibly other top k's
 //
 // Note: batching is not really applicable to HNSWs
+//
+// Grids over several indexes, k's and thread counts are run by run_experiments instead.
 
-// CONFIGURE BENCHMARK VALUES
-// number of runs for a single vector
-inline constexpr size_t RUNS_FOR_SINGLE_QUERY = 1000;
+/// @brief write one row per query with one latency column per run and the recall
+void write_latency_csv(const fs::path& csv_filename,
+					   const EnvironmentInfo& env,
+					   const std::vector<std::vector<uint64_t>>& latency,
+					   const std::vector<double>& recall) {
+	std::cout << "writing to file: " << csv_filename.string() << std::endl;
+	std::ofstream fout(csv_filename);
+	if(fout.is_open()) {
+		write_environment(fout, env);
+		fout << "id";
+		for(size_t iter = 0; iter < latency.front().size(); iter++)
+			fout << ", iter" << (iter + 1) << " (us)";
 
-// number of different vectors to try single queries on
-inline constexpr size_t NUM_SINGLE_QUERIES = 5;
+		fout << ", recall";
+		fout << '\n';
+		for(size_t test_id = 0; test_id < latency.size(); test_id++) {
+			fout << test_id;
 
-// the K to run the single query on
-inline constexpr size_t SINGLE_QUERY_K = 100;
+			for(size_t iter = 0; iter < latency[test_id].size(); iter++) {
+				fout << ", " << latency[test_id][iter];
+			}
+			fout << ", " << recall[test_id];
+			fout << '\n';
+		}
+		fout.close();
+	} else {
+		std::cerr << "cannot open file: " << csv_filename << std::endl;
+	}
+}
 
-inline constexpr int num_threads = 32;
 int main(int argc, char** argv) {
 
 	// parse arguments because I'm cool
@@ -44,6 +80,128 @@ int main(int argc, char** argv) {
 	program.add_argument("res_path").help("path to directory to write result");
 	program.add_argument("index_path").help("path to hnsw index file");
 
+	program.add_argument("--runs")
+		.help("number of runs for a single vector")
+		.default_value(1000)
+		.scan<'i', int>();
+	program.add_argument("--num-single-queries")
+		.help("number of different vectors to try single queries on")
+		.default_value(5)
+		.scan<'i', int>();
+	program.add_argument("-k")
+		.help("the k to run the single queries and the workload on")
+		.default_value(100)
+		.scan<'i', int>();
+	program.add_argument("--ef")
+		.help("list of space separated search ef's")
+		.default_value(std::vector<int>{ 100, 150, 200, 250, 300 })
+		.scan<'i', int>()
+		.nargs(argparse::nargs_pattern::at_least_one);
+
+	program.add_argument("--isolate")
+		.help("pin the query thread, mlock and prefault the index and dataset")
+		.default_value(false)
+		.implicit_value(true);
+	program.add_argument("--core")
+		.help("cpu to pin the query thread to when isolated")
+		.default_value(0)
+		.scan<'i', int>();
+	program.add_argument("--realtime")
+		.help("run the query thread with SCHED_FIFO when isolated")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--cache-mode")
+		.help("what to do between runs: warm, evict (stream a buffer larger than the llc), "
+			  "pageout (evict and reclaim the index pages) or interleave (unrelated queries)")
+		.default_value(std::string("warm"));
+	program.add_argument("--interleave")
+		.help("number of unrelated queries to run between runs in interleave mode")
+		.default_value(10)
+		.scan<'i', int>();
+	program.add_argument("--drop-page-cache")
+		.help("drop the index file from the page cache before loading it")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--with-workload")
+		.help("also run the workload benchmark (different queries drawn from --workload)")
+		.default_value(false)
+		.implicit_value(true);
+	add_workload_arguments(program);
+
+	program.add_argument("--quality-k")
+		.help("list of space separated k's to report quality metrics over the whole query set for")
+		.default_value(std::vector<int>{ 1, 10, 100 })
+		.scan<'i', int>()
+		.nargs(argparse::nargs_pattern::at_least_one);
+	program.add_argument("--gt-distances")
+		.help("fvecs with the ground truth distances, enables distance ratio and tie-aware recall")
+		.default_value(std::string(""));
+
+	program.add_argument("--generic-distance")
+		.help("search with the generic distance kernel instead of the one specialized for the dim")
+		.default_value(false)
+		.implicit_value(true);
+	program.add_argument("--distance-samples")
+		.help("samples of the distance kernel timing (specialized against generic), 0 to skip it")
+		.default_value(1000)
+		.scan<'i', int>();
+
+	program.add_argument("--search-mode")
+		.help("hnswlib (HierarchicalNSW::searchKnn), standard (the same loop in lib/search.hpp), "
+			  "early_abandon (stop a distance once it exceeds the ef-th best), batched (all "
+			  "fresh neighbors of a node in one kernel call) or prefilter (skip neighbors by the "
+			  "hamming distance of their binary codes)")
+		.default_value(std::string("hnswlib"));
+	program.add_argument("--reorder-dims")
+		.help("reorder the dims of the index by decreasing variance, estimated on this many "
+			  "vectors (0 = keep the order)")
+		.default_value(0)
+		.scan<'i', int>();
+
+	program.add_argument("--prefilter-multiplier")
+		.help("list of space separated hamming multipliers of the prefilter mode, neighbors "
+			  "farther than multiplier x the worst result's code are skipped. The first one is "
+			  "used by the tests, all of them are compared against the standard loop at the end")
+		.default_value(std::vector<double>{ 1.0, 1.1, 1.2, 1.3 })
+		.scan<'g', double>()
+		.nargs(argparse::nargs_pattern::at_least_one);
+
+	program.add_argument("--compact-layout")
+		.help("also copy the index into the compact layout (lib/compact.hpp: level 0 links, "
+			  "vectors and labels in separate arrays) and compare it against the hnswlib layout")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--compact-file")
+		.help("also load the compact copy build_hnsw --compact-links saved next to the index "
+			  "(<index>.compact) and compare it in the layout test")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--arena")
+		.help("load the upper level link lists into one arena (lib/arena.hpp) instead of one "
+			  "malloc per element")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--upper-replica")
+		.help("run the greedy descent on a compact replica of the upper levels (lib/upper.hpp): "
+			  "none, fp32 or sq8 (vectors as 8 bit codes). Not in hnswlib mode")
+		.default_value(std::string("none"));
+
+	program.add_argument("--no-rerank")
+		.help("return the results of a compressed (sq8, pq) or projected (pca) index as traversed, "
+			  "without the exact rerank of the ef candidates")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--summary-only")
+		.help("only write summaries to the json lines results, not every latency sample")
+		.default_value(false)
+		.implicit_value(true);
+
 	try {
 		program.parse_args(argc, argv);
 	} catch(const std::exception& err) {
@@ -55,6 +213,36 @@ int main(int argc, char** argv) {
 	const fs::path gist_dir{ program.get<std::string>("gist_dir") };
 	const fs::path res_path{ program.get<std::string>("res_path") };
 	const fs::path index_path{ program.get<std::string>("index_path") };
+	const size_t RUNS_FOR_SINGLE_QUERY = program.get<int>("--runs");
+	const size_t NUM_SINGLE_QUERIES = program.get<int>("--num-single-queries");
+	const size_t SINGLE_QUERY_K = program.get<int>("-k");
+	const std::vector<int> EF = program.get<std::vector<int>>("--ef");
+	const bool isolate = program.get<bool>("--isolate");
+	const int core = program.get<int>("--core");
+	const bool realtime = program.get<bool>("--realtime");
+	const CacheMode cache_mode = parse_cache_mode(program.get<std::string>("--cache-mode"));
+	const size_t interleave = program.get<int>("--interleave");
+	const bool drop_page_cache = program.get<bool>("--drop-page-cache");
+	const bool with_workload = program.get<bool>("--with-workload");
+	const WorkloadConfig workload_config = workload_config_from(program);
+	const std::vector<int> quality_k = program.get<std::vector<int>>("--quality-k");
+	const std::string gt_distances_path = program.get<std::string>("--gt-distances");
+	const bool summary_only = program.get<bool>("--summary-only");
+	const bool generic_distance = program.get<bool>("--generic-distance");
+	const size_t distance_samples = program.get<int>("--distance-samples");
+	const SearchMode search_mode = parse_search_mode(program.get<std::string>("--search-mode"));
+	const size_t reorder_dims = program.get<int>("--reorder-dims");
+	const bool no_rerank = program.get<bool>("--no-rerank");
+	const bool compact_layout = program.get<bool>("--compact-layout");
+	const bool compact_file = program.get<bool>("--compact-file");
+	const bool arena = program.get<bool>("--arena");
+	const std::string upper_replica_kind = program.get<std::string>("--upper-replica");
+	if(upper_replica_kind != "none" && upper_replica_kind != "fp32" &&
+	   upper_replica_kind != "sq8") {
+		throw std::runtime_error(std::format("unknown upper replica '{}'", upper_replica_kind));
+	}
+	const std::vector<double> prefilter_multipliers =
+		program.get<std::vector<double>>("--prefilter-multiplier");
 
 	const fs::path gist_query = gist_dir / "gist_query.fvecs";
 	const fs::path gist_groundtruth = gist_dir / "gist_groundtruth.ivecs";
@@ -63,6 +251,16 @@ int main(int argc, char** argv) {
 	std::cout << std::format("\tNUM_QUERIES = {}", NUM_SINGLE_QUERIES) << std::endl;
 	std::cout << std::format("\tITERS_PER_QUERY = {}", RUNS_FOR_SINGLE_QUERY) << std::endl;
 	std::cout << std::format("\tTOP_K= {}", SINGLE_QUERY_K) << std::endl;
+	std::cout << std::format("\tEF = {}", EF) << std::endl;
+	std::cout << std::format("\tISOLATE = {} (core {}, realtime {})", isolate, core, realtime)
+			  << std::endl;
+	std::cout << std::format("\tCACHE_MODE = {}", program.get<std::string>("--cache-mode"))
+			  << std::endl;
+
+	// pin before loading so first touch places the data on the local numa node
+	if(isolate) {
+		pin_current_thread(core);
+	}
 
 	const auto GIST_Q = load_gist_960<float>(gist_query);
 	std::cout << std::format("gist query with NB = {} and DIM = {}", GIST_Q.nb, GIST_Q.dim)
@@ -72,29 +270,380 @@ int main(int argc, char** argv) {
 	std::cout << std::format("gist gt with NB = {} and DIM = {}", GIST_GT.nb, GIST_GT.dim)
 			  << std::endl;
 
-	assert(NUM_SINGLE_QUERIES <= GIST_Q.nb);
+	std::unique_ptr<const Embedding<float>> GIST_GT_D;
+	if(!gt_distances_path.empty()) {
+		GIST_GT_D.reset(new Embedding<float>(load_gist_960<float>(gt_distances_path)));
+	}
+	const RecallEvaluator evaluator(GIST_GT, GIST_GT_D.get());
+
+	// a compressed (or projected) index has its quantizer next to it and reranks with the base
+	// vectors
+	std::optional<Sq8Quantizer> sq8_quantizer;
+	std::optional<PqQuantizer> pq_quantizer;
+	std::optional<PcaProjection> pca_projection;
+	const QueryCoder* coder = nullptr;
+	if(fs::exists(sq8_quantizer_path(index_path))) {
+		coder = &sq8_quantizer.emplace(Sq8Quantizer::load(sq8_quantizer_path(index_path)));
+	} else if(fs::exists(pq_quantizer_path(index_path))) {
+		coder = &pq_quantizer.emplace(PqQuantizer::load(pq_quantizer_path(index_path)));
+	} else if(fs::exists(pca_projection_path(index_path))) {
+		coder = &pca_projection.emplace(PcaProjection::load(pca_projection_path(index_path)));
+	}
+	const bool rerank = coder != nullptr && !no_rerank;
+
+	// the base set, for perturbed workload queries and the rerank of a compressed index
+	std::unique_ptr<const Embedding<float>> GIST_B;
+	if(rerank || (with_workload && workload_config.num_perturbed > 0)) {
+		GIST_B.reset(new Embedding<float>(load_gist_960<float>(gist_dir / "gist_base.fvecs")));
+	}
 
+	std::unique_ptr<Workload> workload;
+	if(with_workload) {
+		workload = generate_workload(
+			GIST_Q, workload_config.num_perturbed > 0 ? GIST_B.get() : nullptr, workload_config);
+		std::cout << std::format("workload {} with {} queries over a pool of {}",
+								 program.get<std::string>("--workload"),
+								 workload->sequence.size(),
+								 workload->pool.nb)
+				  << std::endl;
+	}
+	// Tests 0 and 1 search the first NUM_SINGLE_QUERIES queries
+	if(NUM_SINGLE_QUERIES > static_cast<size_t>(GIST_Q.nb)) {
+		throw std::runtime_error(
+			std::format("--num-single-queries {} is more than the {} queries of the query set",
+						NUM_SINGLE_QUERIES,
+						GIST_Q.nb));
+	}
+	// interleave searches the queries after the first NUM_SINGLE_QUERIES between the timed ones
+	if(cache_mode == CacheMode::interleave &&
+	   NUM_SINGLE_QUERIES >= static_cast<size_t>(GIST_Q.nb)) {
+		throw std::runtime_error(
+			std::format("--cache-mode interleave needs fewer than the {} queries of the query set, "
+						"got --num-single-queries {}",
+						GIST_Q.nb,
+						NUM_SINGLE_QUERIES));
+	}
+
+	if(drop_page_cache) {
+		drop_file_cache(index_path);
+	}
 	std::cout << std::format("loading from file: {}", index_path.string()) << std::endl;
-	hnswlib::L2Space space(960);
-	hnswlib::HierarchicalNSW<float> alg_hnsw = hnswlib::HierarchicalNSW<float>(&space, index_path);
+	DispatchedL2Space space(960, !generic_distance);
+	std::unique_ptr<hnswlib::SpaceInterface<float>> compressed_space;
+	std::string kernel_name = space.kernel_name();
+	// a half precision index is searched with float queries, its distance converts the vectors
+	const std::optional<HalfFormat> half_format = half_format_of(index_path);
+	if(half_format) {
+		if(search_mode == SearchMode::early_abandon || search_mode == SearchMode::batched ||
+		   reorder_dims > 0) {
+			throw std::runtime_error(
+				"a half precision index is only searched in hnswlib or standard mode, unreordered");
+		}
+		auto half_space = std::make_unique<HalfSpace>(960, *half_format, true);
+		kernel_name = half_space->kernel_name();
+		compressed_space = std::move(half_space);
+	} else if(sq8_quantizer) {
+		auto sq8_space = std::make_unique<Sq8Space>(*sq8_quantizer);
+		kernel_name = sq8_space->kernel_name();
+		compressed_space = std::move(sq8_space);
+	} else if(pq_quantizer) {
+		auto pq_space = std::make_unique<PqSpace>(*pq_quantizer);
+		kernel_name = std::format("{}{}_{}",
+								  pq_quantizer->rotated() ? "o" : "",
+								  pq_space->kernel_name(),
+								  pq_quantizer->m());
+		compressed_space = std::move(pq_space);
+	} else if(pca_projection) {
+		// an ordinary l2 index at the projected dim
+		auto pca_space = std::make_unique<DispatchedL2Space>(pca_projection->out_dim(),
+															   !generic_distance);
+		kernel_name = std::format("pca{}_{}", pca_projection->out_dim(), pca_space->kernel_name());
+		compressed_space = std::move(pca_space);
+	}
+	std::cout << std::format("distance kernels: {} (cpu: {})", kernel_name, cpu_simd_features())
+			  << std::endl;
+	hnswlib::SpaceInterface<float>* index_space =
+		compressed_space ? compressed_space.get() : &space;
+	const auto load_start = chrono::high_resolution_clock::now();
+	std::unique_ptr<hnswlib::HierarchicalNSW<float>> loaded_index;
+	if(arena) {
+		loaded_index = std::make_unique<ArenaHnsw>(index_space, index_path);
+	} else {
+		loaded_index = std::make_unique<hnswlib::HierarchicalNSW<float>>(index_space, index_path);
+	}
+	const auto load_end = chrono::high_resolution_clock::now();
+	hnswlib::HierarchicalNSW<float>& alg_hnsw = *loaded_index;
+	const double load_ms =
+		chrono::duration_cast<chrono::microseconds>(load_end - load_start).count() / 1000.0;
+	std::cout << std::format("loaded in {:.1f} ms, upper level link lists {}",
+							 load_ms,
+							 arena ? "in one arena" : "malloced per element")
+			  << std::endl;
+	HnswSearcher searcher(alg_hnsw, search_mode);
+	std::cout << std::format("search mode: {}", program.get<std::string>("--search-mode"))
+			  << std::endl;
+	if(reorder_dims > 0) {
+		const auto start = chrono::high_resolution_clock::now();
+		searcher.reorder_dimensions(reorder_dims);
+		const auto end = chrono::high_resolution_clock::now();
+		std::cout << std::format("reordered dims by variance of {} vectors in {} ms",
+								 reorder_dims,
+								 chrono::duration_cast<chrono::milliseconds>(end - start).count())
+				  << std::endl;
+	}
+	if(coder != nullptr) {
+		searcher.use_query_coder(*coder, rerank ? GIST_B->data.get() : nullptr);
+		std::cout << std::format("compressed index, ef candidates {}",
+								 rerank ? "reranked with " + space.kernel_name() : "not reranked")
+				  << std::endl;
+	}
+
+	std::unique_ptr<const BinaryCodes> binary_codes;
+	if(search_mode == SearchMode::prefilter) {
+		if(coder != nullptr || half_format || reorder_dims > 0) {
+			throw std::runtime_error("the prefilter needs a float index with its dims in order");
+		}
+		const auto start = chrono::high_resolution_clock::now();
+		binary_codes = std::make_unique<const BinaryCodes>(alg_hnsw, 960);
+		const auto end = chrono::high_resolution_clock::now();
+		searcher.use_prefilter(*binary_codes, prefilter_multipliers.front());
+		std::cout << std::format("binary codes of {} bytes in {} ms, hamming multiplier {}",
+								 binary_codes->words() * sizeof(uint64_t),
+								 chrono::duration_cast<chrono::milliseconds>(end - start).count(),
+								 prefilter_multipliers.front())
+				  << std::endl;
+	}
+
+	std::unique_ptr<const UpperReplica> upper_replica;
+	if(upper_replica_kind != "none") {
+		if(search_mode == SearchMode::hnswlib || coder != nullptr || half_format) {
+			throw std::runtime_error("the upper replica needs a float index searched in a mode "
+									 "other than hnswlib");
+		}
+		const auto start = chrono::high_resolution_clock::now();
+		upper_replica =
+			std::make_unique<const UpperReplica>(alg_hnsw, 960, upper_replica_kind == "sq8");
+		const auto end = chrono::high_resolution_clock::now();
+		searcher.use_upper_replica(*upper_replica);
+		std::cout << std::format("upper replica of {} elements in {} ms: {} KiB vectors, {} KiB "
+								 "links ({})",
+								 upper_replica->size(),
+								 chrono::duration_cast<chrono::milliseconds>(end - start).count(),
+								 upper_replica->vector_bytes() >> 10,
+								 upper_replica->link_bytes() >> 10,
+								 upper_replica->kernel_name())
+				  << std::endl;
+	}
+
+	const HnswMemory memory = hnsw_memory(alg_hnsw);
+	const size_t rerank_bytes = rerank ? sizeof(float) * GIST_B->nb * GIST_B->dim : 0;
+	const size_t prefilter_bytes = binary_codes ? binary_codes->memory_bytes() : 0;
+	std::cout << std::format("index memory: level 0 {} MiB ({} MiB vectors), upper levels {} MiB, "
+							 "rerank vectors {} MiB, prefilter codes {} MiB",
+							 memory.level0 >> 20,
+							 memory.vectors >> 20,
+							 memory.upper >> 20,
+							 rerank_bytes >> 20,
+							 prefilter_bytes >> 20)
+			  << std::endl;
+
+	EnvironmentInfo env = capture_environment(isolate ? core : sched_getcpu());
+	env.pinned = isolate;
+	if(isolate) {
+		try {
+			lock_all_memory();
+			env.mlocked = true;
+		} catch(const std::exception& err) {
+			std::cerr << "warning: " << err.what() << std::endl;
+		}
+
+		size_t checksum = prefault(GIST_Q.data.get(), sizeof(float) * GIST_Q.nb * GIST_Q.dim);
+		checksum += prefault(GIST_GT.data.get(), sizeof(int) * GIST_GT.nb * GIST_GT.dim);
+		checksum += prefault_hnsw(alg_hnsw);
+		if(rerank) {
+			checksum += prefault(GIST_B->data.get(), rerank_bytes);
+		}
+		std::cout << std::format("prefaulted index and dataset (checksum {})", checksum)
+				  << std::endl;
+
+		if(realtime) {
+			try {
+				raise_priority();
+				env.realtime = true;
+			} catch(const std::exception& err) {
+				std::cerr << "warning: " << err.what() << std::endl;
+			}
+		}
+	}
+	std::cout << std::format("cpu: {} @ {} MHz, governor: {}, thp: {}, smt: {}",
+							 env.cpu_model,
+							 env.cur_mhz,
+							 env.governor,
+							 env.transparent_hugepages,
+							 env.smt)
+			  << std::endl;
+
+	if(cache_mode == CacheMode::pageout && env.mlocked) {
+		std::cerr << "warning: mlocked pages cannot be paged out, pageout degrades to evict"
+				  << std::endl;
+	}
+
+	const fs::path results_filename =
+		res_path / fs::path(std::format("bench_st_sq_{}.jsonl", index_path.filename().string()));
+	std::cout << "writing results to: " << results_filename.string() << std::endl;
+	ResultWriter result_store(results_filename, env, !summary_only);
+	const std::map<std::string, std::string> base_params{
+		{ "bench", "bench_st_sq" },
+		{ "index", index_path.filename().string() },
+		{ "k", std::to_string(SINGLE_QUERY_K) },
+		{ "distance", kernel_name },
+		{ "search_mode", program.get<std::string>("--search-mode") },
+		{ "reorder_dims", std::to_string(reorder_dims) },
+		{ "rerank", rerank ? "exact" : "none" },
+		{ "upper_links", arena ? "arena" : "malloc" },
+		{ "upper_replica", upper_replica_kind },
+		{ "pca_dim", pca_projection ? std::to_string(pca_projection->out_dim()) : "none" },
+		{ "prefilter_multiplier",
+		  binary_codes ? std::format("{}", prefilter_multipliers.front()) : "none" },
+	};
+
+	{
+		auto params = base_params;
+		params["test"] = "memory";
+		result_store.write(params,
+						   {},
+						   { { "level0_bytes", static_cast<double>(memory.level0) },
+							 { "vector_bytes", static_cast<double>(memory.vectors) },
+							 { "upper_bytes", static_cast<double>(memory.upper) },
+							 { "bookkeeping_bytes", static_cast<double>(memory.bookkeeping) },
+							 { "rerank_bytes", static_cast<double>(rerank_bytes) },
+							 { "prefilter_bytes", static_cast<double>(prefilter_bytes) },
+							 { "upper_replica_bytes",
+							   upper_replica ? static_cast<double>(upper_replica->memory_bytes())
+											 : 0.0 },
+							 { "load_ms", load_ms } });
+	}
+
+	std::optional<CacheEvictor> evictor;
+	if(cache_mode == CacheMode::evict || cache_mode == CacheMode::pageout) {
+		evictor.emplace();
+		std::cout << std::format("cache evictor buffer: {} MiB", evictor->size() >> 20)
+				  << std::endl;
+	}
+
+	// bring the index out of the caches before a cold run
+	size_t interleave_cursor = 0;
+	volatile size_t sink = 0;
+	auto perturb_caches = [&]() {
+		switch(cache_mode) {
+		case CacheMode::warm:
+			break;
+		case CacheMode::pageout:
+			if(!env.mlocked) {
+				pageout_hnsw(alg_hnsw);
+			}
+			[[fallthrough]];
+		case CacheMode::evict:
+			sink = sink + evictor->evict();
+			break;
+		case CacheMode::interleave:
+			// unrelated queries are the ones after the ones being measured
+			for(size_t i = 0; i < interleave; i++) {
+				const size_t other =
+					NUM_SINGLE_QUERIES + interleave_cursor++ % (GIST_Q.nb - NUM_SINGLE_QUERIES);
+				const float* query = GIST_Q.data.get() + GIST_Q.dim * other;
+				sink = sink + searcher.search(query, SINGLE_QUERY_K).size();
+			}
+			break;
+		}
+	};
+
+	// Test 0: time of one distance at the index dim, the kernel specialized for the dim against
+	// the generic one (and the one of a half precision index). The vectors are the first ones of
+	// the index (of the base set for a quantized index, skipped without it) and stay in l2, so
+	// this is the arithmetic and not the memory a search waits on.
+	if(distance_samples > 0 && (coder == nullptr || GIST_B)) {
+		const size_t num_vectors = std::min<size_t>(256, alg_hnsw.cur_element_count);
+		const auto float_vector = [&](size_t i) -> const void* {
+			if(coder != nullptr) {
+				return GIST_B->data.get() + GIST_B->dim * alg_hnsw.getExternalLabel(i);
+			}
+			return alg_hnsw.getDataByInternalId(i);
+		};
+		DispatchedL2Space generic_space(960, false);
+		DispatchedL2Space specialized_space(960, true);
+		std::vector<std::pair<std::string, hnswlib::SpaceInterface<float>*>> spaces;
+		if(half_format) {
+			spaces.emplace_back(kernel_name, compressed_space.get());
+		} else {
+			spaces.emplace_back(generic_space.kernel_name(), &generic_space);
+			spaces.emplace_back(specialized_space.kernel_name(), &specialized_space);
+		}
+		for(const auto& [name, s] : spaces) {
+			const hnswlib::DISTFUNC<float> dist = s->get_dist_func();
+			const void* dist_param = s->get_dist_func_param();
+			std::vector<double> samples(distance_samples);
+			float sum = 0.0f;
+			for(size_t sample = 0; sample < distance_samples; sample++) {
+				const float* query = GIST_Q.data.get() + GIST_Q.dim * (sample % GIST_Q.nb);
+				auto start = chrono::high_resolution_clock::now();
+				for(size_t i = 0; i < num_vectors; i++) {
+					sum += dist(query, float_vector(i), dist_param);
+				}
+				auto end = chrono::high_resolution_clock::now();
+				samples[sample] = chrono::duration<double, std::nano>(end - start).count() /
+								  num_vectors;
+			}
+			sink = sink + static_cast<size_t>(sum);
+
+			const Summary summary = summarize(samples);
+			std::cout << std::format("distance {}: p50 {:.1f}ns mean {:.1f}ns",
+									 name,
+									 summary.p50,
+									 summary.mean)
+					  << std::endl;
+			auto params = base_params;
+			params["test"] = "distance";
+			params["distance"] = name;
+			params["unit"] = "ns";
+			result_store.write(params, samples);
+		}
+	}
 
 	// Test 1: performance querying a single query multiple times
 
 	// rows correspond to query id and columns correspond to the latency for that run
+	// in every mode but warm each run is a cold run right after perturbing the caches followed by
+	// a warm run of the same query, so both distributions come from the same state of the index
 	for(int ef : EF) {
-		uint64_t single_query_latency[NUM_SINGLE_QUERIES][RUNS_FOR_SINGLE_QUERY];
-		double single_query_recall[NUM_SINGLE_QUERIES];
+		alg_hnsw.setEf(ef);
+		std::vector<std::vector<uint64_t>> single_query_latency(
+			NUM_SINGLE_QUERIES, std::vector<uint64_t>(RUNS_FOR_SINGLE_QUERY));
+		std::vector<std::vector<uint64_t>> cold_query_latency(
+			NUM_SINGLE_QUERIES, std::vector<uint64_t>(RUNS_FOR_SINGLE_QUERY));
+		std::vector<double> single_query_recall(NUM_SINGLE_QUERIES);
 
 		for(size_t test_id = 0; test_id < NUM_SINGLE_QUERIES; test_id++) {
 			std::cout << std::format("run id: {} ef: {}", test_id, ef) << std::endl;
 			std::priority_queue<std::pair<float, hnswlib::labeltype>> output;
+			SearchStats stats;
 
 			// std::cout << "Q: " << GIST_Q.dim << " " << GIST_Q.nb << std::endl;
 			const float* vector_addr =
 				static_cast<float*>(GIST_Q.data.get() + GIST_Q.dim * test_id);
 			for(size_t run_id = 0; run_id < RUNS_FOR_SINGLE_QUERY; run_id++) {
+				if(cache_mode != CacheMode::warm) {
+					perturb_caches();
+					auto start = chrono::high_resolution_clock::now();
+					auto o = searcher.search(vector_addr, SINGLE_QUERY_K);
+					auto end = chrono::high_resolution_clock::now();
+					cold_query_latency[test_id][run_id] =
+						chrono::duration_cast<chrono::microseconds>(end - start).count();
+					sink = sink + o.size();
+				}
+
 				auto start = chrono::high_resolution_clock::now();
-				auto o = alg_hnsw.searchKnn(vector_addr, SINGLE_QUERY_K);
+				auto o = searcher.search(vector_addr, SINGLE_QUERY_K, &stats);
 				auto end = chrono::high_resolution_clock::now();
 				auto duration_elapsed = chrono::duration_cast<chrono::microseconds>(end - start);
 				uint64_t duration_elapsed_us = duration_elapsed.count();
@@ -102,38 +651,343 @@ int main(int argc, char** argv) {
 				output = std::move(o);
 			}
 
-			single_query_recall[test_id] = calculate_recall(test_id, GIST_GT, output);
+			single_query_recall[test_id] =
+				calculate_recall(test_id, GIST_GT, output, SINGLE_QUERY_K);
 			std::cout << "\trecall: " << (single_query_recall[test_id] * 100) << "%" << std::endl;
+
+			auto params = base_params;
+			params["test"] = "same_vector";
+			params["ef"] = std::to_string(ef);
+			params["query"] = std::to_string(test_id);
+			params["cache_mode"] = "warm";
+			const std::vector<double> warm_samples(single_query_latency[test_id].begin(),
+												   single_query_latency[test_id].end());
+			std::map<std::string, double> metrics = stats.metrics(GIST_Q.dim);
+			metrics["recall"] = single_query_recall[test_id];
+			result_store.write(params, warm_samples, metrics);
+			if(cache_mode != CacheMode::warm) {
+				params["test"] = "cold_vector";
+				params["cache_mode"] = program.get<std::string>("--cache-mode");
+				const std::vector<double> cold_samples(cold_query_latency[test_id].begin(),
+													   cold_query_latency[test_id].end());
+				result_store.write(
+					params, cold_samples, { { "recall", single_query_recall[test_id] } });
+			}
+
+			const auto& warm = single_query_latency[test_id];
+			const double warm_mean =
+				std::accumulate(warm.begin(), warm.end(), 0.0) / RUNS_FOR_SINGLE_QUERY;
+			if(cache_mode != CacheMode::warm) {
+				const auto& cold = cold_query_latency[test_id];
+				const double cold_mean =
+					std::accumulate(cold.begin(), cold.end(), 0.0) / RUNS_FOR_SINGLE_QUERY;
+				std::cout << std::format("\tmean cold: {:.1f}us warm: {:.1f}us", cold_mean, warm_mean)
+						  << std::endl;
+			} else {
+				std::cout << std::format("\tmean warm: {:.1f}us", warm_mean) << std::endl;
+			}
 		}
 
-		fs::path csv_filename =
+		write_latency_csv(
 			res_path / fs::path(std::format(
 						   "1-ST-CPU_dim_960_nb_1000000_{}_searchef_{}_same_vector_latencies.csv",
 						   index_path.filename().string(),
-						   ef));
+						   ef)),
+			env,
+			single_query_latency,
+			single_query_recall);
+
+		if(cache_mode != CacheMode::warm) {
+			write_latency_csv(
+				res_path /
+					fs::path(std::format(
+						"1-ST-CPU_dim_960_nb_1000000_{}_searchef_{}_{}_cold_vector_latencies.csv",
+						index_path.filename().string(),
+						ef,
+						program.get<std::string>("--cache-mode"))),
+				env,
+				cold_query_latency,
+				single_query_recall);
+		}
+	}
 
-		std::cout << "writing to file: " << csv_filename.string() << std::endl;
-		std::ofstream fout(csv_filename);
-		if(fout.is_open()) {
-			fout << "id";
-			for(int iter = 0; iter < RUNS_FOR_SINGLE_QUERY; iter++)
-				fout << ", iter" << (iter + 1) << " (us)";
+	// Test 2: performance querying different queries drawn from a workload
+	if(workload) {
+		for(int ef : EF) {
+			alg_hnsw.setEf(ef);
+			std::cout << std::format("workload ef: {}", ef) << std::endl;
+			const size_t n = workload->sequence.size();
+			std::vector<uint64_t> latency(n);
+			std::vector<double> recall(n, -1.0);
+			SearchStats stats;
 
-			fout << ", recall";
-			fout << '\n';
-			for(size_t test_id = 0; test_id < NUM_SINGLE_QUERIES; test_id++) {
-				fout << test_id;
+			for(size_t seq = 0; seq < n; seq++) {
+				const size_t pool_id = workload->sequence[seq];
+				auto start = chrono::high_resolution_clock::now();
+				auto output = searcher.search(workload->query(pool_id), SINGLE_QUERY_K, &stats);
+				auto end = chrono::high_resolution_clock::now();
+				latency[seq] = chrono::duration_cast<chrono::microseconds>(end - start).count();
 
-				for(int iter = 0; iter < RUNS_FOR_SINGLE_QUERY; iter++) {
-					fout << ", " << single_query_latency[test_id][iter];
+				// only queries from the query set have ground truth
+				if(pool_id < workload->num_original) {
+					recall[seq] = calculate_recall(pool_id, GIST_GT, output, SINGLE_QUERY_K);
 				}
-				fout << ", " << single_query_recall[test_id];
-				fout << '\n';
 			}
-			fout.close();
-		} else {
-			std::cerr << "cannot open file: " << csv_filename << std::endl;
+			double recall_sum = 0.0;
+			size_t recall_count = 0;
+			for(const double r : recall) {
+				if(r >= 0.0) {
+					recall_sum += r;
+					recall_count++;
+				}
+			}
+			auto params = base_params;
+			params["test"] = "workload";
+			params["ef"] = std::to_string(ef);
+			params["workload"] = program.get<std::string>("--workload");
+			std::map<std::string, double> metrics = stats.metrics(workload->pool.dim);
+			if(recall_count > 0) {
+				metrics["recall"] = recall_sum / recall_count;
+			}
+			result_store.write(
+				params, std::vector<double>(latency.begin(), latency.end()), metrics);
+
+			write_workload_csv(
+				res_path / fs::path(std::format(
+							   "2-ST-CPU_dim_960_nb_1000000_{}_searchef_{}_{}_workload_latencies.csv",
+							   index_path.filename().string(),
+							   ef,
+							   program.get<std::string>("--workload"))),
+				env,
+				*workload,
+				latency,
+				recall);
+		}
+	}
+
+	// Test 3: quality over the whole query set for several k's
+	fs::path quality_filename = res_path / fs::path(std::format(
+											   "3-ST-CPU_dim_960_nb_1000000_{}_quality.csv",
+											   index_path.filename().string()));
+	std::cout << "writing to file: " << quality_filename.string() << std::endl;
+	std::ofstream quality_out(quality_filename);
+	write_environment(quality_out, env);
+	quality_out << "ef, k, recall, 1-recall@1, distance ratio, map, tie-aware recall\n";
+	for(int ef : EF) {
+		alg_hnsw.setEf(ef);
+		for(const int k : quality_k) {
+			std::vector<SearchResult> results(GIST_Q.nb);
+
+			// latency is not measured here, so use every core
+#pragma omp parallel for schedule(dynamic)
+			for(int q = 0; q < GIST_Q.nb; q++) {
+				results[q] = to_sorted_result(
+					searcher.search(GIST_Q.data.get() + static_cast<size_t>(GIST_Q.dim) * q, k));
+			}
+
+			const QualityMetrics m = evaluator.evaluate(results, k);
+			std::cout << std::format("ef: {} k: {} recall: {:.2f}% 1-recall@1: {:.2f}% "
+									 "ratio: {:.4f} map: {:.4f} tie-aware: {:.2f}%",
+									 ef,
+									 k,
+									 m.recall * 100,
+									 m.recall_1_at_1 * 100,
+									 m.distance_ratio,
+									 m.map,
+									 m.tie_aware_recall * 100)
+					  << std::endl;
+			auto params = base_params;
+			params["test"] = "quality";
+			params["ef"] = std::to_string(ef);
+			params["k"] = std::to_string(k);
+			result_store.write(params,
+						  {},
+						  { { "recall", m.recall },
+							{ "recall_1_at_1", m.recall_1_at_1 },
+							{ "distance_ratio", m.distance_ratio },
+							{ "map", m.map },
+							{ "tie_aware_recall", m.tie_aware_recall } });
+
+			quality_out << std::format("{}, {}, {}, {}, {}, {}, {}\n",
+									   ef,
+									   k,
+									   m.recall,
+									   m.recall_1_at_1,
+									   m.distance_ratio,
+									   m.map,
+									   m.tie_aware_recall);
+		}
+	}
+	// Test 4: the prefilter against the standard loop on the same graph, every query of the set
+	// single threaded at every ef and multiplier: distances avoided, recall lost, latency gained
+	if(binary_codes) {
+		HnswSearcher standard(alg_hnsw, SearchMode::standard);
+		HnswSearcher prefilter(alg_hnsw, SearchMode::prefilter);
+		struct Pass {
+			std::vector<double> latency;
+			double recall = 0.0;
+			SearchStats stats;
+		};
+		const auto run_pass = [&](const HnswSearcher& s) {
+			Pass pass;
+			pass.latency.resize(GIST_Q.nb);
+			for(int q = 0; q < GIST_Q.nb; q++) {
+				const float* query = GIST_Q.data.get() + static_cast<size_t>(GIST_Q.dim) * q;
+				auto start = chrono::high_resolution_clock::now();
+				auto output = s.search(query, SINGLE_QUERY_K, &pass.stats);
+				auto end = chrono::high_resolution_clock::now();
+				pass.latency[q] = chrono::duration<double, std::micro>(end - start).count();
+				pass.recall += calculate_recall(q, GIST_GT, output, SINGLE_QUERY_K) / GIST_Q.nb;
+			}
+			return pass;
+		};
+		const auto mean = [](const std::vector<double>& v) {
+			return std::accumulate(v.begin(), v.end(), 0.0) / v.size();
+		};
+
+		for(int ef : EF) {
+			alg_hnsw.setEf(ef);
+			const Pass base = run_pass(standard);
+			const double base_distances =
+				static_cast<double>(base.stats.distances) / base.stats.queries;
+			for(const double multiplier : prefilter_multipliers) {
+				prefilter.use_prefilter(*binary_codes, static_cast<float>(multiplier));
+				const Pass pass = run_pass(prefilter);
+				const double distances =
+					static_cast<double>(pass.stats.distances) / pass.stats.queries;
+				const double avoided = 1.0 - distances / base_distances;
+				const double speedup = mean(base.latency) / mean(pass.latency);
+				std::cout << std::format("prefilter ef: {} x{}: distances {:.0f} -> {:.0f} "
+										 "({:.1f}% avoided), recall {:.4f} -> {:.4f}, "
+										 "mean {:.1f}us -> {:.1f}us (x{:.2f})",
+										 ef,
+										 multiplier,
+										 base_distances,
+										 distances,
+										 avoided * 100,
+										 base.recall,
+										 pass.recall,
+										 mean(base.latency),
+										 mean(pass.latency),
+										 speedup)
+						  << std::endl;
+
+				auto params = base_params;
+				params["test"] = "prefilter";
+				params["ef"] = std::to_string(ef);
+				params["search_mode"] = "prefilter";
+				params["prefilter_multiplier"] = std::format("{}", multiplier);
+				std::map<std::string, double> metrics = pass.stats.metrics(GIST_Q.dim);
+				metrics["recall"] = pass.recall;
+				metrics["recall_loss"] = base.recall - pass.recall;
+				metrics["distances_avoided_fraction"] = avoided;
+				metrics["speedup"] = speedup;
+				result_store.write(params, pass.latency, metrics);
+			}
+		}
+	}
+
+	// Test 5: the same graph in the hnswlib layout (standard loop over the interleaved level 0
+	// records) and in the compact one (the same loop over separate link, vector and label arrays),
+	// every query of the set single threaded at every ef. With --compact-file also the compact copy
+	// build_hnsw saved next to the index (reordered, links possibly compressed).
+	if(compact_layout || compact_file) {
+		if(coder != nullptr || reorder_dims > 0) {
+			throw std::runtime_error("the compact layout needs an uncompressed index, unreordered");
+		}
+		const auto start = chrono::high_resolution_clock::now();
+		const CompactIndex compact(alg_hnsw);
+		const auto end = chrono::high_resolution_clock::now();
+		std::cout << std::format("compact layout: level 0 {} MB (hnswlib {} MB) in {} ms",
+								 compact.level0_bytes() / 1000000,
+								 memory.level0 / 1000000,
+								 chrono::duration_cast<chrono::milliseconds>(end - start).count())
+				  << std::endl;
+		std::vector<std::pair<std::string, const CompactIndex*>> layouts{ { "compact", &compact } };
+
+		std::optional<CompactIndex> saved;
+		if(compact_file) {
+			saved.emplace(CompactIndex::load(compact_index_path(index_path), *index_space));
+			std::cout << std::format("compact file: {} links, {:.1f} link bytes per vector "
+									 "(compact {:.1f}, hnswlib {})",
+									 link_encoding_name(saved->encoding()),
+									 static_cast<double>(saved->link_bytes()) / saved->size(),
+									 static_cast<double>(compact.link_bytes()) / compact.size(),
+									 alg_hnsw.size_links_level0_)
+					  << std::endl;
+			layouts.emplace_back("compact_" + link_encoding_name(saved->encoding()), &*saved);
+		}
+
+		HnswSearcher standard(alg_hnsw, SearchMode::standard);
+		const auto run_pass = [&](const auto& search, std::vector<double>& latency) {
+			double recall = 0.0;
+			latency.resize(GIST_Q.nb);
+			for(int q = 0; q < GIST_Q.nb; q++) {
+				const float* query = GIST_Q.data.get() + static_cast<size_t>(GIST_Q.dim) * q;
+				auto start = chrono::high_resolution_clock::now();
+				auto output = search(query);
+				auto end = chrono::high_resolution_clock::now();
+				latency[q] = chrono::duration<double, std::micro>(end - start).count();
+				recall += calculate_recall(q, GIST_GT, output, SINGLE_QUERY_K) / GIST_Q.nb;
+			}
+			return recall;
+		};
+		const auto mean = [](const std::vector<double>& v) {
+			return std::accumulate(v.begin(), v.end(), 0.0) / v.size();
+		};
+		const auto write_layout = [&](int ef,
+									  const std::string& layout,
+									  const std::vector<double>& latency,
+									  std::map<std::string, double> metrics) {
+			auto params = base_params;
+			params["test"] = "layout";
+			params["ef"] = std::to_string(ef);
+			params["search_mode"] = "standard";
+			params["layout"] = layout;
+			result_store.write(params, latency, metrics);
+		};
+
+		for(int ef : EF) {
+			alg_hnsw.setEf(ef);
+			std::vector<double> hnswlib_latency;
+			const double hnswlib_recall = run_pass(
+				[&](const float* query) { return standard.search(query, SINGLE_QUERY_K); },
+				hnswlib_latency);
+			write_layout(ef,
+						 "hnswlib",
+						 hnswlib_latency,
+						 { { "recall", hnswlib_recall },
+						   { "level0_bytes", static_cast<double>(memory.level0) },
+						   { "link_bytes_per_vector",
+							 static_cast<double>(alg_hnsw.size_links_level0_) } });
+
+			for(const auto& [layout, index] : layouts) {
+				std::vector<double> latency;
+				const double recall = run_pass(
+					[&](const float* query) { return index->search(query, SINGLE_QUERY_K, ef); },
+					latency);
+				const double speedup = mean(hnswlib_latency) / mean(latency);
+				std::cout << std::format("layout ef: {}: {} mean {:.1f}us -> {:.1f}us (x{:.2f}), "
+										 "recall {:.4f} -> {:.4f}",
+										 ef,
+										 layout,
+										 mean(hnswlib_latency),
+										 mean(latency),
+										 speedup,
+										 hnswlib_recall,
+										 recall)
+						  << std::endl;
+				write_layout(ef,
+							 layout,
+							 latency,
+							 { { "recall", recall },
+							   { "level0_bytes", static_cast<double>(index->level0_bytes()) },
+							   { "link_bytes_per_vector",
+								 static_cast<double>(index->link_bytes()) / index->size() },
+							   { "speedup", speedup } });
+			}
 		}
 	}
+
 	return 0;
 }
\ No newline at end of file
@@ -1,48 +1,29 @@
 
 #include "lib/argparser.hpp"
+#include "lib/compact.hpp"
+#include "lib/distance.hpp"
 #include "lib/embeddings.hpp"
+#include "lib/half.hpp"
+#include "lib/pca.hpp"
+#include "lib/pq.hpp"
+#include "lib/sq8.hpp"
 #include "lib/utils.hpp"
 
 #include <cmath>
+#include <cstring>
 #include <execution>
 #include <filesystem>
 #include <format>
 #include <hnswlib/hnswlib.h>
+#include <memory>
 #include <numeric>
+#include <optional>
 
 namespace chrono = std::chrono;
 namespace fs = std::filesystem;
 
 constexpr int NUM_THREADS = 20;
 
-template <typename T>
-struct std::formatter<std::vector<T>> {
-	constexpr auto parse(std::format_parse_context& ctx) {
-		return ctx.begin();
-	}
-
-	auto format(const std::vector<T>& vec, std::format_context& ctx) const {
-		auto out = ctx.out();
-		*out++ = '{';
-		for(auto it = vec.begin(); it != vec.end(); ++it) {
-			if(it != vec.begin()) {
-				*out++ = ',';
-				*out++ = ' ';
-			}
-			out = std::format_to(out, "{}", *it);
-		}
-		*out++ = '}';
-		return out;
-	}
-};
-
-void fast_normalize(const float* src, float* dest, size_t dim) {
-	float norm = std::inner_product(src, src + dim, src, 0.0f);
-	norm = 1.0f / (std::sqrt(norm) + std::numeric_limits<float>::epsilon());
-
-	std::transform(std::execution::seq, src, src + dim, dest, [norm](float x) { return x * norm; });
-}
-
 void build_hnsw(hnswlib::HierarchicalNSW<float>& hnsw,
 				const Embedding<float>& embedding,
 				bool normalize) {
@@ -56,13 +37,128 @@ void build_hnsw(hnswlib::HierarchicalNSW<float>& hnsw,
 
 		if(normalize) {
 			fast_normalize(point, normalized_point[id], embedding.dim);
-			hnsw.addPoint(point, row);
+			hnsw.addPoint(normalized_point[id], row);
 		} else {
 			hnsw.addPoint(point, row);
 		}
 	});
 }
 
+/// @brief build on the sq8 codes of the embedding, the graph is the one searches traverse
+void build_hnsw_sq8(hnswlib::HierarchicalNSW<float>& hnsw,
+					const Embedding<float>& embedding,
+					const Sq8Quantizer& quantizer) {
+	const size_t dim = embedding.dim;
+	std::vector<uint8_t> codes(static_cast<size_t>(embedding.nb) * dim);
+	for(size_t row = 0; row < static_cast<size_t>(embedding.nb); row++) {
+		quantizer.encode(embedding.data.get() + row * dim, codes.data() + row * dim);
+	}
+
+	ParallelFor(0, embedding.nb, NUM_THREADS, [&](size_t row, size_t) {
+		hnsw.addPoint(codes.data() + row * dim, row);
+	});
+}
+
+/// @brief build on the vectors converted to `format` as they are inserted
+void build_hnsw_half(hnswlib::HierarchicalNSW<float>& hnsw,
+					 const Embedding<float>& embedding,
+					 HalfFormat format) {
+	const float* data = embedding.data.get();
+
+	uint16_t half_point[NUM_THREADS][960];
+
+	ParallelFor(0, embedding.nb, NUM_THREADS, [&](size_t row, size_t id) {
+		to_half(data + embedding.dim * row, embedding.dim, format, half_point[id]);
+		hnsw.addPoint(half_point[id], row);
+	});
+}
+
+/// @brief build on the vectors projected by `projection` as they are inserted
+void build_hnsw_pca(hnswlib::HierarchicalNSW<float>& hnsw,
+					const Embedding<float>& embedding,
+					const PcaProjection& projection) {
+	const float* data = embedding.data.get();
+
+	float projected_point[NUM_THREADS][960];
+
+	ParallelFor(0, embedding.nb, NUM_THREADS, [&](size_t row, size_t id) {
+		projection.project(data + embedding.dim * row, projected_point[id]);
+		hnsw.addPoint(projected_point[id], row);
+	});
+}
+
+/// @brief every `nb / n`th of the first `n * (nb / n)` vectors, to train a quantizer on
+std::vector<float> strided_sample(const Embedding<float>& embedding, size_t n) {
+	const size_t dim = embedding.dim;
+	const size_t stride = embedding.nb / std::max<size_t>(n, 1);
+	std::vector<float> sample(n * dim);
+	for(size_t i = 0; i < n; i++) {
+		std::copy_n(embedding.data.get() + i * stride * dim, dim, sample.data() + i * dim);
+	}
+	return sample;
+}
+
+/// @brief the graph of `graph` in a new index over `space` with every vector replaced by its pq
+/// code. hnswlib cannot insert into a pq index (see lib/pq.hpp), so the links, levels and labels
+/// are copied: with the same M the link lists have the same layout, only the data between the
+/// level 0 links and the label shrinks.
+std::unique_ptr<hnswlib::HierarchicalNSW<float>>
+with_pq_codes(const hnswlib::HierarchicalNSW<float>& graph,
+			  PqSpace& space,
+			  const PqQuantizer& quantizer) {
+	auto pq = std::make_unique<hnswlib::HierarchicalNSW<float>>(
+		&space, graph.max_elements_, graph.M_, graph.ef_construction_);
+	const size_t count = graph.cur_element_count;
+
+	ParallelFor(0, count, NUM_THREADS, [&](size_t id, size_t) {
+		std::memcpy(pq->get_linklist0(id), graph.get_linklist0(id), graph.size_links_level0_);
+		quantizer.encode(reinterpret_cast<const float*>(graph.getDataByInternalId(id)),
+						 reinterpret_cast<uint8_t*>(pq->getDataByInternalId(id)));
+		pq->setExternalLabel(id, graph.getExternalLabel(id));
+
+		const int level = graph.element_levels_[id];
+		pq->element_levels_[id] = level;
+		if(level > 0) {
+			const size_t bytes = pq->size_links_per_element_ * level;
+			pq->linkLists_[id] = static_cast<char*>(malloc(bytes));
+			if(pq->linkLists_[id] == nullptr) {
+				throw std::runtime_error("not enough memory for the pq index link lists");
+			}
+			std::memcpy(pq->linkLists_[id], graph.linkLists_[id], bytes);
+		}
+	});
+
+	for(size_t id = 0; id < count; id++) {
+		pq->label_lookup_[graph.getExternalLabel(id)] = id;
+	}
+	pq->cur_element_count = count;
+	pq->maxlevel_ = graph.maxlevel_;
+	pq->enterpoint_node_ = graph.enterpoint_node_;
+	return pq;
+}
+
+/// @brief freeze `hnsw` into a CompactIndex, reorder it, encode its links in `encoding` and save
+/// it next to the index at `save_file` (lib/compact.hpp)
+void save_compact(const hnswlib::HierarchicalNSW<float>& hnsw,
+				  const fs::path& save_file,
+				  LinkEncoding encoding) {
+	const auto start = chrono::high_resolution_clock::now();
+	CompactIndex compact(hnsw);
+	const double plain_bytes = static_cast<double>(compact.link_bytes()) / compact.size();
+	compact.reorder();
+	compact.encode_links(encoding);
+	compact.save(compact_index_path(save_file));
+	const auto end = chrono::high_resolution_clock::now();
+	std::cout << std::format("saved compact index with {} links, {:.1f} link bytes per vector "
+							 "(plain {:.1f}, hnswlib {}) in {} s",
+							 link_encoding_name(encoding),
+							 static_cast<double>(compact.link_bytes()) / compact.size(),
+							 plain_bytes,
+							 hnsw.size_links_level0_,
+							 chrono::duration_cast<chrono::seconds>(end - start).count())
+			  << std::endl;
+}
+
 int main(int argc, char** argv) {
 	argparse::ArgumentParser program("bench_st_sq");
 
@@ -87,6 +183,51 @@ int main(int argc, char** argv) {
 		.default_value(false)
 		.implicit_value(true);
 
+	program.add_argument("--use-sq8")
+		.help("build using l2 distance on 8 bit scalar quantized vectors (lib/sq8.hpp)")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--use-fp16")
+		.help("build using l2 distance on vectors stored as fp16 (lib/half.hpp)")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--use-bf16")
+		.help("build using l2 distance on vectors stored as bf16 (lib/half.hpp)")
+		.default_value(false)
+		.implicit_value(true);
+
+	program.add_argument("--pq-m")
+		.help("also build a product quantized index with this many one byte subquantizers "
+			  "(lib/pq.hpp), must divide the dim, 0 = none")
+		.default_value(0)
+		.scan<'i', int>();
+	program.add_argument("--opq")
+		.help("rotate the vectors before product quantization (faiss::OPQMatrix)")
+		.default_value(false)
+		.implicit_value(true);
+	program.add_argument("--pq-train")
+		.help("vectors of the base set to train the product quantizer on")
+		.default_value(100000)
+		.scan<'i', int>();
+
+	program.add_argument("--pca-dim")
+		.help("list of space separated dims to also build pca projected indexes for "
+			  "(lib/pca.hpp), one per dim")
+		.default_value(std::vector<int>{})
+		.scan<'i', int>()
+		.nargs(argparse::nargs_pattern::any);
+	program.add_argument("--pca-train")
+		.help("vectors of the base set to train the pca projection on")
+		.default_value(100000)
+		.scan<'i', int>();
+
+	program.add_argument("--compact-links")
+		.help("also save the l2 and cosine indexes as reordered compact indexes (<index>.compact, "
+			  "lib/compact.hpp) with their level 0 links plain or vbyte compressed, none = don't")
+		.default_value(std::string("none"));
+
 	try {
 		program.parse_args(argc, argv);
 	} catch(const std::exception& err) {
@@ -103,6 +244,23 @@ int main(int argc, char** argv) {
 	const std::vector<int> hyperparams_e = program.get<std::vector<int>>("-e");
 	const bool use_euclidean = program.get<bool>("--use-euclidean");
 	const bool use_cosine = program.get<bool>("--use-cosine");
+	const bool use_sq8 = program.get<bool>("--use-sq8");
+	std::vector<HalfFormat> half_formats;
+	if(program.get<bool>("--use-fp16")) {
+		half_formats.push_back(HalfFormat::fp16);
+	}
+	if(program.get<bool>("--use-bf16")) {
+		half_formats.push_back(HalfFormat::bf16);
+	}
+	const size_t pq_m = program.get<int>("--pq-m");
+	const bool use_opq = program.get<bool>("--opq");
+	const size_t pq_train = program.get<int>("--pq-train");
+	const std::vector<int> pca_dims = program.get<std::vector<int>>("--pca-dim");
+	const size_t pca_train = program.get<int>("--pca-train");
+	std::optional<LinkEncoding> compact_links;
+	if(program.get<std::string>("--compact-links") != "none") {
+		compact_links = parse_link_encoding(program.get<std::string>("--compact-links"));
+	}
 
 	std::cout << std::format("HNSW Building Settings") << std::endl;
 	std::cout << std::format("\t gist path: '{}'", gist_dir.string()) << std::endl;
@@ -112,6 +270,18 @@ int main(int argc, char** argv) {
 	std::cout << std::format("\t Ef construction's to build: {}", hyperparams_e) << std::endl;
 	std::cout << std::format("\t build l2: {}", use_euclidean) << std::endl;
 	std::cout << std::format("\t build cosine: {}", use_cosine) << std::endl;
+	std::cout << std::format("\t build sq8: {}", use_sq8) << std::endl;
+	std::cout << std::format("\t build fp16: {}, bf16: {}",
+							 program.get<bool>("--use-fp16"),
+							 program.get<bool>("--use-bf16"))
+			  << std::endl;
+	std::cout << std::format("\t build pq: m = {} (opq {}, trained on {})", pq_m, use_opq, pq_train)
+			  << std::endl;
+	std::cout << std::format("\t build pca: dims = {} (trained on {})", pca_dims, pca_train)
+			  << std::endl;
+	std::cout << std::format("\t compact links: {}", program.get<std::string>("--compact-links"))
+			  << std::endl;
+	std::cout << std::format("\t distance kernels: {}", distance_kernels().isa) << std::endl;
 
 	assert(fs::exists(gist_dir) && fs::is_directory(gist_dir));
 	assert(fs::exists(gist_base) && fs::is_regular_file(gist_base));
@@ -119,6 +289,37 @@ int main(int argc, char** argv) {
 
 	auto gist_vectors = load_gist_960<float>(gist_base);
 
+	// the pq quantizer does not depend on the graph, train it once on a strided sample
+	std::optional<PqQuantizer> pq_quantizer;
+	if(pq_m > 0) {
+		const size_t n = std::min<size_t>(pq_train, gist_vectors.nb);
+		const std::vector<float> sample = strided_sample(gist_vectors, n);
+		const auto start = chrono::high_resolution_clock::now();
+		pq_quantizer.emplace(
+			PqQuantizer::train(sample.data(), n, gist_vectors.dim, pq_m, use_opq));
+		const auto end = chrono::high_resolution_clock::now();
+		std::cout << std::format("trained pq quantizer in {} s",
+								 chrono::duration_cast<chrono::seconds>(end - start).count())
+				  << std::endl;
+	}
+
+	// likewise one projection per dim, the indexes of every m and ef share it
+	std::vector<PcaProjection> pca_projections;
+	if(!pca_dims.empty()) {
+		const size_t n = std::min<size_t>(pca_train, gist_vectors.nb);
+		const std::vector<float> sample = strided_sample(gist_vectors, n);
+		for(const int pca_dim : pca_dims) {
+			const auto start = chrono::high_resolution_clock::now();
+			pca_projections.push_back(
+				PcaProjection::train(sample.data(), n, gist_vectors.dim, pca_dim));
+			const auto end = chrono::high_resolution_clock::now();
+			std::cout << std::format("trained pca projection to {} dims in {} s",
+									 pca_dim,
+									 chrono::duration_cast<chrono::seconds>(end - start).count())
+					  << std::endl;
+		}
+	}
+
 	for(const int m : hyperparams_m) {
 		for(const int ef_construction : hyperparams_e) {
 			if(use_euclidean) {
@@ -130,12 +331,15 @@ int main(int argc, char** argv) {
 					std::cout << std::format("generating index: {}", save_file.string())
 							  << std::endl;
 
-					hnswlib::L2Space l2_space(gist_vectors.dim);
+					DispatchedL2Space l2_space(gist_vectors.dim);
 					hnswlib::HierarchicalNSW<float> alg_hnsw = hnswlib::HierarchicalNSW<float>(
 						&l2_space, gist_vectors.nb, m, ef_construction);
 					build_hnsw(alg_hnsw, gist_vectors, false);
 
 					alg_hnsw.saveIndex(save_file.string());
+					if(compact_links) {
+						save_compact(alg_hnsw, save_file, *compact_links);
+					}
 					std::cout << std::endl;
 				}
 			}
@@ -149,11 +353,115 @@ int main(int argc, char** argv) {
 					std::cout << std::format("generating index: {}", save_file.string())
 							  << std::endl;
 
-					hnswlib::InnerProductSpace cosine_space(gist_vectors.dim);
+					DispatchedIpSpace cosine_space(gist_vectors.dim);
 					hnswlib::HierarchicalNSW<float> alg_hnsw = hnswlib::HierarchicalNSW<float>(
 						&cosine_space, gist_vectors.nb, m, ef_construction);
 					build_hnsw(alg_hnsw, gist_vectors, true);
 					alg_hnsw.saveIndex(save_file.string());
+					if(compact_links) {
+						save_compact(alg_hnsw, save_file, *compact_links);
+					}
+					std::cout << std::endl;
+				}
+			}
+
+			if(use_sq8) {
+				fs::path save_file =
+					index_path / std::format("hnsw_m_{}_ef_{}_sq8.bin", m, ef_construction);
+				if(fs::exists(save_file)) {
+					std::cout << std::format("skipping index: {}", save_file.string()) << std::endl;
+				} else {
+					std::cout << std::format("generating index: {}", save_file.string())
+							  << std::endl;
+
+					const Sq8Quantizer quantizer = Sq8Quantizer::train(
+						gist_vectors.data.get(), gist_vectors.nb, gist_vectors.dim);
+					Sq8Space sq8_space(quantizer);
+					hnswlib::HierarchicalNSW<float> alg_hnsw = hnswlib::HierarchicalNSW<float>(
+						&sq8_space, gist_vectors.nb, m, ef_construction);
+					build_hnsw_sq8(alg_hnsw, gist_vectors, quantizer);
+
+					alg_hnsw.saveIndex(save_file.string());
+					quantizer.save(sq8_quantizer_path(save_file));
+					std::cout << std::endl;
+				}
+			}
+
+			for(const HalfFormat format : half_formats) {
+				fs::path save_file = index_path / std::format("hnsw_m_{}_ef_{}_{}.bin",
+															  m,
+															  ef_construction,
+															  half_format_name(format));
+				if(fs::exists(save_file)) {
+					std::cout << std::format("skipping index: {}", save_file.string()) << std::endl;
+				} else {
+					std::cout << std::format("generating index: {}", save_file.string())
+							  << std::endl;
+
+					HalfSpace half_space(gist_vectors.dim, format, false);
+					hnswlib::HierarchicalNSW<float> alg_hnsw = hnswlib::HierarchicalNSW<float>(
+						&half_space, gist_vectors.nb, m, ef_construction);
+					build_hnsw_half(alg_hnsw, gist_vectors, format);
+
+					alg_hnsw.saveIndex(save_file.string());
+					std::cout << std::endl;
+				}
+			}
+
+			if(pq_quantizer) {
+				fs::path save_file = index_path / std::format("hnsw_m_{}_ef_{}_{}{}.bin",
+															  m,
+															  ef_construction,
+															  use_opq ? "opq" : "pq",
+															  pq_m);
+				if(fs::exists(save_file)) {
+					std::cout << std::format("skipping index: {}", save_file.string()) << std::endl;
+				} else {
+					std::cout << std::format("generating index: {}", save_file.string())
+							  << std::endl;
+
+					// the graph of the float l2 index if there is one, so recall differences
+					// between the two come from the distances alone
+					const fs::path l2_file =
+						index_path / std::format("hnsw_m_{}_ef_{}_l2.bin", m, ef_construction);
+					DispatchedL2Space l2_space(gist_vectors.dim);
+					std::unique_ptr<hnswlib::HierarchicalNSW<float>> graph;
+					if(fs::exists(l2_file)) {
+						std::cout << std::format("graph from: {}", l2_file.string()) << std::endl;
+						graph = std::make_unique<hnswlib::HierarchicalNSW<float>>(
+							&l2_space, l2_file.string());
+					} else {
+						graph = std::make_unique<hnswlib::HierarchicalNSW<float>>(
+							&l2_space, gist_vectors.nb, m, ef_construction);
+						build_hnsw(*graph, gist_vectors, false);
+					}
+
+					PqSpace pq_space(*pq_quantizer);
+					const auto pq_hnsw = with_pq_codes(*graph, pq_space, *pq_quantizer);
+					pq_hnsw->saveIndex(save_file.string());
+					pq_quantizer->save(pq_quantizer_path(save_file));
+					std::cout << std::endl;
+				}
+			}
+
+			for(const PcaProjection& projection : pca_projections) {
+				fs::path save_file = index_path / std::format("hnsw_m_{}_ef_{}_pca{}.bin",
+															  m,
+															  ef_construction,
+															  projection.out_dim());
+				if(fs::exists(save_file)) {
+					std::cout << std::format("skipping index: {}", save_file.string()) << std::endl;
+				} else {
+					std::cout << std::format("generating index: {}", save_file.string())
+							  << std::endl;
+
+					DispatchedL2Space pca_space(projection.out_dim());
+					hnswlib::HierarchicalNSW<float> alg_hnsw = hnswlib::HierarchicalNSW<float>(
+						&pca_space, gist_vectors.nb, m, ef_construction);
+					build_hnsw_pca(alg_hnsw, gist_vectors, projection);
+
+					alg_hnsw.saveIndex(save_file.string());
+					projection.save(pca_projection_path(save_file));
 					std::cout << std::endl;
 				}
 			}
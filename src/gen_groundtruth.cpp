@@ -0,0 +1,191 @@
+#include "lib/argparser.hpp"
+#include "lib/embeddings.hpp"
+#include "lib/utils.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <faiss/IndexFlat.h>
+#include <filesystem>
+#include <format>
+#include <limits>
+#include <omp.h>
+#include <stdexcept>
+#include <vector>
+
+namespace chrono = std::chrono;
+namespace fs = std::filesystem;
+
+// Exact top K by brute force with faiss' flat index (blocked GEMM through BLAS for more than a
+// handful of queries, parallel over all cores). The base set is streamed in chunks, every chunk
+// is searched for all queries and merged into the running top K, so the base never has to fit in
+// ram. Distances are written the way hnswlib reports them: squared l2, or 1 - inner product.
+
+/// @brief merge a chunk's top k (ascending distance) into the running top k of one query
+void merge_top_k(float* best_dist,
+				 int* best_ids,
+				 const float* chunk_dist,
+				 const faiss::idx_t* chunk_ids,
+				 size_t k,
+				 size_t id_offset) {
+	std::vector<float> merged_dist(k);
+	std::vector<int> merged_ids(k);
+
+	size_t a = 0, b = 0;
+	for(size_t i = 0; i < k; i++) {
+		// faiss pads with id -1 when a chunk has fewer than k rows
+		const bool take_chunk = chunk_ids[b] >= 0 && chunk_dist[b] < best_dist[a];
+		if(take_chunk) {
+			merged_dist[i] = chunk_dist[b];
+			merged_ids[i] = static_cast<int>(chunk_ids[b] + id_offset);
+			b++;
+		} else {
+			merged_dist[i] = best_dist[a];
+			merged_ids[i] = best_ids[a];
+			a++;
+		}
+	}
+	std::copy(merged_dist.begin(), merged_dist.end(), best_dist);
+	std::copy(merged_ids.begin(), merged_ids.end(), best_ids);
+}
+
+int main(int argc, char** argv) {
+	argparse::ArgumentParser program("gen_groundtruth");
+
+	program.add_argument("base").help("path to base fvecs");
+	program.add_argument("query").help("path to query fvecs");
+	program.add_argument("output").help("output prefix, writes <output>.ivecs and <output>.fvecs");
+	program.add_argument("-k").help("neighbors per query").default_value(100).scan<'i', int>();
+	program.add_argument("--metric")
+		.help("l2, ip or cosine (normalizes base and queries)")
+		.default_value(std::string("l2"));
+	program.add_argument("--nb")
+		.help("only use the first nb base vectors (0 = all)")
+		.default_value(0)
+		.scan<'i', int>();
+	program.add_argument("--chunk")
+		.help("base vectors per chunk")
+		.default_value(100000)
+		.scan<'i', int>();
+	program.add_argument("--threads")
+		.help("number of threads (0 = all cores)")
+		.default_value(0)
+		.scan<'i', int>();
+
+	try {
+		program.parse_args(argc, argv);
+	} catch(const std::exception& err) {
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		return 1;
+	}
+
+	const fs::path base_path{ program.get<std::string>("base") };
+	const fs::path query_path{ program.get<std::string>("query") };
+	const fs::path output{ program.get<std::string>("output") };
+	const size_t k = program.get<int>("-k");
+	const std::string metric = program.get<std::string>("--metric");
+	const size_t chunk = program.get<int>("--chunk");
+	const int threads = program.get<int>("--threads");
+
+	if(metric != "l2" && metric != "ip" && metric != "cosine") {
+		std::cerr << std::format("unknown metric '{}'", metric) << std::endl;
+		return 1;
+	}
+	const bool inner_product = metric != "l2";
+	const bool normalize = metric == "cosine";
+	if(threads > 0) {
+		omp_set_num_threads(threads);
+	}
+
+	VecsReader<float> base(base_path);
+	const auto query = load_gist_960<float>(query_path);
+	const size_t dim = query.dim;
+	const size_t nq = query.nb;
+	const size_t nb = program.get<int>("--nb") > 0
+						  ? std::min<size_t>(program.get<int>("--nb"), base.nb())
+						  : base.nb();
+	// the chunks are read with the dims of the base and scored with those of the queries
+	if(static_cast<size_t>(base.dim()) != dim) {
+		throw std::runtime_error(std::format("base '{}' has {} dims, query '{}' has {}",
+											 base_path.string(),
+											 base.dim(),
+											 query_path.string(),
+											 dim));
+	}
+
+	std::cout << "Ground Truth Settings" << std::endl;
+	std::cout << std::format("\t base: '{}' ({} of {} vectors)", base_path.string(), nb, base.nb())
+			  << std::endl;
+	std::cout << std::format("\t query: '{}' ({} vectors)", query_path.string(), nq) << std::endl;
+	std::cout << std::format("\t k: {}, metric: {}, chunk: {}", k, metric, chunk) << std::endl;
+
+	std::vector<float> queries(query.data.get(), query.data.get() + nq * dim);
+	if(normalize) {
+		for(size_t q = 0; q < nq; q++) {
+			fast_normalize(&queries[q * dim], &queries[q * dim], dim);
+		}
+	}
+
+	std::vector<float> best_dist(nq * k, std::numeric_limits<float>::max());
+	std::vector<int> best_ids(nq * k, -1);
+
+	std::vector<float> rows(chunk * dim);
+	std::vector<float> chunk_dist(nq * k);
+	std::vector<faiss::idx_t> chunk_ids(nq * k);
+
+	auto start = chrono::high_resolution_clock::now();
+	for(size_t offset = 0; offset < nb;) {
+		const size_t count = base.read(rows.data(), std::min(chunk, nb - offset));
+		if(normalize) {
+#pragma omp parallel for
+			for(size_t i = 0; i < count; i++) {
+				fast_normalize(&rows[i * dim], &rows[i * dim], dim);
+			}
+		}
+
+		if(inner_product) {
+			faiss::IndexFlatIP index(dim);
+			index.add(count, rows.data());
+			index.search(nq, queries.data(), k, chunk_dist.data(), chunk_ids.data());
+			// faiss returns similarities (descending), hnswlib distances are 1 - ip (ascending)
+			for(float& d : chunk_dist) {
+				d = 1.0f - d;
+			}
+		} else {
+			faiss::IndexFlatL2 index(dim);
+			index.add(count, rows.data());
+			index.search(nq, queries.data(), k, chunk_dist.data(), chunk_ids.data());
+		}
+
+#pragma omp parallel for
+		for(size_t q = 0; q < nq; q++) {
+			merge_top_k(&best_dist[q * k],
+						&best_ids[q * k],
+						&chunk_dist[q * k],
+						&chunk_ids[q * k],
+						k,
+						offset);
+		}
+
+		offset += count;
+		auto elapsed = chrono::duration_cast<chrono::seconds>(chrono::high_resolution_clock::now() -
+															 start)
+						   .count();
+		std::cout << std::format("[{:7.2f}%] {} / {} base vectors, elapsed = {:5d}s\r",
+								 100.0 * offset / nb,
+								 offset,
+								 nb,
+								 elapsed);
+		std::cout.flush();
+	}
+	std::cout << std::endl;
+
+	const fs::path ivecs_path = output.string() + ".ivecs";
+	const fs::path fvecs_path = output.string() + ".fvecs";
+	std::cout << std::format("writing to files: {} {}", ivecs_path.string(), fvecs_path.string())
+			  << std::endl;
+	write_vecs(ivecs_path, best_ids.data(), k, nq);
+	write_vecs(fvecs_path, best_dist.data(), k, nq);
+
+	return 0;
+}
@@ -0,0 +1,434 @@
+#include "lib/argparser.hpp"
+#include "lib/distance.hpp"
+#include "lib/embeddings.hpp"
+#include "lib/half.hpp"
+#include "lib/isolation.hpp"
+#include "lib/recall.hpp"
+#include "lib/result_store.hpp"
+#include "lib/sq8.hpp"
+#include "lib/stats.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <hnswlib/hnswlib.h>
+#include <map>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace chrono = std::chrono;
+namespace fs = std::filesystem;
+
+// Microbenchmarks of the pieces a query is made of, so a change in end to end latency can be
+// traced to one of them. Every kernel is run in batches that take at least --sample-us, each
+// sample is the time per operation of one batch in ns. Results go to a json lines result file
+// (lib/result_store.hpp, unit = ns), so `results diff` and `results gate` work on them.
+
+/// @brief keep the compiler from optimizing away a result
+template <typename T>
+inline void do_not_optimize(const T& value) {
+	asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class MicroBench {
+public:
+	MicroBench(ResultWriter& writer,
+			   const std::string& filter,
+			   size_t repetitions,
+			   double sample_us,
+			   size_t dim)
+		: writer_(writer)
+		, filter_(filter)
+		, repetitions_(repetitions)
+		, sample_us_(sample_us)
+		, dim_(dim) {}
+
+	/// @param ops operations done by one call of `fn`
+	/// @param bytes bytes read per operation, adds a throughput metric if set
+	template <typename F>
+	void measure(const std::string& name, size_t ops, F&& fn, size_t bytes = 0) {
+		if(!filter_.empty() && name.find(filter_) == std::string::npos) {
+			return;
+		}
+
+		// warm up (first touch of buffers, caches) and find the number of calls that make one
+		// sample last sample_us
+		time_calls(1, fn);
+		size_t calls = 1;
+		for(;;) {
+			const double us = time_calls(calls, fn) / 1e3;
+			if(us >= sample_us_ || calls >= (size_t{ 1 } << 30)) {
+				break;
+			}
+			const size_t factor = us > 0.0 ? static_cast<size_t>(sample_us_ / us * 1.2) : 16;
+			calls *= std::clamp<size_t>(factor, 2, 16);
+		}
+
+		std::vector<double> samples(repetitions_);
+		for(double& sample : samples) {
+			sample = time_calls(calls, fn) / (calls * ops);
+		}
+
+		const Summary s = summarize(samples);
+		std::cout << std::format("{:40} {:12.2f} ns/op  min {:12.2f}  p99 {:12.2f}  ({} x {} ops)",
+								 name,
+								 s.p50,
+								 s.min,
+								 s.p99,
+								 calls,
+								 ops)
+				  << std::endl;
+
+		std::map<std::string, double> metrics{ { "ops_per_s", 1e9 / s.p50 } };
+		if(bytes > 0) {
+			metrics["bytes_per_s"] = bytes * 1e9 / s.p50;
+			std::cout << std::format("{:40} {:12.2f} GB/s", "", bytes / s.p50) << std::endl;
+		}
+		writer_.write({ { "bench", "microbench" },
+						{ "kernel", name },
+						{ "dim", std::to_string(dim_) },
+						{ "unit", "ns" } },
+					  samples,
+					  metrics);
+	}
+
+private:
+	template <typename F>
+	static double time_calls(size_t calls, F& fn) {
+		const auto start = chrono::steady_clock::now();
+		for(size_t i = 0; i < calls; i++) {
+			fn();
+		}
+		const auto end = chrono::steady_clock::now();
+		return chrono::duration<double, std::nano>(end - start).count();
+	}
+
+	ResultWriter& writer_;
+	const std::string filter_;
+	const size_t repetitions_;
+	const double sample_us_;
+	const size_t dim_;
+};
+
+int main(int argc, char** argv) {
+	argparse::ArgumentParser program("microbench");
+
+	program.add_argument("--output")
+		.help("json lines result file")
+		.default_value(std::string("./results/microbench.jsonl"));
+	program.add_argument("--dim").help("vector dimension").default_value(960).scan<'i', int>();
+	program.add_argument("--filter")
+		.help("only run kernels whose name contains this")
+		.default_value(std::string(""));
+	program.add_argument("--repetitions")
+		.help("samples per kernel")
+		.default_value(30)
+		.scan<'i', int>();
+	program.add_argument("--sample-us")
+		.help("minimum duration of one sample")
+		.default_value(2000.0)
+		.scan<'g', double>();
+	program.add_argument("--elements")
+		.help("elements of the visited list (index size)")
+		.default_value(1000000)
+		.scan<'i', int>();
+	program.add_argument("--ef")
+		.help("result heap size of the heap kernels")
+		.default_value(100)
+		.scan<'i', int>();
+	program.add_argument("--gist-dir")
+		.help("gist directory, enables the load_gist_960 throughput kernel")
+		.default_value(std::string(""));
+	program.add_argument("--core")
+		.help("cpu to pin to (-1 = no pinning)")
+		.default_value(-1)
+		.scan<'i', int>();
+
+	try {
+		program.parse_args(argc, argv);
+	} catch(const std::exception& err) {
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		return 1;
+	}
+
+	const fs::path output{ program.get<std::string>("--output") };
+	const size_t dim = program.get<int>("--dim");
+	const size_t elements = program.get<int>("--elements");
+	const size_t ef = program.get<int>("--ef");
+	const std::string gist_dir = program.get<std::string>("--gist-dir");
+	const int core = program.get<int>("--core");
+
+	if(core >= 0) {
+		pin_current_thread(core);
+	}
+	EnvironmentInfo env = capture_environment(core >= 0 ? core : sched_getcpu());
+	env.pinned = core >= 0;
+
+	if(output.has_parent_path()) {
+		fs::create_directories(output.parent_path());
+	}
+	std::cout << "writing results to: " << output.string() << std::endl;
+	ResultWriter writer(output, env, true);
+	MicroBench bench(writer,
+					 program.get<std::string>("--filter"),
+					 program.get<int>("--repetitions"),
+					 program.get<double>("--sample-us"),
+					 dim);
+
+	std::mt19937_64 rng(42);
+	std::normal_distribution<float> gaussian;
+
+	// a handful of vectors that stay in l1/l2, this measures the arithmetic, not memory
+	constexpr size_t NUM_VECTORS = 32;
+	std::vector<float> vectors(NUM_VECTORS * dim);
+	for(float& x : vectors) {
+		x = gaussian(rng);
+	}
+	std::vector<float> query(dim);
+	for(float& x : query) {
+		x = gaussian(rng);
+	}
+
+	// distance kernels, every ISA variant hnswlib was compiled with and the cpu supports
+	std::vector<std::pair<std::string, hnswlib::DISTFUNC<float>>> kernels{
+		{ "l2/scalar", hnswlib::L2Sqr },
+		{ "ip/scalar", hnswlib::InnerProductDistance },
+	};
+	if(dim % 16 == 0) {
+#if defined(USE_SSE)
+		kernels.emplace_back("l2/sse", hnswlib::L2SqrSIMD16ExtSSE);
+		kernels.emplace_back("ip/sse", hnswlib::InnerProductDistanceSIMD16ExtSSE);
+#endif
+#if defined(USE_AVX)
+		if(__builtin_cpu_supports("avx")) {
+			kernels.emplace_back("l2/avx", hnswlib::L2SqrSIMD16ExtAVX);
+			kernels.emplace_back("ip/avx", hnswlib::InnerProductDistanceSIMD16ExtAVX);
+		}
+#endif
+#if defined(USE_AVX512)
+		if(__builtin_cpu_supports("avx512f")) {
+			kernels.emplace_back("l2/avx512", hnswlib::L2SqrSIMD16ExtAVX512);
+			kernels.emplace_back("ip/avx512", hnswlib::InnerProductDistanceSIMD16ExtAVX512);
+		}
+#endif
+	}
+	// what hnswlib's own spaces pick
+	hnswlib::L2Space l2_space(dim);
+	hnswlib::InnerProductSpace ip_space(dim);
+	kernels.emplace_back("l2/space", l2_space.get_dist_func());
+	kernels.emplace_back("ip/space", ip_space.get_dist_func());
+	// every runtime dispatched level the cpu supports (lib/distance.hpp), the benchmarks use the
+	// first one unless HNSW_ISA says otherwise
+	for(const DistanceKernels& k : supported_distance_kernels()) {
+		kernels.emplace_back("l2/dispatch_" + k.isa, k.l2);
+		kernels.emplace_back("ip/dispatch_" + k.isa, k.ip);
+		if(k.has_fixed(dim)) {
+			kernels.emplace_back(std::format("l2/dispatch_{}_{}", k.isa, dim), k.l2_for(dim));
+			kernels.emplace_back(std::format("ip/dispatch_{}_{}", k.isa, dim), k.ip_for(dim));
+		}
+	}
+
+	for(const auto& [name, dist] : kernels) {
+		bench.measure(
+			"distance/" + name,
+			NUM_VECTORS,
+			[&, dist = dist]() {
+				float sum = 0.0f;
+				for(size_t i = 0; i < NUM_VECTORS; i++) {
+					sum += dist(query.data(), vectors.data() + i * dim, &dim);
+				}
+				do_not_optimize(sum);
+			},
+			dim * sizeof(float));
+	}
+
+	// the same vectors through the batch kernels, one call for all of them like search mode batched
+	std::vector<const void*> batch(NUM_VECTORS);
+	for(size_t i = 0; i < NUM_VECTORS; i++) {
+		batch[i] = vectors.data() + i * dim;
+	}
+	std::vector<float> batch_distances(NUM_VECTORS);
+	for(const DistanceKernels& k : supported_distance_kernels()) {
+		bench.measure(
+			"distance/l2/batch_" + k.isa,
+			NUM_VECTORS,
+			[&, batch_kernel = k.l2_batch]() {
+				batch_kernel(query.data(), batch.data(), NUM_VECTORS, dim, batch_distances.data());
+				do_not_optimize(batch_distances[0]);
+			},
+			dim * sizeof(float));
+	}
+
+	// the same vectors as sq8 codes, a quarter of the bytes per distance
+	const Sq8Quantizer quantizer = Sq8Quantizer::train(vectors.data(), NUM_VECTORS, dim);
+	std::vector<uint8_t> codes((NUM_VECTORS + 1) * dim);
+	for(size_t i = 0; i < NUM_VECTORS; i++) {
+		quantizer.encode(vectors.data() + i * dim, codes.data() + i * dim);
+	}
+	const uint8_t* code_query = codes.data() + NUM_VECTORS * dim;
+	quantizer.encode(query.data(), codes.data() + NUM_VECTORS * dim);
+	const kernels::Sq8Param sq8_param{ dim, quantizer.weights().data() };
+	for(const DistanceKernels& k : supported_distance_kernels()) {
+		bench.measure(
+			"distance/sq8/dispatch_" + k.isa,
+			NUM_VECTORS,
+			[&, dist = k.sq8_l2]() {
+				float sum = 0.0f;
+				for(size_t i = 0; i < NUM_VECTORS; i++) {
+					sum += dist(code_query, codes.data() + i * dim, &sq8_param);
+				}
+				do_not_optimize(sum);
+			},
+			dim);
+	}
+
+	// the same vectors in half precision against the float query, half the bytes per distance
+	for(const HalfFormat format : { HalfFormat::fp16, HalfFormat::bf16 }) {
+		std::vector<uint16_t> half(NUM_VECTORS * dim);
+		to_half(vectors.data(), NUM_VECTORS * dim, format, half.data());
+		for(const DistanceKernels& k : supported_distance_kernels()) {
+			bench.measure(
+				std::format("distance/{}/dispatch_{}", half_format_name(format), k.isa),
+				NUM_VECTORS,
+				[&, dist = format == HalfFormat::fp16 ? k.fp16_l2_query : k.bf16_l2_query]() {
+					float sum = 0.0f;
+					for(size_t i = 0; i < NUM_VECTORS; i++) {
+						sum += dist(query.data(), half.data() + i * dim, &dim);
+					}
+					do_not_optimize(sum);
+				},
+				dim * sizeof(uint16_t));
+		}
+	}
+
+	// pq codes of dim / 10 bytes against a lookup table (ten dims per subquantizer, 96 for GIST)
+	const size_t pq_m = std::max<size_t>(dim / 10, 1);
+	std::vector<float> table(pq_m * kernels::PQ_CENTROIDS);
+	for(float& entry : table) {
+		const float x = gaussian(rng);
+		entry = x * x;
+	}
+	std::vector<uint8_t> pq_codes(NUM_VECTORS * pq_m);
+	std::uniform_int_distribution<int> pick_centroid(0, kernels::PQ_CENTROIDS - 1);
+	for(uint8_t& c : pq_codes) {
+		c = static_cast<uint8_t>(pick_centroid(rng));
+	}
+	const kernels::PqParam pq_param{ dim, pq_m };
+	for(const DistanceKernels& k : supported_distance_kernels()) {
+		bench.measure(
+			"distance/pq/dispatch_" + k.isa,
+			NUM_VECTORS,
+			[&, dist = k.pq_adc]() {
+				float sum = 0.0f;
+				for(size_t i = 0; i < NUM_VECTORS; i++) {
+					sum += dist(table.data(), pq_codes.data() + i * pq_m, &pq_param);
+				}
+				do_not_optimize(sum);
+			},
+			pq_m);
+	}
+
+	// visited list: one acquire/release per query and one check-and-mark per neighbor
+	hnswlib::VisitedListPool pool(1, elements);
+	bench.measure("visited_list/acquire_release", 1, [&]() {
+		hnswlib::VisitedList* vl = pool.getFreeVisitedList();
+		do_not_optimize(vl->curV);
+		pool.releaseVisitedList(vl);
+	});
+
+	constexpr size_t NUM_IDS = 4096;
+	std::vector<hnswlib::tableint> ids(NUM_IDS);
+	std::uniform_int_distribution<hnswlib::tableint> pick_id(0, elements - 1);
+	for(hnswlib::tableint& id : ids) {
+		id = pick_id(rng);
+	}
+	bench.measure("visited_list/check_and_mark", NUM_IDS, [&]() {
+		hnswlib::VisitedList* vl = pool.getFreeVisitedList();
+		size_t fresh = 0;
+		for(const hnswlib::tableint id : ids) {
+			if(vl->mass[id] != vl->curV) {
+				vl->mass[id] = vl->curV;
+				fresh++;
+			}
+		}
+		do_not_optimize(fresh);
+		pool.releaseVisitedList(vl);
+	});
+
+	// heaps with the access pattern of searchBaseLayer: a bounded max heap of the ef best results
+	// and a candidate heap (negated distances) that is pushed and popped alternately
+	using Pair = std::pair<float, hnswlib::tableint>;
+	using Heap = std::priority_queue<Pair,
+									 std::vector<Pair>,
+									 hnswlib::HierarchicalNSW<float>::CompareByFirst>;
+	std::vector<float> distances(NUM_IDS);
+	for(float& d : distances) {
+		d = std::abs(gaussian(rng));
+	}
+	bench.measure("heap/top_candidates", NUM_IDS, [&]() {
+		Heap top;
+		for(size_t i = 0; i < NUM_IDS; i++) {
+			if(top.size() < ef || distances[i] < top.top().first) {
+				top.emplace(distances[i], ids[i]);
+				if(top.size() > ef) {
+					top.pop();
+				}
+			}
+		}
+		do_not_optimize(top.top());
+	});
+	bench.measure("heap/candidate_set", NUM_IDS, [&]() {
+		Heap candidates;
+		float sum = 0.0f;
+		for(size_t i = 0; i < NUM_IDS; i++) {
+			candidates.emplace(-distances[i], ids[i]);
+			if(i % 2 == 1) {
+				sum += candidates.top().first;
+				candidates.pop();
+			}
+		}
+		do_not_optimize(sum);
+	});
+
+	// recall of one query at k = 100
+	constexpr size_t RECALL_K = 100;
+	Embedding<int> gt{ std::unique_ptr<int[]>(new int[RECALL_K]), RECALL_K, 1 };
+	std::priority_queue<std::pair<float, hnswlib::labeltype>> result;
+	for(size_t i = 0; i < RECALL_K; i++) {
+		gt.data[i] = ids[i];
+		result.emplace(distances[i], i % 2 == 0 ? ids[i] : ids[i + RECALL_K]);
+	}
+	bench.measure("recall/calculate_recall", 1, [&]() {
+		do_not_optimize(calculate_recall(0, gt, result, RECALL_K));
+	});
+	const RecallEvaluator evaluator(gt);
+	const SearchResult sorted = to_sorted_result(result);
+	bench.measure("recall/evaluate", 1, [&]() {
+		do_not_optimize(evaluator.evaluate(0, sorted, RECALL_K).recall);
+	});
+
+	std::vector<float> normalized(dim);
+	bench.measure("normalize/fast_normalize", 1, [&]() {
+		fast_normalize(query.data(), normalized.data(), dim);
+		do_not_optimize(normalized[0]);
+	});
+
+	// load throughput from the page cache
+	if(!gist_dir.empty()) {
+		const fs::path gist_query = fs::path(gist_dir) / "gist_query.fvecs";
+		bench.measure(
+			"load/load_gist_960",
+			1,
+			[&]() {
+				const auto loaded = load_gist_960<float>(gist_query);
+				do_not_optimize(loaded.data[0]);
+			},
+			fs::file_size(gist_query));
+	}
+
+	return 0;
+}
@@ -0,0 +1,187 @@
+#include "lib/argparser.hpp"
+#include "lib/distance.hpp"
+#include "lib/embeddings.hpp"
+#include "lib/isolation.hpp"
+#include "lib/recall.hpp"
+#include "lib/query_log.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <hnswlib/hnswlib.h>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace chrono = std::chrono;
+namespace fs = std::filesystem;
+
+// Replays a query log (see lib/query_log.hpp) against an index, either as fast as possible or
+// with the inter-arrival times of the original capture (open loop: a slow query delays the next
+// ones, which shows up as response time > service time)
+
+int main(int argc, char** argv) {
+	argparse::ArgumentParser program("replay");
+
+	program.add_argument("log_path").help("path to query log");
+	program.add_argument("res_path").help("path to directory to write result");
+	program.add_argument("index_path").help("path to hnsw index file");
+	program.add_argument("--timed")
+		.help("reproduce the original inter-arrival times instead of replaying back to back")
+		.default_value(false)
+		.implicit_value(true);
+	program.add_argument("--speed")
+		.help("time scale for --timed, 2 replays twice as fast as captured")
+		.default_value(1.0)
+		.scan<'g', double>();
+	program.add_argument("--groundtruth")
+		.help("ivecs ground truth with one row per log entry, enables recall")
+		.default_value(std::string(""));
+
+	try {
+		program.parse_args(argc, argv);
+	} catch(const std::exception& err) {
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		return 1;
+	}
+
+	const fs::path log_path{ program.get<std::string>("log_path") };
+	const fs::path res_path{ program.get<std::string>("res_path") };
+	const fs::path index_path{ program.get<std::string>("index_path") };
+	const bool timed = program.get<bool>("--timed");
+	const double speed = program.get<double>("--speed");
+	const std::string groundtruth = program.get<std::string>("--groundtruth");
+
+	const auto log = load_query_log(log_path);
+	std::cout << std::format(
+					 "query log with NB = {} and DIM = {}", log->vectors.nb, log->vectors.dim)
+			  << std::endl;
+
+	// Embedding is not movable, `new` from the prvalue is the only way to make it optional
+	std::unique_ptr<const Embedding<int>> gt;
+	if(!groundtruth.empty()) {
+		gt.reset(new Embedding<int>(load_gist_960<int>(groundtruth)));
+		if(gt->nb != log->vectors.nb) {
+			throw std::runtime_error(
+				std::format("ground truth {} has {} rows, the query log has {} entries",
+							groundtruth,
+							gt->nb,
+							log->vectors.nb));
+		}
+	}
+
+	std::cout << std::format("loading from file: {}", index_path.string()) << std::endl;
+	std::cout << std::format("distance kernels: {} (cpu: {})",
+							 distance_kernels().isa,
+							 cpu_simd_features())
+			  << std::endl;
+	DispatchedL2Space space(log->vectors.dim);
+	hnswlib::HierarchicalNSW<float> alg_hnsw = hnswlib::HierarchicalNSW<float>(&space, index_path);
+	const size_t default_ef = alg_hnsw.ef_;
+
+	const size_t n = log->entries.size();
+	// an entry stamped before the previous one would arrive in the past and get a wrong response
+	// time, and sorting would misalign the ground truth rows
+	if(timed) {
+		for(size_t i = 1; i < n; i++) {
+			if(log->entries[i].timestamp_ns < log->entries[i - 1].timestamp_ns) {
+				throw std::runtime_error(
+					std::format("{}: entry {} is stamped before entry {}, --timed needs the "
+								"entries in timestamp order",
+								log_path.string(),
+								i,
+								i - 1));
+			}
+		}
+	}
+
+	std::vector<uint64_t> service_ns(n);
+	std::vector<uint64_t> response_ns(n);
+	std::vector<double> recall(n, -1.0);
+	std::vector<std::vector<int>> results(n);
+
+	const auto replay_start = chrono::steady_clock::now();
+	for(size_t i = 0; i < n; i++) {
+		const QueryLogEntry& entry = log->entries[i];
+
+		// the moment the query arrives, it waits in the "queue" until the previous one is done
+		auto arrival = chrono::steady_clock::now();
+		if(timed) {
+			arrival = replay_start +
+					  chrono::nanoseconds(static_cast<uint64_t>(entry.timestamp_ns / speed));
+			std::this_thread::sleep_until(arrival);
+		}
+
+		alg_hnsw.setEf(entry.ef != 0 ? entry.ef : default_ef);
+		std::optional<AllowedLabelsFilter> filter;
+		if(entry.filter_size > 0) {
+			const uint32_t* begin = log->filters.data() + entry.filter_begin;
+			filter.emplace(begin, begin + entry.filter_size);
+		}
+
+		const auto start = chrono::steady_clock::now();
+		auto output = alg_hnsw.searchKnn(log->vector(i), entry.k, filter ? &*filter : nullptr);
+		const auto end = chrono::steady_clock::now();
+
+		service_ns[i] = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+		response_ns[i] = chrono::duration_cast<chrono::nanoseconds>(end - arrival).count();
+
+		if(gt != nullptr) {
+			recall[i] = calculate_recall(i, *gt, output, std::min<size_t>(entry.k, gt->dim));
+		}
+
+		// nearest first
+		results[i].resize(output.size());
+		for(size_t j = output.size(); j > 0; j--) {
+			results[i][j - 1] = static_cast<int>(output.top().second);
+			output.pop();
+		}
+	}
+
+	const fs::path csv_filename =
+		res_path / std::format("replay_{}_{}_{}_latencies.csv",
+							   log_path.stem().string(),
+							   index_path.filename().string(),
+							   timed ? std::format("timed_x{}", speed) : "fast");
+	std::cout << "writing to file: " << csv_filename.string() << std::endl;
+	std::ofstream fout(csv_filename);
+	if(fout.is_open()) {
+		write_environment(fout, capture_environment(sched_getcpu()));
+		fout << "seq, timestamp (ns), k, ef, filter size, service (us), response (us), recall\n";
+		for(size_t i = 0; i < n; i++) {
+			const QueryLogEntry& entry = log->entries[i];
+			fout << std::format("{}, {}, {}, {}, {}, {:.3f}, {:.3f}, ",
+								i,
+								entry.timestamp_ns,
+								entry.k,
+								entry.ef,
+								entry.filter_size,
+								service_ns[i] / 1000.0,
+								response_ns[i] / 1000.0);
+			if(recall[i] >= 0.0) {
+				fout << recall[i];
+			}
+			fout << '\n';
+		}
+	} else {
+		std::cerr << "cannot open file: " << csv_filename << std::endl;
+	}
+
+	// result ids in ivecs layout, each row is as long as the number of results of that query
+	const fs::path ivecs_filename = csv_filename.parent_path() /
+									(csv_filename.stem().string() + "_results.ivecs");
+	std::cout << "writing to file: " << ivecs_filename.string() << std::endl;
+	std::ofstream rout(ivecs_filename, std::ios::binary);
+	for(const auto& row : results) {
+		const int size = row.size();
+		rout.write(reinterpret_cast<const char*>(&size), sizeof(int));
+		rout.write(reinterpret_cast<const char*>(row.data()), sizeof(int) * size);
+	}
+
+	return 0;
+}
@@ -0,0 +1,401 @@
+#include "lib/argparser.hpp"
+#include "lib/result_store.hpp"
+#include "lib/stats.hpp"
+
+#include <cmath>
+#include <filesystem>
+#include <format>
+#include <map>
+#include <set>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Reader for the json lines result files (lib/result_store.hpp).
+//
+//   results summary <files>... [--over rep query]   one row per configuration
+//   results diff <a> <b> [--over rep]               relative change per configuration of b vs a
+//   results gate <baseline> <candidate>              exit 1 if any configuration regressed or
+//                                                    is missing from either file
+//
+// Records whose params only differ in the --over params are aggregated into one configuration.
+//
+// The gate needs the raw samples of both runs. Per configuration it flags
+//   - a latency shift: one sided Mann-Whitney U test p < alpha and the bootstrap confidence
+//     interval of the median ratio candidate / baseline entirely above 1 + threshold
+//   - a tail regression: the bootstrap confidence interval of the p99 ratio entirely above
+//     1 + threshold
+//   - a recall drop larger than the recall tolerance: the files only keep the mean recall of a
+//     configuration, not the recall of every query, so recall is gated on that tolerance alone
+// Requiring the whole interval above the threshold keeps small but significant changes (common
+// with thousands of samples) from failing the gate. A configuration of either file missing from
+// the other, or no configuration in common, fails the gate too: a truncated or renamed run must
+// not pass by comparing nothing.
+
+struct Aggregate {
+	size_t records = 0;
+	// of the latency samples, "us" unless the params say otherwise
+	std::string unit = "us";
+	Summary summary;
+	std::map<std::string, double> metrics;
+};
+
+using Groups = std::map<std::string, std::vector<const ResultRecord*>>;
+
+/// @brief "key=value key=value" of all params except the ones aggregated over
+std::string group_key(const ResultRecord& record, const std::set<std::string>& over) {
+	std::string key;
+	for(const auto& [name, value] : record.params) {
+		if(!over.contains(name)) {
+			key += std::format("{}{}={}", key.empty() ? "" : " ", name, value);
+		}
+	}
+	return key;
+}
+
+Groups group(const std::vector<ResultSet>& sets, const std::set<std::string>& over) {
+	Groups groups;
+	for(const ResultSet& set : sets) {
+		for(const ResultRecord& record : set.records) {
+			groups[group_key(record, over)].push_back(&record);
+		}
+	}
+	return groups;
+}
+
+/// @brief exact summary if every record kept its samples, pooled summaries otherwise
+Aggregate aggregate(const std::vector<const ResultRecord*>& records) {
+	Aggregate agg;
+	agg.records = records.size();
+	if(!records.empty() && records.front()->params.contains("unit")) {
+		agg.unit = records.front()->params.at("unit");
+	}
+
+	bool all_samples = true;
+	std::vector<double> samples;
+	std::vector<Summary> summaries;
+	for(const ResultRecord* r : records) {
+		all_samples = all_samples && !r->samples.empty();
+		samples.insert(samples.end(), r->samples.begin(), r->samples.end());
+		if(r->summary.count > 0) {
+			summaries.push_back(r->summary);
+		}
+	}
+	agg.summary = all_samples ? summarize(samples) : combine(summaries);
+
+	std::map<std::string, size_t> counts;
+	for(const ResultRecord* r : records) {
+		for(const auto& [name, value] : r->metrics) {
+			if(!std::isnan(value)) {
+				agg.metrics[name] += value;
+				counts[name]++;
+			}
+		}
+	}
+	for(auto& [name, value] : agg.metrics) {
+		value /= counts[name];
+	}
+	return agg;
+}
+
+std::string relative_change(double a, double b) {
+	if(a == 0.0 || std::isnan(a) || std::isnan(b)) {
+		return "     -";
+	}
+	return std::format("{:+6.1f}%", 100.0 * (b - a) / a);
+}
+
+int summary(const std::vector<std::string>& files, const std::set<std::string>& over) {
+	std::vector<ResultSet> sets;
+	for(const std::string& file : files) {
+		sets.push_back(load_results(file));
+	}
+
+	for(const auto& [key, records] : group(sets, over)) {
+		const Aggregate agg = aggregate(records);
+		std::cout << key << std::endl;
+		if(agg.summary.count > 0) {
+			std::cout << std::format("\trecords: {}, samples: {}, mean: {:.1f}{}, "
+									 "stddev: {:.1f}{}, p50: {:.1f}{}, p90: {:.1f}{}, "
+									 "p99: {:.1f}{}, max: {:.1f}{}",
+									 agg.records,
+									 agg.summary.count,
+									 agg.summary.mean,
+									 agg.unit,
+									 agg.summary.stddev(),
+									 agg.unit,
+									 agg.summary.p50,
+									 agg.unit,
+									 agg.summary.p90,
+									 agg.unit,
+									 agg.summary.p99,
+									 agg.unit,
+									 agg.summary.max,
+									 agg.unit)
+					  << std::endl;
+		}
+		for(const auto& [name, value] : agg.metrics) {
+			std::cout << std::format("\t{}: {:.4f}", name, value) << std::endl;
+		}
+	}
+	return 0;
+}
+
+int diff(const std::string& file_a, const std::string& file_b, const std::set<std::string>& over) {
+	const std::vector<ResultSet> a{ load_results(file_a) };
+	const std::vector<ResultSet> b{ load_results(file_b) };
+	const Groups groups_a = group(a, over);
+	const Groups groups_b = group(b, over);
+
+	for(const char* field : { "cpu_model", "governor" }) {
+		const std::string env_a = a[0].env.contains(field) ? a[0].env.at(field) : "unknown";
+		const std::string env_b = b[0].env.contains(field) ? b[0].env.at(field) : "unknown";
+		if(env_a != env_b) {
+			std::cout << std::format("warning: {} differs: '{}' vs '{}'", field, env_a, env_b)
+					  << std::endl;
+		}
+	}
+
+	for(const auto& [key, records_a] : groups_a) {
+		const auto it = groups_b.find(key);
+		if(it == groups_b.end()) {
+			std::cout << std::format("only in {}: {}", file_a, key) << std::endl;
+			continue;
+		}
+		const Aggregate x = aggregate(records_a);
+		const Aggregate y = aggregate(it->second);
+
+		std::cout << key << std::endl;
+		if(x.summary.count > 0 && y.summary.count > 0) {
+			std::cout << std::format("\tmean: {:.1f} -> {:.1f}{} ({}), "
+									 "p50: {:.1f} -> {:.1f}{} ({}), p99: {:.1f} -> {:.1f}{} ({})",
+									 x.summary.mean,
+									 y.summary.mean,
+									 x.unit,
+									 relative_change(x.summary.mean, y.summary.mean),
+									 x.summary.p50,
+									 y.summary.p50,
+									 x.unit,
+									 relative_change(x.summary.p50, y.summary.p50),
+									 x.summary.p99,
+									 y.summary.p99,
+									 x.unit,
+									 relative_change(x.summary.p99, y.summary.p99))
+					  << std::endl;
+		}
+		for(const auto& [name, value] : x.metrics) {
+			const auto other = y.metrics.find(name);
+			if(other != y.metrics.end()) {
+				std::cout << std::format("\t{}: {:.4f} -> {:.4f} ({})",
+										 name,
+										 value,
+										 other->second,
+										 relative_change(value, other->second))
+						  << std::endl;
+			}
+		}
+	}
+	for(const auto& [key, records] : groups_b) {
+		if(!groups_a.contains(key)) {
+			std::cout << std::format("only in {}: {}", file_b, key) << std::endl;
+		}
+	}
+	return 0;
+}
+
+struct GateConfig {
+	double alpha;
+	double threshold;
+	double recall_tolerance;
+	size_t bootstrap;
+	uint64_t seed;
+};
+
+int gate(const std::string& file_a,
+		 const std::string& file_b,
+		 const std::set<std::string>& over,
+		 const GateConfig& config) {
+	const std::vector<ResultSet> a{ load_results(file_a) };
+	const std::vector<ResultSet> b{ load_results(file_b) };
+	const Groups groups_a = group(a, over);
+	const Groups groups_b = group(b, over);
+
+	auto median = [](std::vector<double>& x) { return percentile(x, 0.50); };
+	auto p99 = [](std::vector<double>& x) { return percentile(x, 0.99); };
+	const double confidence = 1.0 - config.alpha;
+
+	size_t compared = 0, regressions = 0, skipped = 0, missing = 0;
+	for(const auto& [key, records_a] : groups_a) {
+		const auto it = groups_b.find(key);
+		if(it == groups_b.end()) {
+			std::cout << std::format("MISSING    {} (not in {})", key, file_b) << std::endl;
+			missing++;
+			continue;
+		}
+		const Aggregate x = aggregate(records_a);
+		const Aggregate y = aggregate(it->second);
+		compared++;
+
+		std::vector<std::string> problems;
+		std::vector<double> samples_a, samples_b;
+		for(const ResultRecord* r : records_a) {
+			samples_a.insert(samples_a.end(), r->samples.begin(), r->samples.end());
+		}
+		for(const ResultRecord* r : it->second) {
+			samples_b.insert(samples_b.end(), r->samples.begin(), r->samples.end());
+		}
+
+		std::string latency = "no samples";
+		if(!samples_a.empty() && !samples_b.empty()) {
+			const double p_value = mann_whitney_greater(samples_a, samples_b);
+			const auto median_ci = bootstrap_ratio_ci(
+				samples_a, samples_b, median, config.bootstrap, confidence, config.seed);
+			const auto p99_ci = bootstrap_ratio_ci(
+				samples_a, samples_b, p99, config.bootstrap, confidence, config.seed);
+			latency = std::format("p50 x[{:.3f}, {:.3f}], p99 x[{:.3f}, {:.3f}], mann-whitney "
+								  "p = {:.2g}",
+								  median_ci.first,
+								  median_ci.second,
+								  p99_ci.first,
+								  p99_ci.second,
+								  p_value);
+			if(p_value < config.alpha && median_ci.first > 1.0 + config.threshold) {
+				problems.push_back("latency shift");
+			}
+			if(p99_ci.first > 1.0 + config.threshold) {
+				problems.push_back("tail regression");
+			}
+		} else if(x.summary.count > 0 || y.summary.count > 0) {
+			skipped++;
+		}
+
+		const double recall_a = x.metrics.contains("recall") ? x.metrics.at("recall") : NAN;
+		const double recall_b = y.metrics.contains("recall") ? y.metrics.at("recall") : NAN;
+		if(recall_b < recall_a - config.recall_tolerance) {
+			problems.push_back("recall drop");
+		}
+
+		if(!problems.empty()) {
+			regressions++;
+		}
+		std::cout << std::format("{} {}", problems.empty() ? "ok        " : "REGRESSED ", key)
+				  << std::endl;
+		std::cout << std::format("\t{}, recall {:.4f} -> {:.4f}", latency, recall_a, recall_b)
+				  << std::endl;
+		for(const std::string& problem : problems) {
+			std::cout << "\t" << problem << std::endl;
+		}
+	}
+
+	for(const auto& [key, records] : groups_b) {
+		if(!groups_a.contains(key)) {
+			std::cout << std::format("MISSING    {} (not in {})", key, file_a) << std::endl;
+			missing++;
+		}
+	}
+
+	std::cout << std::format("{} configurations compared, {} regressed, {} missing, {} without "
+							 "samples",
+							 compared,
+							 regressions,
+							 missing,
+							 skipped)
+			  << std::endl;
+	if(skipped > 0) {
+		std::cout << "warning: latency is only gated on configurations with raw samples on both "
+					 "sides (bench_st_sq without --summary-only, run_experiments raw_samples = 1)"
+				  << std::endl;
+	}
+	if(compared == 0) {
+		std::cout << "error: no configuration in common" << std::endl;
+	}
+	return regressions > 0 || missing > 0 || compared == 0 ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+	argparse::ArgumentParser program("results");
+
+	argparse::ArgumentParser summary_command("summary");
+	summary_command.add_description("aggregate result files per configuration");
+	summary_command.add_argument("files").help("json lines result files").nargs(
+		argparse::nargs_pattern::at_least_one);
+	summary_command.add_argument("--over")
+		.help("params to aggregate over")
+		.default_value(std::vector<std::string>{ "rep" })
+		.nargs(argparse::nargs_pattern::any);
+
+	argparse::ArgumentParser diff_command("diff");
+	diff_command.add_description("compare two result files per configuration");
+	diff_command.add_argument("a").help("baseline result file");
+	diff_command.add_argument("b").help("candidate result file");
+	diff_command.add_argument("--over")
+		.help("params to aggregate over")
+		.default_value(std::vector<std::string>{ "rep" })
+		.nargs(argparse::nargs_pattern::any);
+
+	argparse::ArgumentParser gate_command("gate");
+	gate_command.add_description("fail if the candidate regressed against the baseline or the two "
+								 "files do not have the same configurations");
+	gate_command.add_argument("baseline").help("baseline result file");
+	gate_command.add_argument("candidate").help("candidate result file");
+	gate_command.add_argument("--over")
+		.help("params to aggregate over")
+		.default_value(std::vector<std::string>{ "rep" })
+		.nargs(argparse::nargs_pattern::any);
+	gate_command.add_argument("--alpha")
+		.help("significance level, the confidence intervals are 1 - alpha")
+		.default_value(0.01)
+		.scan<'g', double>();
+	gate_command.add_argument("--threshold")
+		.help("relative slowdown that counts as a regression")
+		.default_value(0.05)
+		.scan<'g', double>();
+	gate_command.add_argument("--recall-tolerance")
+		.help("absolute drop of the mean recall that counts as a regression (recall has no "
+			  "statistical test, the files keep no per query recall)")
+		.default_value(0.005)
+		.scan<'g', double>();
+	gate_command.add_argument("--bootstrap")
+		.help("bootstrap resamples")
+		.default_value(2000)
+		.scan<'i', int>();
+	gate_command.add_argument("--seed").default_value(42).scan<'i', int>();
+
+	program.add_subparser(summary_command);
+	program.add_subparser(diff_command);
+	program.add_subparser(gate_command);
+
+	try {
+		program.parse_args(argc, argv);
+	} catch(const std::exception& err) {
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		return 1;
+	}
+
+	if(program.is_subcommand_used(summary_command)) {
+		const auto over = summary_command.get<std::vector<std::string>>("--over");
+		return summary(summary_command.get<std::vector<std::string>>("files"),
+					   std::set<std::string>(over.begin(), over.end()));
+	}
+	if(program.is_subcommand_used(diff_command)) {
+		const auto over = diff_command.get<std::vector<std::string>>("--over");
+		return diff(diff_command.get<std::string>("a"),
+					diff_command.get<std::string>("b"),
+					std::set<std::string>(over.begin(), over.end()));
+	}
+	if(program.is_subcommand_used(gate_command)) {
+		const auto over = gate_command.get<std::vector<std::string>>("--over");
+		const GateConfig config{ gate_command.get<double>("--alpha"),
+								 gate_command.get<double>("--threshold"),
+								 gate_command.get<double>("--recall-tolerance"),
+								 static_cast<size_t>(gate_command.get<int>("--bootstrap")),
+								 static_cast<uint64_t>(gate_command.get<int>("--seed")) };
+		return gate(gate_command.get<std::string>("baseline"),
+					gate_command.get<std::string>("candidate"),
+					std::set<std::string>(over.begin(), over.end()),
+					config);
+	}
+	std::cerr << program;
+	return 1;
+}
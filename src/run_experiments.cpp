@@ -0,0 +1,423 @@
+#include "lib/argparser.hpp"
+#include "lib/distance.hpp"
+#include "lib/embeddings.hpp"
+#include "lib/experiment.hpp"
+#include "lib/isolation.hpp"
+#include "lib/pca.hpp"
+#include "lib/recall.hpp"
+#include "lib/result_store.hpp"
+#include "lib/search.hpp"
+#include "lib/utils.hpp"
+#include "lib/workload.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <hnswlib/hnswlib.h>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+namespace chrono = std::chrono;
+namespace fs = std::filesystem;
+
+// Runs every [experiment] of a spec file (see lib/experiment.hpp) as a grid over
+// indexes x pca_dim x ef x k x threads x repetitions. Datasets and indexes are loaded once and
+// shared by all cells and experiments of the run, so a sweep costs one load per index instead of
+// one per cell. A pca_dim other than 0 searches the index of the section projected to that many
+// dims (lib/pca.hpp), reranked with the full base vectors.
+
+struct Dataset {
+	const SpecSection& section;
+	std::unique_ptr<const Embedding<float>> base;
+	std::unique_ptr<const Embedding<float>> query;
+	std::unique_ptr<const Embedding<int>> groundtruth;
+
+	fs::path file(const std::string& key, const std::string& default_name) const {
+		return fs::path(section.get("dir", ".")) / section.get(key, default_name);
+	}
+
+	const Embedding<float>& get_base() {
+		if(!base) {
+			std::cout << std::format("loading base of dataset {}", section.name) << std::endl;
+			base.reset(
+				new Embedding<float>(load_gist_960<float>(file("base", "gist_base.fvecs"))));
+		}
+		return *base;
+	}
+
+	const Embedding<float>& get_query() {
+		if(!query) {
+			query.reset(
+				new Embedding<float>(load_gist_960<float>(file("query", "gist_query.fvecs"))));
+		}
+		return *query;
+	}
+
+	const Embedding<int>& get_groundtruth() {
+		if(!groundtruth) {
+			groundtruth.reset(new Embedding<int>(
+				load_gist_960<int>(file("groundtruth", "gist_groundtruth.ivecs"))));
+		}
+		return *groundtruth;
+	}
+};
+
+struct LoadedIndex {
+	std::string dataset;
+	std::unique_ptr<hnswlib::SpaceInterface<float>> space;
+	std::unique_ptr<hnswlib::HierarchicalNSW<float>> hnsw;
+	// a pca index: queries are projected, the ef candidates reranked with the base vectors
+	std::optional<PcaProjection> projection;
+	std::unique_ptr<HnswSearcher> searcher;
+
+	HnswSearcher::Result search(const float* query, size_t k) const {
+		return searcher ? searcher->search(query, k) : hnsw->searchKnn(query, k);
+	}
+};
+
+class Runner {
+public:
+	explicit Runner(const ExperimentSpec& spec)
+		: spec_(spec) {}
+
+	Dataset& dataset(const std::string& name) {
+		auto it = datasets_.find(name);
+		if(it == datasets_.end()) {
+			it = datasets_.emplace(name, std::make_unique<Dataset>(spec_.find("dataset", name)))
+					 .first;
+		}
+		return *it->second;
+	}
+
+	/// @brief load the index from `path`, or build it from the dataset (and `save` it if given)
+	/// @param pca_dim if not 0, the index over the vectors projected to `pca_dim` dims instead,
+	/// at `path` with a _pca<dim> suffix and with its projection next to it
+	LoadedIndex& index(const std::string& name, size_t pca_dim) {
+		const std::string key = pca_dim > 0 ? std::format("{}_pca{}", name, pca_dim) : name;
+		auto it = indexes_.find(key);
+		if(it != indexes_.end()) {
+			return *it->second;
+		}
+
+		const SpecSection& section = spec_.find("index", name);
+		auto loaded = std::make_unique<LoadedIndex>();
+		loaded->dataset = section.get("dataset");
+		Dataset& data = dataset(loaded->dataset);
+		const size_t dim = data.get_query().dim;
+
+		std::optional<fs::path> path;
+		if(section.has("path")) {
+			path = section.get("path");
+			if(pca_dim > 0) {
+				path->replace_filename(std::format(
+					"{}_pca{}{}", path->stem().string(), pca_dim, path->extension().string()));
+			}
+		}
+
+		if(pca_dim > 0) {
+			if(section.get("space", "l2") != "l2") {
+				throw std::runtime_error(std::format("index {}: pca needs an l2 index", name));
+			}
+			if(path && fs::exists(pca_projection_path(*path))) {
+				loaded->projection.emplace(PcaProjection::load(pca_projection_path(*path)));
+			} else {
+				// a strided sample of the base set, as build_hnsw trains it
+				const Embedding<float>& base = data.get_base();
+				const size_t n = std::min<size_t>(section.get_as<size_t>("pca_train", 100000),
+												  base.nb);
+				const size_t stride = base.nb / std::max<size_t>(n, 1);
+				std::vector<float> sample(n * dim);
+				for(size_t i = 0; i < n; i++) {
+					std::copy_n(base.data.get() + i * stride * dim, dim, sample.data() + i * dim);
+				}
+				std::cout << std::format("training pca projection of index {} to {} dims on {}",
+										 name,
+										 pca_dim,
+										 n)
+						  << std::endl;
+				loaded->projection.emplace(PcaProjection::train(sample.data(), n, dim, pca_dim));
+			}
+		}
+		const size_t index_dim = pca_dim > 0 ? pca_dim : dim;
+
+		if(section.get("space", "l2") == "ip") {
+			loaded->space = std::make_unique<DispatchedIpSpace>(index_dim);
+		} else {
+			loaded->space = std::make_unique<DispatchedL2Space>(index_dim);
+		}
+
+		if(path && fs::exists(*path)) {
+			std::cout << std::format("loading from file: {}", path->string()) << std::endl;
+			loaded->hnsw = std::make_unique<hnswlib::HierarchicalNSW<float>>(loaded->space.get(),
+																			 path->string());
+		} else {
+			const Embedding<float>& base = data.get_base();
+			const size_t m = section.get_as<size_t>("M", 32);
+			const size_t ef_construction = section.get_as<size_t>("efc", 200);
+			std::cout << std::format(
+							 "building index {} (M = {}, efc = {})", key, m, ef_construction)
+					  << std::endl;
+			loaded->hnsw = std::make_unique<hnswlib::HierarchicalNSW<float>>(
+				loaded->space.get(), base.nb, m, ef_construction);
+			ParallelFor(0, base.nb, 0, [&](size_t row, size_t) {
+				const float* point = base.data.get() + base.dim * row;
+				if(loaded->projection) {
+					thread_local std::vector<float> projected;
+					projected.resize(index_dim);
+					loaded->projection->project(point, projected.data());
+					loaded->hnsw->addPoint(projected.data(), row);
+				} else {
+					loaded->hnsw->addPoint(point, row);
+				}
+			});
+			if(path) {
+				loaded->hnsw->saveIndex(path->string());
+				if(loaded->projection) {
+					loaded->projection->save(pca_projection_path(*path));
+				}
+			}
+		}
+
+		if(loaded->projection) {
+			loaded->searcher = std::make_unique<HnswSearcher>(*loaded->hnsw, SearchMode::hnswlib);
+			loaded->searcher->use_query_coder(*loaded->projection, data.get_base().data.get());
+		}
+		return *indexes_.emplace(key, std::move(loaded)).first->second;
+	}
+
+	void run(const SpecSection& experiment) {
+		const auto index_names = experiment.get_list<std::string>("indexes", {});
+		const std::vector<int> pca_grid = experiment.get_list<int>("pca_dim", { 0 });
+		const std::vector<int> ef_grid = experiment.get_list<int>("ef", { 100 });
+		const std::vector<int> k_grid = experiment.get_list<int>("k", { 100 });
+		const std::vector<int> thread_grid = experiment.get_list<int>("threads", { 1 });
+		const int repetitions = experiment.get_as<int>("repetitions", 1);
+		const WorkloadConfig workload_config = workload_config_from(experiment);
+		const fs::path output = experiment.get("output", "./results");
+		const bool raw_samples = experiment.get_as<int>("raw_samples", 0) != 0;
+
+		fs::create_directories(output);
+		const fs::path csv_filename = output / std::format("experiment_{}.csv", experiment.name);
+		std::cout << std::format("experiment {}: {} indexes x {} pca dims x {} ef x {} k x {} "
+								 "threads x {} reps",
+								 experiment.name,
+								 index_names.size(),
+								 pca_grid.size(),
+								 ef_grid.size(),
+								 k_grid.size(),
+								 thread_grid.size(),
+								 repetitions)
+				  << std::endl;
+
+		std::ofstream fout(csv_filename);
+		if(!fout.is_open()) {
+			std::cerr << "cannot open file: " << csv_filename << std::endl;
+			return;
+		}
+		const EnvironmentInfo env = capture_environment(sched_getcpu());
+		write_environment(fout, env);
+		ResultWriter results(
+			output / std::format("experiment_{}.jsonl", experiment.name), env, raw_samples);
+		fout << "index, pca_dim, ef, k, threads, rep, queries, qps, mean (us), p50 (us), p95 (us), "
+				"p99 (us), recall, index (MB)\n";
+
+		std::vector<std::pair<std::string, size_t>> indexes;
+		for(const std::string& index_name : index_names) {
+			for(const int pca_dim : pca_grid) {
+				indexes.emplace_back(index_name, pca_dim);
+			}
+		}
+
+		for(const auto& [index_name, pca_dim] : indexes) {
+			LoadedIndex& loaded = index(index_name, pca_dim);
+			Dataset& data = dataset(loaded.dataset);
+			const RecallEvaluator evaluator(data.get_groundtruth());
+			const HnswMemory memory = hnsw_memory(*loaded.hnsw);
+			const double index_mb = (memory.level0 + memory.upper) / 1e6;
+
+			// one workload per dataset and experiment, shared by every cell
+			std::unique_ptr<Workload> workload =
+				workload_config.num_perturbed > 0
+					? generate_workload(data.get_query(), &data.get_base(), workload_config)
+					: generate_workload(data.get_query(), nullptr, workload_config);
+
+			for(const int ef : ef_grid) {
+				loaded.hnsw->setEf(ef);
+				for(const int k : k_grid) {
+					for(const int threads : thread_grid) {
+						for(int rep = 0; rep < repetitions; rep++) {
+							const CellResult cell =
+								run_cell(loaded, *workload, evaluator, k, threads);
+							std::cout << std::format("\t{} pca_dim={} ef={} k={} threads={} "
+													 "rep={}: qps {:.1f}, mean {:.1f}us, "
+													 "p99 {:.1f}us, recall {:.4f}",
+													 index_name,
+													 pca_dim,
+													 ef,
+													 k,
+													 threads,
+													 rep,
+													 cell.qps,
+													 cell.mean_us,
+													 cell.p99_us,
+													 cell.recall)
+									  << std::endl;
+							fout << std::format(
+								"{}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {}\n",
+								index_name,
+								pca_dim,
+								ef,
+								k,
+								threads,
+								rep,
+								workload->sequence.size(),
+								cell.qps,
+								cell.mean_us,
+								cell.p50_us,
+								cell.p95_us,
+								cell.p99_us,
+								cell.recall,
+								index_mb);
+
+							// the graph and the vectors it traverses, not the base set a pca
+							// index reranks with
+							std::map<std::string, double> metrics{ { "qps", cell.qps },
+																   { "index_mb", index_mb } };
+							if(cell.recall >= 0.0) {
+								metrics["recall"] = cell.recall;
+							}
+							results.write({ { "bench", "run_experiments" },
+											{ "experiment", experiment.name },
+											{ "index", index_name },
+											{ "pca_dim", std::to_string(pca_dim) },
+											{ "ef", std::to_string(ef) },
+											{ "k", std::to_string(k) },
+											{ "threads", std::to_string(threads) },
+											{ "rep", std::to_string(rep) },
+											{ "workload", experiment.get("workload", "uniform") } },
+										  cell.latency_us,
+										  metrics);
+						}
+					}
+				}
+			}
+		}
+		std::cout << "wrote: " << csv_filename.string() << std::endl;
+	}
+
+private:
+	struct CellResult {
+		double qps;
+		double mean_us;
+		double p50_us;
+		double p95_us;
+		double p99_us;
+		// mean over the queries that have ground truth, -1 if none do
+		double recall;
+		// in workload order
+		std::vector<double> latency_us;
+	};
+
+	/// @brief issue the whole workload from `threads` threads
+	CellResult run_cell(const LoadedIndex& loaded,
+						const Workload& workload,
+						const RecallEvaluator& evaluator,
+						size_t k,
+						size_t threads) {
+		const size_t n = workload.sequence.size();
+		if(n == 0) {
+			throw std::runtime_error("empty workload, num_queries must be at least 1");
+		}
+		std::vector<double> latency_us(n);
+		std::vector<double> recall(n, -1.0);
+		// kept per query and scored after the loop, the recall is not part of the timed span
+		std::vector<HnswSearcher::Result> results(n);
+		std::vector<chrono::steady_clock::time_point> started(n), finished(n);
+
+		ParallelFor(0, n, threads, [&](size_t seq, size_t) {
+			const size_t pool_id = workload.sequence[seq];
+			started[seq] = chrono::steady_clock::now();
+			auto result = loaded.search(workload.query(pool_id), k);
+			finished[seq] = chrono::steady_clock::now();
+			latency_us[seq] =
+				chrono::duration<double, std::micro>(finished[seq] - started[seq]).count();
+			results[seq] = std::move(result);
+		});
+
+		// wall time from the first start to the last finish, ParallelFor's progress printer
+		// would inflate a timer around the call
+		const double seconds =
+			chrono::duration<double>(*std::max_element(finished.begin(), finished.end()) -
+									 *std::min_element(started.begin(), started.end()))
+				.count();
+
+		if(k <= evaluator.depth()) {
+			for(size_t seq = 0; seq < n; seq++) {
+				const size_t pool_id = workload.sequence[seq];
+				if(pool_id < workload.num_original) {
+					recall[seq] =
+						evaluator.evaluate(pool_id, to_sorted_result(std::move(results[seq])), k)
+							.recall;
+				}
+			}
+		}
+		double recall_sum = 0.0;
+		size_t recall_count = 0;
+		for(const double r : recall) {
+			if(r >= 0.0) {
+				recall_sum += r;
+				recall_count++;
+			}
+		}
+
+		CellResult cell;
+		cell.latency_us = latency_us;
+		cell.qps = n / seconds;
+		cell.mean_us = std::accumulate(latency_us.begin(), latency_us.end(), 0.0) / n;
+		std::sort(latency_us.begin(), latency_us.end());
+		cell.p50_us = latency_us[n / 2];
+		cell.p95_us = latency_us[n * 95 / 100];
+		cell.p99_us = latency_us[n * 99 / 100];
+		cell.recall = recall_count ? recall_sum / recall_count : -1.0;
+		return cell;
+	}
+
+	const ExperimentSpec& spec_;
+	std::map<std::string, std::unique_ptr<Dataset>> datasets_;
+	std::map<std::string, std::unique_ptr<LoadedIndex>> indexes_;
+};
+
+int main(int argc, char** argv) {
+	argparse::ArgumentParser program("run_experiments");
+
+	program.add_argument("spec").help("path to experiment spec (see experiments/gist.ini)");
+	program.add_argument("--only")
+		.help("only run the experiments with these names")
+		.default_value(std::vector<std::string>{})
+		.nargs(argparse::nargs_pattern::any);
+
+	try {
+		program.parse_args(argc, argv);
+	} catch(const std::exception& err) {
+		std::cerr << err.what() << std::endl;
+		std::cerr << program;
+		return 1;
+	}
+
+	const ExperimentSpec spec = ExperimentSpec::load(program.get<std::string>("spec"));
+	const auto only = program.get<std::vector<std::string>>("--only");
+
+	Runner runner(spec);
+	for(const SpecSection* experiment : spec.of_type("experiment")) {
+		if(only.empty() || std::find(only.begin(), only.end(), experiment->name) != only.end()) {
+			runner.run(*experiment);
+		}
+	}
+
+	return 0;
+}